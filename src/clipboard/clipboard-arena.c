@@ -0,0 +1,355 @@
+#include "clipboard-arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Texts longer than a chunk get one of their own
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_INITIAL_STRINGS 64
+// Smaller holes are not worth moving every text for
+#define ARENA_COMPACT_MIN (64 * 1024)
+
+static uint32_t text_hash(const char* text, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+    return hash;
+}
+
+ClipboardArena* arena_new(void) {
+    ClipboardArena* arena = calloc(1, sizeof(ClipboardArena));
+    if (!arena) return NULL;
+
+    arena->index_capacity = ARENA_INITIAL_STRINGS;
+    arena->index = calloc(arena->index_capacity, sizeof(uint32_t));
+    if (!arena->index) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->free_string = ARENA_NONE;
+    atomic_init(&arena->epoch, 0);
+    atomic_init(&arena->readers[0], 0);
+    atomic_init(&arena->readers[1], 0);
+    atomic_init(&arena->refs, 1);
+    atomic_init(&arena->lock, 0);
+    return arena;
+}
+
+static void retired_free(ArenaRetired* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    list->count = 0;
+}
+
+ClipboardArena* arena_ref(ClipboardArena* arena) {
+    atomic_fetch_add(&arena->refs, 1);
+    return arena;
+}
+
+void arena_unref(ClipboardArena* arena) {
+    if (!arena || atomic_fetch_sub(&arena->refs, 1) != 1) return;
+
+    for (uint16_t i = 0; i < arena->mimes_size; i++) {
+        free(arena->mimes[i]);
+    }
+    free(arena->mimes);
+    for (uint32_t i = 0; i < arena->chunk_count; i++) {
+        free(arena->chunks[i]);
+    }
+    free(arena->chunks);
+    for (int i = 0; i < 2; i++) {
+        retired_free(&arena->retired[i]);
+        free(arena->retired[i].items);
+    }
+    free(arena->strings);
+    free(arena->index);
+    free(arena);
+}
+
+void arena_lock(ClipboardArena* arena) {
+    while (atomic_exchange(&arena->lock, 1)) __builtin_ia32_pause();
+}
+
+void arena_unlock(ClipboardArena* arena) {
+    atomic_store(&arena->lock, 0);
+}
+
+// If the queue cannot grow, ptr is leaked rather than freed under a reader.
+void arena_retire(ClipboardArena* arena, void* ptr) {
+    if (!ptr) return;
+
+    ArenaRetired* list = &arena->retired[atomic_load(&arena->epoch) & 1];
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 16;
+        void** items = realloc(list->items, new_capacity * sizeof(void*));
+        if (!items) return;
+        list->items = items;
+        list->capacity = new_capacity;
+    }
+    list->items[list->count++] = ptr;
+}
+
+// Readers count themselves under the parity of the epoch they pinned and
+// retry if it moved on meanwhile, so a writer that finds the previous
+// parity at zero knows every reader of that epoch has left.
+int arena_read_begin(ClipboardArena* arena) {
+    for (;;) {
+        uint64_t epoch = atomic_load(&arena->epoch);
+        atomic_fetch_add(&arena->readers[epoch & 1], 1);
+        if (atomic_load(&arena->epoch) == epoch) return (int)(epoch & 1);
+        atomic_fetch_sub(&arena->readers[epoch & 1], 1);
+    }
+}
+
+void arena_read_end(ClipboardArena* arena, int parity) {
+    atomic_fetch_sub_explicit(&arena->readers[parity], 1, memory_order_release);
+}
+
+// Frees what was retired two epochs ago and starts a new epoch, unless a
+// reader of the previous one is still inside; then a later write tries
+// again.
+static void reclaim(ClipboardArena* arena) {
+    uint64_t epoch = atomic_load(&arena->epoch);
+    if (atomic_load(&arena->readers[(epoch + 1) & 1]) != 0) return;
+
+    retired_free(&arena->retired[(epoch + 1) & 1]);
+    atomic_store(&arena->epoch, epoch + 1);
+}
+
+static size_t find_index_slot(const ClipboardArena* arena, const char* text, size_t len, uint32_t hash) {
+    size_t mask = arena->index_capacity - 1;
+    size_t slot = hash & mask;
+
+    while (arena->index[slot] != 0) {
+        const ArenaString* string = &arena->strings[arena->index[slot] - 1];
+        if (string->hash == hash && string->len == len &&
+            memcmp(string->text, text, len) == 0) {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Keeps the index at most 3/4 full, counting every string ever allocated.
+static bool reserve_index(ClipboardArena* arena) {
+    if ((size_t)(arena->strings_size + 1) * 4 <= arena->index_capacity * 3) return true;
+
+    size_t new_capacity = arena->index_capacity * 2;
+    uint32_t* new_index = calloc(new_capacity, sizeof(uint32_t));
+    if (!new_index) return false;
+
+    size_t mask = new_capacity - 1;
+    for (uint32_t i = 0; i < arena->strings_size; i++) {
+        if (arena->strings[i].refs == 0) continue;
+        size_t slot = arena->strings[i].hash & mask;
+        while (new_index[slot] != 0) slot = (slot + 1) & mask;
+        new_index[slot] = i + 1;
+    }
+
+    free(arena->index);
+    arena->index = new_index;
+    arena->index_capacity = new_capacity;
+    return true;
+}
+
+// Same backward shift as the clipboard table's delete_slot.
+static void delete_index_slot(ClipboardArena* arena, size_t slot) {
+    size_t mask = arena->index_capacity - 1;
+    size_t hole = slot;
+
+    for (size_t next = (slot + 1) & mask; arena->index[next] != 0; next = (next + 1) & mask) {
+        size_t home = arena->strings[arena->index[next] - 1].hash & mask;
+        if (((next - home) & mask) < ((next - hole) & mask)) continue;
+
+        arena->index[hole] = arena->index[next];
+        hole = next;
+    }
+
+    arena->index[hole] = 0;
+}
+
+// Returns room for size bytes, in a new chunk if the last one is full.
+// What is left of that one stays unused until compaction.
+static char* reserve_data(ClipboardArena* arena, size_t size) {
+    if (arena->chunk_count > 0 && arena->chunk_used + size <= ARENA_CHUNK_SIZE) {
+        return arena->chunks[arena->chunk_count - 1] + arena->chunk_used;
+    }
+
+    if (arena->chunk_count == arena->chunk_capacity) {
+        uint32_t new_capacity = arena->chunk_capacity ? arena->chunk_capacity * 2 : 8;
+        char** new_chunks = realloc(arena->chunks, new_capacity * sizeof(char*));
+        if (!new_chunks) return NULL;
+        arena->chunks = new_chunks;
+        arena->chunk_capacity = new_capacity;
+    }
+
+    char* chunk = malloc(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+    if (!chunk) return NULL;
+    arena->chunks[arena->chunk_count++] = chunk;
+    arena->chunk_used = 0;
+    return chunk;
+}
+
+static uint32_t new_string(ClipboardArena* arena) {
+    if (arena->free_string != ARENA_NONE) {
+        uint32_t handle = arena->free_string;
+        arena->free_string = arena->strings[handle].next_free;
+        return handle;
+    }
+
+    if (arena->strings_size == arena->strings_capacity) {
+        uint32_t new_capacity = arena->strings_capacity ? arena->strings_capacity * 2 : ARENA_INITIAL_STRINGS;
+        ArenaString* new_strings = realloc(arena->strings, new_capacity * sizeof(ArenaString));
+        if (!new_strings) return ARENA_NONE;
+        arena->strings = new_strings;
+        arena->strings_capacity = new_capacity;
+    }
+    return arena->strings_size++;
+}
+
+static uint32_t intern_locked(ClipboardArena* arena, const char* text, size_t len, uint32_t hash) {
+    if (!reserve_index(arena)) return ARENA_NONE;
+
+    size_t slot = find_index_slot(arena, text, len, hash);
+    if (arena->index[slot] != 0) {
+        uint32_t handle = arena->index[slot] - 1;
+        arena->strings[handle].refs++;
+        return handle;
+    }
+
+    char* data = reserve_data(arena, len + 1);
+    if (!data) return ARENA_NONE;
+    uint32_t handle = new_string(arena);
+    if (handle == ARENA_NONE) return ARENA_NONE;
+
+    ArenaString* string = &arena->strings[handle];
+    string->text = data;
+    string->len = len;
+    string->hash = hash;
+    string->refs = 1;
+
+    memcpy(data, text, len);
+    data[len] = '\0';
+    arena->chunk_used += len + 1;
+    arena->used += len + 1;
+    arena->index[slot] = handle + 1;
+    return handle;
+}
+
+uint32_t arena_intern(ClipboardArena* arena, const char* text, size_t len) {
+    uint32_t hash = text_hash(text, len);
+
+    arena_lock(arena);
+    uint32_t handle = intern_locked(arena, text, len, hash);
+    reclaim(arena);
+    arena_unlock(arena);
+    return handle;
+}
+
+// Copies the live texts into new chunks, in handle order, and retires
+// the old ones.
+static void compact(ClipboardArena* arena) {
+    char** old_chunks = arena->chunks;
+    uint32_t old_count = arena->chunk_count;
+    uint32_t old_capacity = arena->chunk_capacity;
+    size_t old_used = arena->chunk_used;
+    char** old_texts = malloc(arena->strings_size * sizeof(char*));
+    if (!old_texts) return;
+
+    arena->chunks = NULL;
+    arena->chunk_count = 0;
+    arena->chunk_capacity = 0;
+
+    size_t used = 0;
+    for (uint32_t i = 0; i < arena->strings_size; i++) {
+        ArenaString* string = &arena->strings[i];
+        old_texts[i] = string->text;
+        if (string->refs == 0) continue;
+
+        char* data = reserve_data(arena, string->len + 1);
+        if (!data) {
+            // Put everything back as it was
+            for (uint32_t j = 0; j <= i; j++) arena->strings[j].text = old_texts[j];
+            for (uint32_t j = 0; j < arena->chunk_count; j++) free(arena->chunks[j]);
+            free(arena->chunks);
+            arena->chunks = old_chunks;
+            arena->chunk_count = old_count;
+            arena->chunk_capacity = old_capacity;
+            arena->chunk_used = old_used;
+            free(old_texts);
+            return;
+        }
+        memcpy(data, string->text, string->len + 1);
+        string->text = data;
+        arena->chunk_used += string->len + 1;
+        used += string->len + 1;
+    }
+
+    for (uint32_t i = 0; i < old_count; i++) {
+        arena_retire(arena, old_chunks[i]);
+    }
+    free(old_chunks);
+    free(old_texts);
+    arena->used = used;
+    arena->dead = 0;
+    arena->generation++;
+}
+
+void arena_release(ClipboardArena* arena, uint32_t handle) {
+    arena_lock(arena);
+
+    ArenaString* string = &arena->strings[handle];
+    if (--string->refs == 0) {
+        delete_index_slot(arena, find_index_slot(arena, string->text, string->len, string->hash));
+        arena->dead += string->len + 1;
+        string->next_free = arena->free_string;
+        arena->free_string = handle;
+
+        if (arena->dead >= ARENA_COMPACT_MIN && arena->dead * 2 >= arena->used) compact(arena);
+    }
+    reclaim(arena);
+
+    arena_unlock(arena);
+}
+
+uint32_t arena_intern_mime(ClipboardArena* arena, const char* mime) {
+    arena_lock(arena);
+
+    uint32_t id = ARENA_NONE;
+    for (uint16_t i = 0; i < arena->mimes_size; i++) {
+        if (strcmp(arena->mimes[i], mime) == 0) {
+            id = i;
+            break;
+        }
+    }
+
+    if (id == ARENA_NONE && arena->mimes_size < UINT16_MAX) {
+        if (arena->mimes_size == arena->mimes_capacity) {
+            uint32_t new_capacity = arena->mimes_capacity ? arena->mimes_capacity * 2 : 16;
+            if (new_capacity > UINT16_MAX) new_capacity = UINT16_MAX;
+            char** new_mimes = realloc(arena->mimes, new_capacity * sizeof(char*));
+            if (new_mimes) {
+                arena->mimes = new_mimes;
+                arena->mimes_capacity = new_capacity;
+            }
+        }
+
+        char* copy = arena->mimes_size < arena->mimes_capacity ? strdup(mime) : NULL;
+        if (copy) {
+            arena->mimes[arena->mimes_size] = copy;
+            id = arena->mimes_size++;
+        }
+    }
+
+    arena_unlock(arena);
+    return id;
+}
+
+const char* arena_text(const ClipboardArena* arena, uint32_t handle) {
+    return arena->strings[handle].text;
+}
+
+const char* arena_mime(const ClipboardArena* arena, uint16_t mime) {
+    return arena->mimes[mime];
+}
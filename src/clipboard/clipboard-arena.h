@@ -0,0 +1,100 @@
+#ifndef CLIPBOARD_ARENA_H
+#define CLIPBOARD_ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define ARENA_NONE UINT32_MAX
+
+// A refcounted string stored once in the arena, found by its contents
+typedef struct {
+    char* text;
+    uint32_t len;
+    uint32_t hash;
+    // 0 while on the free list, which is chained through `next_free`
+    uint32_t refs;
+    uint32_t next_free;
+} ArenaString;
+
+// Memory compaction retired that readers may still be looking at.
+typedef struct {
+    void** items;
+    size_t count;
+    size_t capacity;
+} ArenaRetired;
+
+// One store for the strings of every clipboard table. Texts are appended
+// to fixed-size chunks once and shared by handle, the index into
+// `strings`, however many tables hold them; a released text leaves a hole
+// that compaction reclaims once holes make up half of `used`. MIME types
+// are few and kept forever in their own table, so entries store them as a
+// 16-bit id.
+//
+// Appending never moves a text. Compaction copies the live ones into new
+// chunks and bumps `generation`; the old chunks are retired and freed once
+// no reader that pinned an earlier epoch with arena_read_begin is left,
+// the same scheme FileTable uses for its views.
+typedef struct {
+    char** chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    // Bytes taken in the last chunk
+    size_t chunk_used;
+    size_t used;
+    size_t dead;
+    uint32_t generation;
+
+    ArenaString* strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    uint32_t free_string;
+
+    // String handle + 1 by hash, linearly probed; 0 is empty
+    uint32_t* index;
+    size_t index_capacity;
+
+    char** mimes;
+    uint16_t mimes_size;
+    uint16_t mimes_capacity;
+
+    _Atomic uint64_t epoch;
+    // Readers inside a read section, by the parity of the epoch they pinned
+    atomic_uint readers[2];
+    ArenaRetired retired[2];
+
+    atomic_int refs;
+    atomic_int lock;
+} ClipboardArena;
+
+ClipboardArena* arena_new(void);
+ClipboardArena* arena_ref(ClipboardArena* arena);
+void arena_unref(ClipboardArena* arena);
+
+void arena_lock(ClipboardArena* arena);
+void arena_unlock(ClipboardArena* arena);
+
+// Both return ARENA_NONE when out of memory. Each successful
+// arena_intern must be matched by one arena_release. The first len bytes
+// of text are stored, with a terminating NUL added.
+uint32_t arena_intern(ClipboardArena* arena, const char* text, size_t len);
+void arena_release(ClipboardArena* arena, uint32_t handle);
+uint32_t arena_intern_mime(ClipboardArena* arena, const char* mime);
+
+// Both need the arena lock held. A text pointer stays valid until the
+// read section it was obtained in ends; a MIME string lasts as long as
+// the arena.
+const char* arena_text(const ClipboardArena* arena, uint32_t handle);
+const char* arena_mime(const ClipboardArena* arena, uint16_t mime);
+
+// Brackets reads of text pointers taken from the arena, or of anything
+// retired through it. Returns the parity to pass to arena_read_end.
+// Writers never wait for readers.
+int arena_read_begin(ClipboardArena* arena);
+void arena_read_end(ClipboardArena* arena, int parity);
+// Frees ptr once no read section that could have reached it is left.
+// Needs the arena lock held.
+void arena_retire(ClipboardArena* arena, void* ptr);
+
+#endif // CLIPBOARD_ARENA_H
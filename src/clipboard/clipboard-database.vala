@@ -11,6 +11,7 @@ namespace Clipboard {
         private Sqlite.Statement case_insensitive_search_stmt;
         private Sqlite.Statement latest_stmt;
         private Sqlite.Statement all_items;
+        private Sqlite.Statement text_stmt;
         private Sqlite.Statement update_timestamp_stmt;
 
         public void update_timestamp(uint item_hash, int64 timestamp) {
@@ -167,6 +168,7 @@ namespace Clipboard {
             case_insensitive_search_stmt = null;
             latest_stmt = null;
             all_items = null;
+            text_stmt = null;
             update_timestamp_stmt = null;
         }
 
@@ -202,11 +204,15 @@ namespace Clipboard {
                 LIMIT 50;
             """);
 
+            // Only the search key and the full length go into memory
             all_items = DatabaseUtils.prepare_statement(db, """
-                SELECT ci.item_hash, ci.timestamp, ci.top_mime, ci.title
+                SELECT ci.item_hash, ci.timestamp, ci.top_mime,
+                       substr(ci.title, 1, %d), length(CAST(ci.title AS BLOB))
                 FROM clipboard_items ci
                 ORDER BY ci.timestamp DESC
-            """);
+            """.printf(ClipboardHash.KEY_CHARS));
+
+            text_stmt = DatabaseUtils.prepare_statement(db, "SELECT title FROM clipboard_items WHERE item_hash = ?;");
 
             update_timestamp_stmt = DatabaseUtils.prepare_statement(db, """
                 UPDATE clipboard_items
@@ -316,15 +322,28 @@ namespace Clipboard {
 
         public unowned Sqlite.Statement get_latest_stmt(int max_recent_entries) {
             latest_stmt = DatabaseUtils.prepare_statement(db, """
-                SELECT ci.item_hash, ci.timestamp, ci.top_mime, ci.title
+                SELECT ci.item_hash, ci.timestamp, ci.top_mime,
+                       substr(ci.title, 1, %d), length(CAST(ci.title AS BLOB))
                 FROM clipboard_items ci
                 ORDER BY ci.timestamp DESC
                 LIMIT ?1;
-            """);
+            """.printf(ClipboardHash.KEY_CHARS));
             latest_stmt.bind_int(1, max_recent_entries);
             return latest_stmt;
         }
 
+        public string? get_text(uint item_hash) {
+            text_stmt.reset();
+            text_stmt.bind_int64(1, item_hash);
+
+            string? text = null;
+            if (text_stmt.step() == Sqlite.ROW) {
+                text = text_stmt.column_text(0);
+            }
+            text_stmt.reset();
+            return text;
+        }
+
         public unowned Sqlite.Statement get_all_items() {
             return all_items;
         }
@@ -12,7 +12,7 @@ static size_t next_power_of_2(size_t x) {
     return x;
 }
 
-static size_t find_slot(uint32_t* hash_to_idx, size_t capacity, uint32_t key, ClipboardEntry* array) {
+static size_t find_slot(uint32_t* hash_to_idx, size_t capacity, uint32_t key, ClipboardRecord* array) {
     size_t mask = capacity - 1;
     size_t slot = key & mask;
 
@@ -26,18 +26,131 @@ static size_t find_slot(uint32_t* hash_to_idx, size_t capacity, uint32_t key, Cl
     return slot;
 }
 
-static void maybe_grow_array(HashTable* ht) {
-    if (ht->size >= ht->array_capacity) {
-        size_t new_capacity = ht->array_capacity * 2;
-        ClipboardEntry* new_array = realloc(ht->array, new_capacity * sizeof(ClipboardEntry));
-        size_t* new_idx_to_hash_slot = realloc(ht->idx_to_hash_slot, new_capacity * sizeof(size_t));
+// Empties slot and pulls later entries of its probe run back into the gap,
+// so no chain is ever broken and no tombstones are needed. An entry moves
+// only when its home slot is not between the gap and where it sits.
+static void delete_slot(HashTable* ht, size_t slot) {
+    size_t mask = ht->capacity - 1;
+    size_t hole = slot;
+
+    for (size_t next = (slot + 1) & mask; ht->hash_to_idx[next] != 0; next = (next + 1) & mask) {
+        size_t idx = ht->hash_to_idx[next] - 1;
+        size_t home = ht->array[idx].primkey & mask;
+        if (((next - home) & mask) < ((next - hole) & mask)) continue;
+
+        ht->hash_to_idx[hole] = ht->hash_to_idx[next];
+        ht->idx_to_hash_slot[idx] = hole;
+        hole = next;
+    }
 
-        if (new_array && new_idx_to_hash_slot) {
-            ht->array = new_array;
-            ht->idx_to_hash_slot = new_idx_to_hash_slot;
-            ht->array_capacity = new_capacity;
-        }
+    ht->hash_to_idx[hole] = 0;
+}
+
+static bool maybe_grow_array(HashTable* ht) {
+    if (ht->size < ht->array_capacity) return true;
+
+    size_t new_capacity = ht->array_capacity * 2;
+    ClipboardRecord* new_array = realloc(ht->array, new_capacity * sizeof(ClipboardRecord));
+    if (new_array) ht->array = new_array;
+    size_t* new_idx_to_hash_slot = realloc(ht->idx_to_hash_slot, new_capacity * sizeof(size_t));
+    if (new_idx_to_hash_slot) ht->idx_to_hash_slot = new_idx_to_hash_slot;
+    ClipboardLink* new_links = realloc(ht->links, new_capacity * sizeof(ClipboardLink));
+    if (new_links) ht->links = new_links;
+
+    if (!new_array || !new_idx_to_hash_slot || !new_links) return false;
+    ht->array_capacity = new_capacity;
+    return true;
+}
+
+static void link_front(HashTable* ht, uint32_t idx) {
+    ht->links[idx].newer = HT_NONE;
+    ht->links[idx].older = ht->newest;
+    if (ht->newest != HT_NONE) ht->links[ht->newest].newer = idx;
+    ht->newest = idx;
+    if (ht->oldest == HT_NONE) ht->oldest = idx;
+}
+
+static void link_back(HashTable* ht, uint32_t idx) {
+    ht->links[idx].older = HT_NONE;
+    ht->links[idx].newer = ht->oldest;
+    if (ht->oldest != HT_NONE) ht->links[ht->oldest].older = idx;
+    ht->oldest = idx;
+    if (ht->newest == HT_NONE) ht->newest = idx;
+}
+
+static void unlink_entry(HashTable* ht, uint32_t idx) {
+    ClipboardLink link = ht->links[idx];
+    if (link.newer != HT_NONE) ht->links[link.newer].older = link.older;
+    else ht->newest = link.older;
+    if (link.older != HT_NONE) ht->links[link.older].newer = link.newer;
+    else ht->oldest = link.newer;
+}
+
+// Moves the last entry of the array into idx, which must be unlinked.
+static void fill_hole(HashTable* ht, size_t idx) {
+    size_t last = ht->size - 1;
+    if (idx == last) return;
+
+    ht->array[idx] = ht->array[last];
+    ht->links[idx] = ht->links[last];
+    ht->idx_to_hash_slot[idx] = ht->idx_to_hash_slot[last];
+    ht->hash_to_idx[ht->idx_to_hash_slot[idx]] = idx + 1;
+
+    ClipboardLink link = ht->links[idx];
+    if (link.newer != HT_NONE) ht->links[link.newer].older = idx;
+    else ht->newest = idx;
+    if (link.older != HT_NONE) ht->links[link.older].newer = idx;
+    else ht->oldest = idx;
+}
+
+// Bytes of text up to the end of its CLIPBOARD_KEY_CHARS-th codepoint
+static size_t key_len(const char* text) {
+    size_t chars = 0;
+    size_t i = 0;
+    for (; text[i]; i++) {
+        // Count lead bytes only, so a codepoint is never split
+        if (((uint8_t)text[i] & 0xC0) != 0x80 && chars++ == CLIPBOARD_KEY_CHARS) break;
     }
+    return i;
+}
+
+// Stores the key and MIME type of an entry, filling record on success.
+static bool intern_strings(HashTable* ht, ClipboardRecord* record, const char* text, const char* content_type) {
+    uint32_t mime = arena_intern_mime(ht->arena, content_type);
+    uint32_t handle = mime != ARENA_NONE ? arena_intern(ht->arena, text, key_len(text)) : ARENA_NONE;
+    if (handle == ARENA_NONE) return false;
+
+    record->key = handle;
+    record->content_type = mime;
+    return true;
+}
+
+// Appends a new entry to the array and the hash, leaving it unlinked.
+static bool add_entry(HashTable* ht, size_t slot, uint32_t primkey, const char* text, uint32_t length,
+                      int64_t timestamp, const char* content_type) {
+    if (!maybe_grow_array(ht)) return false;
+    if (!intern_strings(ht, &ht->array[ht->size], text, content_type)) return false;
+
+    ht->array[ht->size].primkey = primkey;
+    ht->array[ht->size].length = length;
+    ht->array[ht->size].timestamp = timestamp;
+
+    ht->hash_to_idx[slot] = ht->size + 1;
+    ht->idx_to_hash_slot[ht->size] = slot;
+    ht->size++;
+    return true;
+}
+
+// Leaves the entry as it was when the new strings cannot be stored.
+static bool update_entry(HashTable* ht, ClipboardRecord* record, const char* text, uint32_t length,
+                         int64_t timestamp, const char* content_type) {
+    uint32_t old_key = record->key;
+    if (!intern_strings(ht, record, text, content_type)) return false;
+
+    arena_release(ht->arena, old_key);
+    record->length = length;
+    record->timestamp = timestamp;
+    return true;
 }
 
 static void resize_hash(HashTable* ht) {
@@ -66,26 +179,35 @@ static inline void ht_unlock(HashTable* ht) {
     atomic_store(&ht->lock, 0);
 }
 
-HashTable* ht_create(size_t initial_capacity) {
+HashTable* ht_create(size_t initial_capacity, ClipboardArena* arena) {
+    if (!arena) return NULL;
     initial_capacity = next_power_of_2(initial_capacity);
     HashTable* ht = malloc(sizeof(HashTable));
     if (!ht) return NULL;
 
-    ht->array = malloc(initial_capacity * sizeof(ClipboardEntry));
+    ht->array = malloc(initial_capacity * sizeof(ClipboardRecord));
     ht->hash_to_idx = calloc(initial_capacity, sizeof(uint32_t));
     ht->idx_to_hash_slot = malloc(initial_capacity * sizeof(size_t));
+    ht->links = malloc(initial_capacity * sizeof(ClipboardLink));
 
-    if (!ht->array || !ht->hash_to_idx || !ht->idx_to_hash_slot) {
+    if (!ht->array || !ht->hash_to_idx || !ht->idx_to_hash_slot || !ht->links) {
         free(ht->array);
         free(ht->hash_to_idx);
         free(ht->idx_to_hash_slot);
+        free(ht->links);
         free(ht);
         return NULL;
     }
 
+    ht->arena = arena_ref(arena);
     ht->capacity = initial_capacity;
     ht->array_capacity = initial_capacity;
     ht->size = 0;
+    ht->newest = HT_NONE;
+    ht->oldest = HT_NONE;
+    ht->view = NULL;
+    ht->view_stale = true;
+    ht->view_generation = 0;
     atomic_init(&ht->lock, 0);
 
     return ht;
@@ -95,17 +217,24 @@ void ht_destroy(HashTable* ht) {
     if (!ht) return;
 
     for (size_t i = 0; i < ht->size; i++) {
-        free(ht->array[i].text);
-        free(ht->array[i].content_type);
+        arena_release(ht->arena, ht->array[i].key);
     }
+    // A search may still be reading it
+    arena_lock(ht->arena);
+    arena_retire(ht->arena, ht->view);
+    arena_unlock(ht->arena);
+    arena_unref(ht->arena);
 
     free(ht->array);
     free(ht->hash_to_idx);
     free(ht->idx_to_hash_slot);
+    free(ht->links);
     free(ht);
 }
 
-bool ht_insert(HashTable* ht, uint32_t primkey, const char* text, int64_t timestamp, const char* content_type) {
+// Updates an existing entry in place; a new one goes behind all others.
+bool ht_insert(HashTable* ht, uint32_t primkey, const char* text, uint32_t length, int64_t timestamp,
+               const char* content_type) {
     if (!ht || primkey == 0 || !text || !content_type) return false;
     ht_lock(ht);
 
@@ -114,104 +243,46 @@ bool ht_insert(HashTable* ht, uint32_t primkey, const char* text, int64_t timest
     }
 
     size_t slot = find_slot(ht->hash_to_idx, ht->capacity, primkey, ht->array);
+    bool ok = true;
 
     if (ht->hash_to_idx[slot] != 0) {
-        size_t idx = ht->hash_to_idx[slot] - 1;
-        free(ht->array[idx].text);
-        free(ht->array[idx].content_type);
-        ht->array[idx].text = strdup(text);
-        ht->array[idx].content_type = strdup(content_type);
-        ht->array[idx].timestamp = timestamp;
-        ht_unlock(ht);
-        return true;
+        ok = update_entry(ht, &ht->array[ht->hash_to_idx[slot] - 1], text, length, timestamp, content_type);
+    } else if ((ok = add_entry(ht, slot, primkey, text, length, timestamp, content_type))) {
+        link_back(ht, ht->size - 1);
     }
 
-    maybe_grow_array(ht);
-
-    ht->array[ht->size].primkey = primkey;
-    ht->array[ht->size].text = strdup(text);
-    ht->array[ht->size].content_type = strdup(content_type);
-    ht->array[ht->size].timestamp = timestamp;
-
-    ht->hash_to_idx[slot] = ht->size + 1;
-    ht->idx_to_hash_slot[ht->size] = slot;
-    ht->size++;
-
+    ht->view_stale = true;
     ht_unlock(ht);
-    return true;
+    return ok;
 }
 
-bool ht_insert_shift(HashTable* ht, uint32_t primkey, const char* text, int64_t timestamp, const char* content_type) {
+// Inserts or updates the entry and makes it the newest.
+bool ht_insert_shift(HashTable* ht, uint32_t primkey, const char* text, uint32_t length, int64_t timestamp,
+                     const char* content_type) {
     if (!ht || primkey == 0 || !text || !content_type) return false;
 
     ht_lock(ht);
 
-    // If key exists, remove it first
-    size_t slot = find_slot(ht->hash_to_idx, ht->capacity, primkey, ht->array);
-    if (ht->hash_to_idx[slot] != 0) {
-        size_t idx = ht->hash_to_idx[slot] - 1;
-        free(ht->array[idx].text);
-        free(ht->array[idx].content_type);
-
-        memmove(&ht->array[idx], &ht->array[idx + 1],
-                (ht->size - idx - 1) * sizeof(ClipboardEntry));
-        ht->size--;
-
-        // Update hash indices for shifted entries
-        for (size_t i = idx; i < ht->size; i++) {
-            size_t entry_slot = ht->idx_to_hash_slot[i + 1];
-            ht->hash_to_idx[entry_slot] = i + 1;
-            ht->idx_to_hash_slot[i] = entry_slot;
-        }
-    }
-
-    // Check if we need to resize the hash table
     if (ht->size >= ht->capacity * 0.75) {
         resize_hash(ht);
     }
 
-    // Make sure we have enough space in the array
-    maybe_grow_array(ht);
-
-    // Ensure we have room for one more element
-    if (ht->size + 1 > ht->array_capacity) {
-        size_t new_capacity = ht->array_capacity * 2;
-        ClipboardEntry* new_array = realloc(ht->array, new_capacity * sizeof(ClipboardEntry));
-        size_t* new_idx_to_hash_slot = realloc(ht->idx_to_hash_slot, new_capacity * sizeof(size_t));
-
-        if (new_array && new_idx_to_hash_slot) {
-            ht->array = new_array;
-            ht->idx_to_hash_slot = new_idx_to_hash_slot;
-            ht->array_capacity = new_capacity;
-        } else {
-            // Handle allocation failure
-            ht_unlock(ht);
-            return false;
-        }
-    }
-
-    // Shift everything up
-    memmove(&ht->array[1], &ht->array[0], ht->size * sizeof(ClipboardEntry));
+    size_t slot = find_slot(ht->hash_to_idx, ht->capacity, primkey, ht->array);
+    bool ok = true;
 
-    // Update hash indices for all shifted entries
-    for (size_t i = ht->size; i > 0; i--) {
-        size_t entry_slot = ht->idx_to_hash_slot[i - 1];
-        ht->hash_to_idx[entry_slot] = i + 1;
-        ht->idx_to_hash_slot[i] = entry_slot;
+    if (ht->hash_to_idx[slot] != 0) {
+        uint32_t idx = ht->hash_to_idx[slot] - 1;
+        if ((ok = update_entry(ht, &ht->array[idx], text, length, timestamp, content_type))) {
+            unlink_entry(ht, idx);
+            link_front(ht, idx);
+        }
+    } else if ((ok = add_entry(ht, slot, primkey, text, length, timestamp, content_type))) {
+        link_front(ht, ht->size - 1);
     }
 
-    // Insert at front
-    ht->array[0].primkey = primkey;
-    ht->array[0].text = strdup(text);
-    ht->array[0].content_type = strdup(content_type);
-    ht->array[0].timestamp = timestamp;
-
-    ht->hash_to_idx[slot] = 1;
-    ht->idx_to_hash_slot[0] = slot;
-    ht->size++;
-
+    ht->view_stale = true;
     ht_unlock(ht);
-    return true;
+    return ok;
 }
 
 bool ht_remove(HashTable* ht, uint32_t key) {
@@ -227,75 +298,77 @@ bool ht_remove(HashTable* ht, uint32_t key) {
 
     size_t idx = ht->hash_to_idx[slot] - 1;
 
-    free(ht->array[idx].text);
-    free(ht->array[idx].content_type);
-
-    if (idx < ht->size - 1) {
-        ht->array[idx] = ht->array[ht->size - 1];
-        size_t moved_slot = ht->idx_to_hash_slot[ht->size - 1];
-        ht->hash_to_idx[moved_slot] = idx + 1;
-        ht->idx_to_hash_slot[idx] = moved_slot;
-    }
+    arena_release(ht->arena, ht->array[idx].key);
 
-    ht->hash_to_idx[slot] = 0;
+    unlink_entry(ht, idx);
+    delete_slot(ht, slot);
+    fill_hole(ht, idx);
     ht->size--;
 
+    ht->view_stale = true;
     ht_unlock(ht);
     return true;
 }
 
+// The recency order survives any removal now, so this is ht_remove.
 bool ht_remove_shift(HashTable* ht, uint32_t key) {
-    if (!ht || key == 0) return false;
-
-    ht_lock(ht);
-
-    size_t slot = find_slot(ht->hash_to_idx, ht->capacity, key, ht->array);
-    if (ht->hash_to_idx[slot] == 0) {
-        ht_unlock(ht);
-        return false;
-    }
-
-    size_t idx = ht->hash_to_idx[slot] - 1;
-
-    // Free memory for the entry being removed
-    free(ht->array[idx].text);
-    free(ht->array[idx].content_type);
-
-    // Shift all subsequent entries up one position
-    memmove(&ht->array[idx], &ht->array[idx + 1],
-            (ht->size - idx - 1) * sizeof(ClipboardEntry));
-
-    // Update hash indices for shifted entries
-    for (size_t i = idx; i < ht->size - 1; i++) {
-        size_t entry_slot = ht->idx_to_hash_slot[i + 1];
-        ht->hash_to_idx[entry_slot] = i + 1;
-        ht->idx_to_hash_slot[i] = entry_slot;
-    }
-
-    // Clear the hash table slot for the removed key
-    ht->hash_to_idx[slot] = 0;
-    ht->size--;
-
-    ht_unlock(ht);
-    return true;
+    return ht_remove(ht, key);
 }
 
+static void resolve(const ClipboardArena* arena, const ClipboardRecord* record, ClipboardEntry* entry) {
+    entry->primkey = record->primkey;
+    entry->key = (char*)arena_text(arena, record->key);
+    entry->length = record->length;
+    entry->timestamp = record->timestamp;
+    entry->content_type = (char*)arena_mime(arena, record->content_type);
+}
 
-const ClipboardEntry* ht_lookup(HashTable* ht, uint32_t key) {
-    if (!ht || key == 0) return NULL;
+bool ht_lookup(HashTable* ht, uint32_t key, ClipboardEntry* entry) {
+    if (!ht || key == 0 || !entry) return false;
 
+    ht_lock(ht);
     size_t slot = find_slot(ht->hash_to_idx, ht->capacity, key, ht->array);
-    if (ht->hash_to_idx[slot] == 0) return NULL;
-
-    return &ht->array[ht->hash_to_idx[slot] - 1];
+    bool found = ht->hash_to_idx[slot] != 0;
+    if (found) {
+        arena_lock(ht->arena);
+        resolve(ht->arena, &ht->array[ht->hash_to_idx[slot] - 1], entry);
+        arena_unlock(ht->arena);
+    }
+    ht_unlock(ht);
+    return found;
 }
 
+// Newest first.
 const ClipboardEntry* ht_entries(HashTable* ht, size_t* length) {
     if (!ht || !length) return NULL;
 
     ht_lock(ht);
-    *length = ht->size;
-    const ClipboardEntry* entries = ht->array;
+    arena_lock(ht->arena);
+
+    if (ht->view_generation != ht->arena->generation) {
+        ht->view_generation = ht->arena->generation;
+        ht->view_stale = true;
+    }
+
+    // Readers of the current view may still be going, so a new one is
+    // built and the old one retired
+    if (ht->view_stale) {
+        ClipboardEntry* view = malloc((ht->size ? ht->size : 1) * sizeof(ClipboardEntry));
+        if (view) {
+            size_t i = 0;
+            for (uint32_t idx = ht->newest; idx != HT_NONE; idx = ht->links[idx].older) {
+                resolve(ht->arena, &ht->array[idx], &view[i++]);
+            }
+            arena_retire(ht->arena, ht->view);
+            ht->view = view;
+            ht->view_stale = false;
+        }
+    }
+
+    // Only when the copy could not be allocated
+    *length = ht->view_stale ? 0 : ht->size;
+    const ClipboardEntry* entries = ht->view;
+    arena_unlock(ht->arena);
     ht_unlock(ht);
     return entries;
 }
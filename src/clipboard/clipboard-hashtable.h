@@ -6,31 +6,83 @@
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <string.h>
+#include "clipboard-arena.h"
 
+// Longest search key in codepoints; the matcher looks no further anyway
+#define CLIPBOARD_KEY_CHARS 512
+
+// `key` is the start of the clip's text, cut after CLIPBOARD_KEY_CHARS
+// codepoints, and `length` the byte length of all of it. The full text
+// stays in the database.
 typedef struct {
     uint32_t primkey;
-    char* text;
+    char* key;
+    uint32_t length;
     int64_t timestamp;
     char* content_type;
 } ClipboardEntry;
 
+// How an entry is stored: its strings are handles into the shared arena
+typedef struct {
+    uint32_t primkey;
+    uint32_t key;
+    int64_t timestamp;
+    uint16_t content_type;
+    uint32_t length;
+} ClipboardRecord;
+
+#define HT_NONE UINT32_MAX
+
+// Neighbours of an entry in recency order, as indices into `array`
+typedef struct {
+    uint32_t newer;
+    uint32_t older;
+} ClipboardLink;
+
+// Entries live unordered in `array`; recency is kept by `links`, so moving
+// an entry to the front or removing it never shifts the others.
+// ht_entries copies the list out newest first into a new `view`, resolving
+// the strings, and only when the table changed or the arena compacted
+// since.
+//
+// `hash_to_idx` is linearly probed at a load of at most 3/4; removal
+// shifts the rest of the probe run back instead of leaving a gap, so
+// lookups stay short however much history comes and goes.
+//
+// Every call serializes on `lock`. The strings in the entries handed out
+// by ht_lookup and ht_entries, and the ht_entries array itself, are
+// borrowed from the arena: call them inside arena_read_begin and
+// arena_read_end and copy whatever has to outlive that. Inserts and
+// removals on other threads may go on meanwhile.
 typedef struct {
-    ClipboardEntry* array;
+    ClipboardArena* arena;
+    ClipboardRecord* array;
     uint32_t* hash_to_idx;
     size_t* idx_to_hash_slot;
+    ClipboardLink* links;
+    uint32_t newest;
+    uint32_t oldest;
     size_t capacity;
     size_t size;
     size_t array_capacity;
+    ClipboardEntry* view;
+    bool view_stale;
+    uint32_t view_generation;
     atomic_int lock;
 } HashTable;
 
-HashTable* ht_create(size_t initial_capacity);
+// Takes a reference on the arena.
+HashTable* ht_create(size_t initial_capacity, ClipboardArena* arena);
 void ht_destroy(HashTable* ht);
-bool ht_insert(HashTable* ht, uint32_t primkey, const char* text, int64_t timestamp, const char* content_type);
+// text may be the full text or already cut down to its key; length is
+// that of the full text either way.
+bool ht_insert(HashTable* ht, uint32_t primkey, const char* text, uint32_t length, int64_t timestamp,
+               const char* content_type);
 bool ht_remove(HashTable* ht, uint32_t key);
 bool ht_remove_shift(HashTable* ht, uint32_t key);
-bool ht_insert_shift(HashTable* ht, uint32_t primkey, const char* text, int64_t timestamp, const char* content_type);
-const ClipboardEntry* ht_lookup(HashTable* ht, uint32_t key);
+bool ht_insert_shift(HashTable* ht, uint32_t primkey, const char* text, uint32_t length, int64_t timestamp,
+                     const char* content_type);
+bool ht_lookup(HashTable* ht, uint32_t key, ClipboardEntry* entry);
 const ClipboardEntry* ht_entries(HashTable* ht, size_t* length);
 
 #endif // CLIPBOARD_HASHTABLE_H
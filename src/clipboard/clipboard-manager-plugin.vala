@@ -114,6 +114,9 @@ namespace BobLauncher {
         };
 
         internal static unowned ClipboardManagerPlugin? plg;
+
+        // Shared by the shards and the recent entries, so each text is held once
+        internal static ClipboardHash.Arena? strings;
     }
 
     namespace ClipboardTreeManager {
@@ -131,7 +134,7 @@ namespace BobLauncher {
 
             entries = new ClipboardHash.Table[num_shards];
             for (int i = 0; i < num_shards; i++) {
-                entries[i] = new ClipboardHash.Table(512);
+                entries[i] = new ClipboardHash.Table(512, ClipboardManager.strings);
             }
         }
 
@@ -139,9 +142,9 @@ namespace BobLauncher {
             return (uint)(primkey % num_shards);
         }
 
-        public static void add_entry(uint primkey, string text, int64 timestamp, string content_type) {
+        public static void add_entry(uint primkey, string text, uint32 length, int64 timestamp, string content_type) {
             uint shard_index = get_shard_index(primkey);
-            entries[shard_index].insert(primkey, text, timestamp, content_type);
+            entries[shard_index].insert(primkey, text, length, timestamp, content_type);
         }
 
         public static void remove_entry(uint primkey) {
@@ -149,21 +152,27 @@ namespace BobLauncher {
             entries[shard_index].remove(primkey);
         }
 
+        // The entries point into the arena, which may compact as soon as
+        // the read ends, so a match gets copies of its strings.
         public static void search_shard(ResultContainer rs, uint shard_id) {
+            int parity = ClipboardManager.strings.read_begin();
             unowned ClipboardHash.Entry[] entries_array = entries[shard_id].get_entries();
 
             for (int i = 0; i < entries_array.length; i++) {
                 unowned ClipboardHash.Entry entry = entries_array[i];
-                Score score = rs.match_score(entry.text);
+                Score score = rs.match_score(entry.key);
+                if (score <= MatchScore.BELOW_THRESHOLD) continue;
+
+                uint32 primkey = entry.primkey;
+                string key = entry.key;
+                uint32 length = entry.length;
+                int64 timestamp = entry.timestamp;
+                string content_type = entry.content_type;
                 rs.add_lazy_unique(score, () => {
-                    return new ClipboardMatch(
-                        entry.primkey,
-                        entry.text,
-                        entry.timestamp,
-                        entry.content_type
-                    );
+                    return new ClipboardMatch(primkey, key, length, timestamp, content_type);
                 });
             }
+            ClipboardManager.strings.read_end(parity);
         }
     }
 
@@ -179,7 +188,8 @@ namespace BobLauncher {
 
         construct {
             icon_name = "edit-paste";
-            recent_entries = new ClipboardHash.Table(max_recent_entries);
+            ClipboardManager.strings = new ClipboardHash.Arena();
+            recent_entries = new ClipboardHash.Table(max_recent_entries, ClipboardManager.strings);
             ClipboardManager.plg = this;
             try {
                 content_ignore_regex = new GLib.Regex("^$", GLib.RegexCompileFlags.OPTIMIZE, 0);
@@ -205,7 +215,7 @@ namespace BobLauncher {
 
         private void load_recent_entries() {
             recent_entries = null;
-            recent_entries = new ClipboardHash.Table(max_recent_entries);
+            recent_entries = new ClipboardHash.Table(max_recent_entries, ClipboardManager.strings);
 
             unowned Sqlite.Statement latest_stmt = db.get_latest_stmt(max_recent_entries);
             latest_stmt.reset();
@@ -214,8 +224,9 @@ namespace BobLauncher {
                 int64 timestamp = latest_stmt.column_int64(1);
                 string top_mime = latest_stmt.column_text(2);
                 string? text = latest_stmt.column_text(3);
+                uint32 length = (uint32)latest_stmt.column_int64(4);
                 if (text != null) {
-                    recent_entries.insert(primkey, text, timestamp, top_mime);
+                    recent_entries.insert(primkey, text, length, timestamp, top_mime);
                 }
             }
         }
@@ -242,8 +253,9 @@ namespace BobLauncher {
                 int64 timestamp = stmt.column_int64(1);
                 string top_mime = stmt.column_text(2);
                 string? text = stmt.column_text(3);
+                uint32 length = (uint32)stmt.column_int64(4);
                 if (text != null) {
-                    ClipboardTreeManager.add_entry(primkey, text, timestamp, top_mime);
+                    ClipboardTreeManager.add_entry(primkey, text, length, timestamp, top_mime);
                 }
             }
 
@@ -335,8 +347,8 @@ namespace BobLauncher {
             }
 
             int64 now = get_current_time();
-            ClipboardTreeManager.add_entry(primkey, display_text, now, top_mime);
-            recent_entries.insert_shift(primkey, display_text, now, top_mime);
+            ClipboardTreeManager.add_entry(primkey, display_text, display_text.length, now, top_mime);
+            recent_entries.insert_shift(primkey, display_text, display_text.length, now, top_mime);
             db.insert_item(content, hash, top_mime, display_text);
         }
 
@@ -351,6 +363,10 @@ namespace BobLauncher {
             return db.get_content(primkey);
         }
 
+        internal string? get_text(uint primkey) {
+            return db.get_text(primkey);
+        }
+
         internal bool set_clipboard(ClipboardMatch match) {
             var content = this.get_content(match.primkey);
             if (content.size() == 0) {
@@ -359,7 +375,7 @@ namespace BobLauncher {
 
             int64 now = GLib.get_real_time();
             db.update_timestamp(match.primkey, now);
-            recent_entries.insert_shift(match.primkey, match.get_title(), now, match.content_type);
+            recent_entries.insert_shift(match.primkey, match.search_key, match.text_length, now, match.content_type);
             wlc.set_clipboard(content);
             return true;
         }
@@ -378,20 +394,22 @@ namespace BobLauncher {
                 ClipboardTreeManager.search_shard(rs, shard_id);
             } else if (shard_id == 0) {
                 int16 base_score = MatchScore.ABOVE_THRESHOLD;
+                int parity = ClipboardManager.strings.read_begin();
                 unowned ClipboardHash.Entry[] recent_array = recent_entries.get_entries();
                 int length = (int)recent_array.length;
                 for (int i = length-1; i >= 0 ; i--) {
                     unowned var entry = recent_array[i];
                     // uint32 hash = uint32.MAX - (uint32)((entry.timestamp - timestamp_offset) >> 14);
+                    uint32 primkey = entry.primkey;
+                    string key = entry.key;
+                    uint32 text_length = entry.length;
+                    int64 timestamp = entry.timestamp;
+                    string content_type = entry.content_type;
                     rs.add_lazy_unique(base_score, () =>
-                        new ClipboardMatch(
-                            entry.primkey,
-                            entry.text,
-                            entry.timestamp,
-                            entry.content_type
-                        )
+                        new ClipboardMatch(primkey, key, text_length, timestamp, content_type)
                     );
                 }
+                ClipboardManager.strings.read_end(parity);
             }
         }
 
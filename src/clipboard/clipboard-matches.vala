@@ -4,7 +4,10 @@ namespace BobLauncher {
         public string icon_type { get; construct; }
         private int max_tooltip_length = 3000;
         private string title;
-        private string content;
+        // The start of the text, as kept in memory for searching
+        internal string search_key;
+        internal uint32 text_length;
+        private string? full_text = null;
         private string timestamp_text;
         private int character_count = 0;
         public string content_type;
@@ -186,11 +189,22 @@ namespace BobLauncher {
 
         private Gtk.Widget? _tooltip_widget = null;
 
+        // The search key is the whole text unless it was cut short
+        private unowned string get_content() {
+            if (full_text == null && search_key.length < text_length) {
+                full_text = ClipboardManager.plg.get_text(primkey);
+            }
+            if (full_text == null) return search_key;
+            return full_text;
+        }
+
         public override unowned Gtk.Widget? get_tooltip() {
             if (_tooltip_widget != null) {
                 return _tooltip_widget;
             }
 
+            unowned string content = get_content();
+
             // Check for hex color format
             string trimmed_content = content.strip();
             if ((trimmed_content.has_prefix("#") && (trimmed_content.length == 7 || trimmed_content.length == 9)) ||
@@ -274,9 +288,11 @@ namespace BobLauncher {
             return _tooltip_widget;
         }
 
-        public ClipboardMatch(uint primkey, string? text, int64 timestamp, string content_type) {
-            if (text == null) {
-                error("text is null");
+        // key is the clip's search key and length the byte length of its full
+        // text, which is only read from the database for the tooltip.
+        public ClipboardMatch(uint primkey, string? key, uint32 length, int64 timestamp, string content_type) {
+            if (key == null) {
+                error("key is null");
             }
 
             var icon_type = IconCacheService.best_icon_name_for_mime_type(content_type);
@@ -287,18 +303,19 @@ namespace BobLauncher {
             var date_time = new DateTime.from_unix_utc(timestamp / 1000000);
             var now = new DateTime.now_local();
 
-            string new_text = text.chug();
+            string new_text = key.chug();
             string append_ellipsis = new_text.length > 200 ? "…" : "";
 
             int max_length = int.min(200, new_text.length);
             this.title = new_text.slice(0, max_length) + append_ellipsis;
-            this.content = text;
+            this.search_key = key;
+            this.text_length = length;
 
             string time_str = BobLauncher.Utils.format_modification_time(now, date_time);
             this.timestamp_text = time_str;
 
             if (this.content_type.down().contains("text")) {
-                this.character_count = text.length;
+                this.character_count = (int)length;
             }
         }
     }
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <poll.h>
 #include <sys/eventfd.h>
 #include <immintrin.h>
@@ -19,6 +20,42 @@
 #define RUNNING 1
 #define SHUTTING_DOWN 2
 
+// Offered data is read in chunks of this size as the pipes become ready
+#define CAPTURE_READ_SIZE (64 * 1024)
+// Past this a MIME type's data moves from memory to an unlinked file
+#define CAPTURE_MEMORY_LIMIT (1024 * 1024)
+// Larger data of a MIME type is dropped, as is any still unread once
+// the timeout runs out
+#define CAPTURE_SIZE_LIMIT (64 * 1024 * 1024)
+#define CAPTURE_TIMEOUT_MS 5000
+
+typedef struct {
+    struct zwlr_data_control_offer_v1 *offer;
+    clipboard_manager *manager;
+    GPtrArray *mime_types;
+} offer_data;
+
+typedef struct {
+    const char *mime_type;
+    // Read end of the pipe, -1 once finished
+    int fd;
+    GByteArray *buffer;
+    // Takes over from buffer past CAPTURE_MEMORY_LIMIT
+    int spill_fd;
+    size_t size;
+    bool complete;
+} capture_stream;
+
+// The selection being read, one stream per offered MIME type
+typedef struct {
+    struct zwlr_data_control_offer_v1 *offer;
+    offer_data *data;
+    capture_stream *streams;
+    guint n_streams;
+    guint pending;
+    gint64 deadline;
+} capture_data;
+
 struct clipboard_manager_t {
     struct wl_display *display;
     struct wl_registry *registry;
@@ -35,15 +72,12 @@ struct clipboard_manager_t {
     uint32_t last_hash;
     bool prevent_deadlock;
 
+    // Only touched from the event thread
+    capture_data *capture;
+
     clipboard_changed_callback on_clipboard_changed;
 };
 
-typedef struct {
-    struct zwlr_data_control_offer_v1 *offer;
-    clipboard_manager *manager;
-    GPtrArray *mime_types;
-} offer_data;
-
 typedef struct {
     struct zwlr_data_control_source_v1 *source;
     clipboard_manager *manager;
@@ -61,7 +95,9 @@ static void offer_handle_offer(void *data, struct zwlr_data_control_offer_v1 *of
 static void source_send_handler(void *data, struct zwlr_data_control_source_v1 *source, const char *mime_type, int32_t fd);
 static void source_cancelled_handler(void *data, struct zwlr_data_control_source_v1 *source);
 static void process_offer(clipboard_manager *manager, struct zwlr_data_control_offer_v1 *offer_obj);
-static GBytes* read_offer_data(struct zwlr_data_control_offer_v1 *offer, const char *mime_type);
+static void read_stream(capture_stream *stream);
+static void finish_capture(clipboard_manager *manager);
+static void free_capture(capture_data *capture);
 
 static const struct wl_registry_listener registry_listener = {
     .global = registry_handle_global,
@@ -178,6 +214,8 @@ void clipboard_manager_destroy(clipboard_manager *manager) {
 
     pthread_join(manager->thread_id, NULL);
 
+    free_capture(manager->capture);
+
     if (manager->device) {
         zwlr_data_control_device_v1_destroy(manager->device);
     }
@@ -279,29 +317,63 @@ void clipboard_manager_set_clipboard(clipboard_manager *manager, GHashTable *con
     pthread_mutex_unlock(&manager->mutex);
 }
 
+// Polls the display and the wake fd, plus the pipes of a selection being
+// read, which is handed on once every pipe is done or its time is up.
 static void* event_loop_thread(void *data) {
     clipboard_manager *manager = data;
 
-    struct pollfd fds[2];
-    fds[0].fd = wl_display_get_fd(manager->display);
-    fds[0].events = POLLIN;
-    fds[1].fd = manager->wake_fd;
-    fds[1].events = POLLIN;
+    GArray *fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    GArray *fd_streams = g_array_new(FALSE, FALSE, sizeof(capture_stream*));
 
     int running;
     while ((running = atomic_load(&manager->running)) == RUNNING) {
-        if (poll(fds, 2, -1) < 0) {
+        struct pollfd display_fd = { .fd = wl_display_get_fd(manager->display), .events = POLLIN };
+        struct pollfd wake_fd = { .fd = manager->wake_fd, .events = POLLIN };
+        g_array_set_size(fds, 0);
+        g_array_set_size(fd_streams, 0);
+        g_array_append_val(fds, display_fd);
+        g_array_append_val(fds, wake_fd);
+
+        int timeout = -1;
+        capture_data *capture = manager->capture;
+        if (capture) {
+            for (guint i = 0; i < capture->n_streams; i++) {
+                capture_stream *stream = &capture->streams[i];
+                if (stream->fd < 0) continue;
+                struct pollfd stream_fd = { .fd = stream->fd, .events = POLLIN };
+                g_array_append_val(fds, stream_fd);
+                g_array_append_val(fd_streams, stream);
+            }
+            gint64 left = (capture->deadline - g_get_monotonic_time()) / 1000;
+            timeout = capture->pending && left > 0 ? (int)left : 0;
+        }
+
+        if (poll((struct pollfd*)fds->data, fds->len, timeout) < 0) {
             if (errno == EINTR) continue;
             fprintf(stderr, "poll error: %s\n", strerror(errno));
             break;
         }
 
-        if (fds[1].revents & POLLIN) {
+        struct pollfd *polled = (struct pollfd*)fds->data;
+
+        if (polled[1].revents & POLLIN) {
             uint64_t val;
             read(manager->wake_fd, &val, sizeof(val));
         }
 
-        if (fds[0].revents & POLLIN) {
+        // Before dispatching, which may replace the capture
+        for (guint i = 2; i < fds->len; i++) {
+            if (!polled[i].revents) continue;
+            capture_stream *stream = g_array_index(fd_streams, capture_stream*, i - 2);
+            read_stream(stream);
+            if (stream->fd < 0) capture->pending--;
+        }
+
+        if (capture && (capture->pending == 0 || g_get_monotonic_time() >= capture->deadline)) {
+            finish_capture(manager);
+        }
+
+        if (polled[0].revents & POLLIN) {
             if (wl_display_dispatch(manager->display) < 0) {
                 fprintf(stderr, "wl_display_dispatch failed\n");
                 break;
@@ -309,6 +381,8 @@ static void* event_loop_thread(void *data) {
         }
     }
 
+    g_array_free(fds, TRUE);
+    g_array_free(fd_streams, TRUE);
     atomic_store(&manager->running, SHUTTING_DOWN);
     return NULL;
 }
@@ -445,6 +519,33 @@ static void source_cancelled_handler(void *data, struct zwlr_data_control_source
     free(source_data);
 }
 
+static void free_capture(capture_data *capture) {
+    if (!capture) {
+        return;
+    }
+
+    for (guint i = 0; i < capture->n_streams; i++) {
+        capture_stream *stream = &capture->streams[i];
+        if (stream->fd >= 0) close(stream->fd);
+        if (stream->spill_fd >= 0) close(stream->spill_fd);
+        if (stream->buffer) g_byte_array_unref(stream->buffer);
+    }
+    g_free(capture->streams);
+
+    g_ptr_array_unref(capture->data->mime_types);
+    free(capture->data);
+    zwlr_data_control_offer_v1_destroy(capture->offer);
+    free(capture);
+}
+
+static void end_stream(capture_stream *stream, bool complete) {
+    close(stream->fd);
+    stream->fd = -1;
+    stream->complete = complete;
+}
+
+// Asks for every offered MIME type at once and leaves the reading to the
+// event loop. A newer selection replaces one still being read.
 static void process_offer(clipboard_manager *manager, struct zwlr_data_control_offer_v1 *offer_obj) {
     offer_data *data = wl_proxy_get_user_data((struct wl_proxy*)offer_obj);
     if (!data || !data->mime_types || data->mime_types->len == 0) {
@@ -454,6 +555,134 @@ static void process_offer(clipboard_manager *manager, struct zwlr_data_control_o
         return;
     }
 
+    free_capture(manager->capture);
+    manager->capture = NULL;
+
+    capture_data *capture = calloc(1, sizeof(capture_data));
+    if (!capture) {
+        fprintf(stderr, "Failed to allocate capture\n");
+        g_ptr_array_unref(data->mime_types);
+        free(data);
+        zwlr_data_control_offer_v1_destroy(offer_obj);
+        return;
+    }
+
+    capture->offer = offer_obj;
+    capture->data = data;
+    capture->streams = g_new0(capture_stream, data->mime_types->len);
+    capture->deadline = g_get_monotonic_time() + CAPTURE_TIMEOUT_MS * 1000;
+    manager->capture = capture;
+
+    for (guint i = 0; i < data->mime_types->len; i++) {
+        capture_stream *stream = &capture->streams[capture->n_streams];
+        int pipe_fd[2];
+        if (pipe2(pipe_fd, O_CLOEXEC | O_NONBLOCK) != 0) {
+            perror("Failed to create pipe");
+            continue;
+        }
+
+        zwlr_data_control_offer_v1_receive(offer_obj, g_ptr_array_index(data->mime_types, i), pipe_fd[1]);
+        close(pipe_fd[1]);
+
+        stream->mime_type = g_ptr_array_index(data->mime_types, i);
+        stream->fd = pipe_fd[0];
+        stream->spill_fd = -1;
+        stream->buffer = g_byte_array_new();
+        capture->n_streams++;
+        capture->pending++;
+    }
+
+    // Make sure the requests reach the compositor
+    wl_display_flush(manager->display);
+}
+
+// Moves what is in memory so far to an unlinked file in the cache dir.
+static bool spill_stream(capture_stream *stream) {
+    stream->spill_fd = open(g_get_user_cache_dir(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (stream->spill_fd < 0) {
+        fprintf(stderr, "Failed to spill %s clipboard data: %s\n", stream->mime_type, strerror(errno));
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < stream->buffer->len) {
+        ssize_t n = write(stream->spill_fd, stream->buffer->data + written, stream->buffer->len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Failed to spill %s clipboard data: %s\n", stream->mime_type, strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+
+    g_byte_array_unref(stream->buffer);
+    stream->buffer = NULL;
+    return true;
+}
+
+// Reads until the pipe runs dry, ends or the data grows too large.
+static void read_stream(capture_stream *stream) {
+    while (stream->fd >= 0) {
+        if (stream->size >= CAPTURE_SIZE_LIMIT) {
+            fprintf(stderr, "Dropping %s clipboard data over %d bytes\n", stream->mime_type, CAPTURE_SIZE_LIMIT);
+            end_stream(stream, false);
+            return;
+        }
+
+        if (stream->buffer && stream->size + CAPTURE_READ_SIZE > CAPTURE_MEMORY_LIMIT && !spill_stream(stream)) {
+            end_stream(stream, false);
+            return;
+        }
+
+        ssize_t n;
+        if (stream->buffer) {
+            g_byte_array_set_size(stream->buffer, stream->size + CAPTURE_READ_SIZE);
+            n = read(stream->fd, stream->buffer->data + stream->size, CAPTURE_READ_SIZE);
+            g_byte_array_set_size(stream->buffer, stream->size + (n > 0 ? n : 0));
+        } else {
+            n = splice(stream->fd, NULL, stream->spill_fd, NULL, CAPTURE_READ_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        if (n > 0) {
+            stream->size += n;
+        } else if (n == 0) {
+            end_stream(stream, true);
+        } else if (errno == EAGAIN) {
+            return;
+        } else if (errno != EINTR) {
+            perror("Error reading clipboard data");
+            end_stream(stream, false);
+        }
+    }
+}
+
+static GBytes* stream_bytes(capture_stream *stream) {
+    if (stream->buffer) {
+        GBytes *bytes = g_byte_array_free_to_bytes(stream->buffer);
+        stream->buffer = NULL;
+        return bytes;
+    }
+
+    // Spilled data stays in the page cache rather than on the heap
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new_from_fd(stream->spill_fd, FALSE, &error);
+    if (!mapped) {
+        fprintf(stderr, "Failed to map %s clipboard data: %s\n", stream->mime_type, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    GBytes *bytes = g_mapped_file_get_bytes(mapped);
+    g_mapped_file_unref(mapped);
+    return bytes;
+}
+
+// Hands the MIME types read in full to the callback; anything still
+// pending past the deadline is dropped.
+static void finish_capture(clipboard_manager *manager) {
+    capture_data *capture = manager->capture;
+    manager->capture = NULL;
+
     GHashTable *content_map = g_hash_table_new_full(
         (GHashFunc)g_bytes_hash,
         (GEqualFunc)g_bytes_equal,
@@ -464,28 +693,38 @@ static void process_offer(clipboard_manager *manager, struct zwlr_data_control_o
     bool has_new_content = false;
     uint32_t combined_hash = 17;
 
-    for (int i = 0; i < data->mime_types->len; i++) {
-        const char *mime_type = g_ptr_array_index(data->mime_types, i);
-        GBytes *content = read_offer_data(offer_obj, mime_type);
-
-        if (content && g_bytes_get_size(content) > 0) {
-            GPtrArray *mime_types = g_hash_table_lookup(content_map, content);
-            if (!mime_types) {
-                mime_types = g_ptr_array_new_with_free_func(g_free);
-                g_hash_table_insert(content_map, g_bytes_ref(content), mime_types);
+    for (guint i = 0; i < capture->n_streams; i++) {
+        capture_stream *stream = &capture->streams[i];
+        if (!stream->complete || stream->size == 0) {
+            if (stream->fd >= 0) {
+                fprintf(stderr, "Timed out reading %s clipboard data\n", stream->mime_type);
             }
+            continue;
+        }
 
-            g_ptr_array_add(mime_types, g_strdup(mime_type));
+        GBytes *content = stream_bytes(stream);
+        if (!content) {
+            continue;
+        }
 
-            combined_hash = 31 * combined_hash + g_bytes_hash(content);
-            combined_hash = 31 * combined_hash + g_str_hash(mime_type);
+        GPtrArray *mime_types = g_hash_table_lookup(content_map, content);
+        if (!mime_types) {
+            mime_types = g_ptr_array_new_with_free_func(g_free);
+            g_hash_table_insert(content_map, g_bytes_ref(content), mime_types);
+        }
 
-            has_new_content = true;
+        g_ptr_array_add(mime_types, g_strdup(stream->mime_type));
 
-            g_bytes_unref(content);
-        }
+        combined_hash = 31 * combined_hash + g_bytes_hash(content);
+        combined_hash = 31 * combined_hash + g_str_hash(stream->mime_type);
+
+        has_new_content = true;
+
+        g_bytes_unref(content);
     }
 
+    free_capture(capture);
+
     if (has_new_content && combined_hash != manager->last_hash) {
         manager->last_hash = combined_hash;
 
@@ -501,43 +740,4 @@ static void process_offer(clipboard_manager *manager, struct zwlr_data_control_o
     } else {
         g_hash_table_destroy(content_map);
     }
-
-    if (data->mime_types) {
-        g_ptr_array_unref(data->mime_types);
-    }
-    free(data);
-
-    zwlr_data_control_offer_v1_destroy(offer_obj);
-}
-
-static GBytes* read_offer_data(struct zwlr_data_control_offer_v1 *offer, const char *mime_type) {
-    int pipe_fd[2];
-    if (pipe(pipe_fd) != 0) {
-        perror("Failed to create pipe");
-        return NULL;
-    }
-
-    zwlr_data_control_offer_v1_receive(offer, mime_type, pipe_fd[1]);
-
-    // Make sure the request reaches the compositor
-    wl_display_flush(((offer_data*)wl_proxy_get_user_data((struct wl_proxy*)offer))->manager->display);
-
-    close(pipe_fd[1]); // Close write
-
-    GByteArray *byte_array = g_byte_array_new();
-    uint8_t buffer[4096];
-    ssize_t bytes_read;
-
-    while ((bytes_read = read(pipe_fd[0], buffer, sizeof(buffer))) > 0) {
-        g_byte_array_append(byte_array, buffer, bytes_read);
-    }
-
-    if (bytes_read < 0) {
-        perror("Error reading from pipe");
-    }
-
-    close(pipe_fd[0]); // Close read
-
-    GBytes *result = g_byte_array_free_to_bytes(byte_array);
-    return result;
 }
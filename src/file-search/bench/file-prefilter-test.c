@@ -0,0 +1,254 @@
+// Checks that the search filters never reject a path the scorer would
+// accept. Generated paths mix case, non-ASCII components and spaces; each
+// query is run through ft_iterate_filtered and through fp_needle_mask,
+// fp_leading_components, fp_ordered_chars and fp_subsequence_prefix
+// directly, and the outcome is compared with a brute-force ordered
+// subsequence test and with the benchmark's scorer. Exits non-zero on the
+// first disagreement.
+//
+//   file-prefilter-test [--entries N] [--queries N] [--seed N]
+
+#include "file-hashtable.h"
+#include "file-prefilter.h"
+#include "match.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CHARS 256
+
+static gint entry_target = 3000;
+static gint query_target = 400;
+static gint seed = 1;
+
+static GOptionEntry options[] = {
+    { "entries", 'n', 0, G_OPTION_ARG_INT, &entry_target, "Paths to generate", "N" },
+    { "queries", 'q', 0, G_OPTION_ARG_INT, &query_target, "Queries to check", "N" },
+    { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed for generated paths and queries", "N" },
+    { NULL }
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+// None of these lowercases to ASCII (as U+212A KELVIN SIGN does), which
+// the ASCII-only filters could not know about.
+static const char* const words[] = {
+    "src", "Lib", "INCLUDE", "Docs", "build", "Config", "data", "My Documents",
+    "Straße", "Ünïcode", "café", "naïve", "Ελληνικά", "日本語", "ÆØÅ", "résumé",
+    "Photos 2023", "x-y_z.d", "README", "Makefile",
+};
+static const char* const extensions[] = { "c", "H", "vala", "md", "PNG", "tar.gz", "jpé", "" };
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+#define EXTENSION_COUNT (sizeof(extensions) / sizeof(extensions[0]))
+
+// Characters random queries draw from, so most of them match nothing
+static const char* const alphabet = "abcXYZ019._- /éÜßλ日";
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static GPtrArray* generate_paths(size_t n) {
+    GHashTable* seen = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+
+    for (size_t attempts = 0; paths->len < n && attempts < n * 4; attempts++) {
+        GString* path = g_string_new("/home/user");
+        int depth = 1 + rng_next() % 4;
+        for (int d = 0; d < depth; d++) {
+            g_string_append_printf(path, "/%s", words[rng_next() % WORD_COUNT]);
+        }
+        g_string_append_printf(path, "/%s%u", words[rng_next() % WORD_COUNT], rng_next() % 100);
+        const char* extension = extensions[rng_next() % EXTENSION_COUNT];
+        if (*extension) g_string_append_printf(path, ".%s", extension);
+
+        char* text = g_string_free(path, FALSE);
+        if (g_hash_table_contains(seen, text)) {
+            g_free(text);
+            continue;
+        }
+        g_hash_table_add(seen, text);
+        g_ptr_array_add(paths, text);
+    }
+
+    g_hash_table_destroy(seen);
+    return paths;
+}
+
+// Codepoints of the path in order, some skipped, some with their case
+// flipped and now and then a space, as people type. Starting in an earlier
+// component keeps the '/' between them, making a multi-component query.
+static char* query_from_path(const char* path) {
+    GString* query = g_string_new(NULL);
+    const char* start = strrchr(path, '/') + 1;
+    if (rng_next() % 3 == 0) {
+        const char* dir = start - 1;
+        while (dir > path && dir[-1] != '/') dir--;
+        if (dir > path) start = dir;
+    }
+
+    for (const char* p = start; *p; p = g_utf8_next_char(p)) {
+        if (rng_next() % 3 == 0) continue;
+        gunichar c = g_utf8_get_char(p);
+        if (rng_next() % 2) c = g_unichar_isupper(c) ? g_unichar_tolower(c) : g_unichar_toupper(c);
+        g_string_append_unichar(query, c);
+        if (rng_next() % 16 == 0) g_string_append_c(query, ' ');
+    }
+    return g_string_free(query, FALSE);
+}
+
+static char* random_query(void) {
+    gunichar chars[MAX_CHARS];
+    int count = 0;
+    for (const char* p = alphabet; *p; p = g_utf8_next_char(p)) chars[count++] = g_utf8_get_char(p);
+
+    GString* query = g_string_new(NULL);
+    int len = 1 + rng_next() % 6;
+    for (int i = 0; i < len; i++) {
+        g_string_append_unichar(query, chars[rng_next() % count]);
+    }
+    return g_string_free(query, FALSE);
+}
+
+typedef struct {
+    const char* text;
+    uint32_t chars[MAX_CHARS];
+    int len;
+    // ASCII without spaces, where the filters are exact rather than loose
+    bool exact;
+    char leading[MAX_CHARS];
+    char ordered[MAX_CHARS];
+    FileQuery query;
+    // What the benchmark hands its scorer: one char per byte of the text
+    uint32_t bytes[MAX_CHARS];
+    needle_info needle;
+} TestQuery;
+
+// Set up the way file_tree_manager_tree_manager_shard does it.
+static void test_query_init(TestQuery* q, const char* text) {
+    memset(q, 0, sizeof(*q));
+    q->text = text;
+    q->exact = true;
+    for (const char* p = text; *p && q->len < MAX_CHARS; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+        if (c >= 0x80 || c == ' ') q->exact = false;
+        q->chars[q->len++] = c;
+    }
+
+    q->query.mask = fp_needle_mask(q->chars, q->len);
+    q->query.dir_len = fp_leading_components(q->chars, q->len, q->leading, sizeof(q->leading));
+    q->query.dir_chars = q->leading;
+    q->query.path_len = fp_ordered_chars(q->chars, q->len, q->ordered, sizeof(q->ordered));
+    q->query.path_chars = q->ordered;
+
+    int len = 0;
+    for (const char* c = text; *c && len < MAX_CHARS; c++) q->bytes[len++] = (unsigned char)*c;
+    q->needle = (needle_info){ .len = len, .capacity = MAX_CHARS, .chars = q->bytes, .unicode_upper = q->bytes };
+}
+
+// Whether the query's codepoints, spaces left out, appear in the path in
+// order, compared case-insensitively.
+static bool brute_force_match(const TestQuery* q, const char* path) {
+    int j = 0;
+    while (j < q->len && q->chars[j] == ' ') j++;
+
+    for (const char* p = path; *p && j < q->len; p = g_utf8_next_char(p)) {
+        if (g_unichar_tolower(g_utf8_get_char(p)) != g_unichar_tolower(q->chars[j])) continue;
+        j++;
+        while (j < q->len && q->chars[j] == ' ') j++;
+    }
+    return j == q->len;
+}
+
+// The prefilter functions applied to one path by hand.
+static bool filter_passes(const TestQuery* q, const char* path) {
+    size_t path_len = strlen(path);
+    size_t dir_len = strrchr(path, '/') - path + 1;
+
+    return (fp_path_mask(path) & q->query.mask) == q->query.mask &&
+           fp_contains_subsequence(path, dir_len, q->leading, q->query.dir_len) &&
+           fp_subsequence_prefix(path, path_len, q->ordered, q->query.path_len) == q->query.path_len;
+}
+
+static void collect_path(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    g_hash_table_add(data, g_strdup(path));
+}
+
+static bool check_query(FileTable* ft, GPtrArray* paths, const TestQuery* q, size_t* accepted) {
+    GHashTable* scanned = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ft_iterate_filtered(ft, &q->query, collect_path, scanned);
+
+    bool ok = true;
+    for (guint i = 0; i < paths->len && ok; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        bool scan = g_hash_table_contains(scanned, path);
+        bool filter = filter_passes(q, path);
+        bool brute = brute_force_match(q, path);
+        bool scored = match_score(&q->needle, path) > SCORE_MIN;
+
+        const char* problem = NULL;
+        if (scan != filter) problem = "ft_iterate_filtered disagrees with the prefilter functions";
+        else if (brute && !filter) problem = "filter rejects an ordered subsequence";
+        else if (scored && !filter) problem = "filter rejects a path the scorer accepts";
+        else if (q->exact && filter != brute) problem = "filter is not exact for an ASCII query";
+
+        if (problem) {
+            fprintf(stderr, "%s\n  query: \"%s\"\n  path: %s\n  scan %d, filter %d, subsequence %d, scorer %d\n",
+                    problem, q->text, path, scan, filter, brute, scored);
+            ok = false;
+        }
+        *accepted += filter;
+    }
+
+    g_hash_table_destroy(scanned);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- check the file search prefilters");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    rng_state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)seed;
+    GPtrArray* paths = generate_paths((size_t)entry_target);
+
+    char** sorted = g_memdup2(paths->pdata, paths->len * sizeof(char*));
+    qsort(sorted, paths->len, sizeof(char*), compare_paths);
+    FileTable* ft = ft_create();
+    size_t indexed = ft_insert_batch(ft, (const char* const*)sorted, NULL, paths->len);
+    g_free(sorted);
+    if (indexed != paths->len) {
+        fprintf(stderr, "Indexed %zu of %u paths\n", indexed, paths->len);
+        return 1;
+    }
+
+    TestQuery* q = malloc(sizeof(TestQuery));
+    size_t accepted = 0;
+    bool ok = true;
+    for (gint i = 0; i < query_target && ok; i++) {
+        char* text = i % 4 == 3 ? random_query() : query_from_path(g_ptr_array_index(paths, rng_next() % paths->len));
+        test_query_init(q, text);
+        ok = check_query(ft, paths, q, &accepted);
+        g_free(text);
+    }
+
+    printf("%s: %u paths, %d queries, %zu accepted\n", ok ? "ok" : "FAILED", paths->len, query_target, accepted);
+    free(q);
+    ft_destroy(ft);
+    g_ptr_array_free(paths, TRUE);
+    return ok ? 0 : 1;
+}
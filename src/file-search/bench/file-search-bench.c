@@ -0,0 +1,435 @@
+// Standalone benchmark for the file index. Builds FileTables from a
+// synthetic tree or a list of real paths, times the operations searches
+// and index updates depend on and prints the results as one JSON object,
+// so runs can be diffed across commits. Needs no display.
+//
+//   file-search-bench [--entries N] [--paths FILE] [--threads N]
+//                     [--crawl-files N] [--seed N]
+
+#include "file-hashtable.h"
+#include "file-prefilter.h"
+#include "file-crawler.h"
+#include "file-tree-manager.h"
+#include "match.h"
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUERY_COUNT 32
+#define LOOKUP_SAMPLES 200000
+#define MAX_FOLDED 256
+
+static gint entry_target = 500000;
+static gchar* paths_file = NULL;
+static gint thread_count = 0;
+static gint crawl_files = 50000;
+static gint seed = 1;
+
+static GOptionEntry options[] = {
+    { "entries", 'n', 0, G_OPTION_ARG_INT, &entry_target, "Synthetic paths to generate", "N" },
+    { "paths", 'p', 0, G_OPTION_ARG_FILENAME, &paths_file, "Newline separated paths to use instead", "FILE" },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &thread_count, "Scan threads, 0 for one per CPU", "N" },
+    { "crawl-files", 'c', 0, G_OPTION_ARG_INT, &crawl_files, "Files in the crawled tree, 0 to skip", "N" },
+    { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed for generated paths and queries", "N" },
+    { NULL }
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static const char* const words[] = {
+    "src", "lib", "include", "test", "docs", "build", "assets", "config", "data", "scripts",
+    "core", "util", "net", "ui", "widgets", "models", "views", "cache", "tmp", "share",
+};
+static const char* const extensions[] = {
+    "c", "h", "vala", "py", "md", "txt", "json", "png", "jpg", "pdf", "rs", "go", "toml", "svg",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+#define EXTENSION_COUNT (sizeof(extensions) / sizeof(extensions[0]))
+
+// A home-directory-like tree: a few projects, each a few levels deep,
+// with skewed directory sizes.
+static GPtrArray* generate_paths(size_t n) {
+    GPtrArray* paths = g_ptr_array_new_full(n, g_free);
+    while (paths->len < n) {
+        GString* path = g_string_new("/home/user");
+        g_string_append_printf(path, "/project-%u", rng_next() % 32);
+
+        int depth = 1 + rng_next() % 4;
+        for (int d = 0; d < depth; d++) {
+            g_string_append_printf(path, "/%s", words[rng_next() % (WORD_COUNT / 2)]);
+            if (rng_next() % 8 == 0) g_string_append_printf(path, "%u", rng_next() % 4);
+        }
+
+        g_string_append_printf(path, "/%s_%s%u.%s", words[rng_next() % WORD_COUNT],
+                               words[rng_next() % WORD_COUNT], rng_next() % 1000,
+                               extensions[rng_next() % EXTENSION_COUNT]);
+        g_ptr_array_add(paths, g_string_free(path, FALSE));
+    }
+    return paths;
+}
+
+static GPtrArray* read_paths(const char* file) {
+    gchar* contents;
+    GError* error = NULL;
+    if (!g_file_get_contents(file, &contents, NULL, &error)) {
+        fprintf(stderr, "Failed to read %s: %s\n", file, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+    for (char* line = strtok(contents, "\n"); line; line = strtok(NULL, "\n")) {
+        if (line[0] == '/') g_ptr_array_add(paths, g_strdup(line));
+    }
+    g_free(contents);
+    return paths;
+}
+
+// Roughly what people type: a few characters of a file name in order,
+// sometimes with a character of the directory in front.
+static char* make_query(const char* path) {
+    const char* name = strrchr(path, '/') + 1;
+    size_t name_len = strlen(name);
+    GString* query = g_string_new(NULL);
+
+    if (rng_next() % 4 == 0) {
+        const char* dir = strrchr(path, '/');
+        while (dir > path && dir[-1] != '/') dir--;
+        if (dir > path) g_string_append_printf(query, "%c/", dir[0]);
+    }
+
+    size_t want = 3 + rng_next() % 3;
+    for (size_t i = 0; i < name_len && query->len < want + 2; i += 1 + rng_next() % 3) {
+        // Kept out so queries print as JSON strings as they are
+        if (name[i] == '"' || name[i] == '\\' || (unsigned char)name[i] < 0x20) continue;
+        g_string_append_c(query, name[i]);
+    }
+    return g_string_free(query, FALSE);
+}
+
+typedef struct {
+    needle_info needle;
+    uint32_t chars[MAX_FOLDED];
+    char leading[MAX_FOLDED];
+    char ordered[MAX_FOLDED];
+    FileQuery query;
+} BenchQuery;
+
+static void bench_query_init(BenchQuery* q, const char* text) {
+    int len = 0;
+    for (const char* c = text; *c && len < MAX_FOLDED; c++) q->chars[len++] = (unsigned char)*c;
+    q->needle = (needle_info){ .len = len, .capacity = MAX_FOLDED, .chars = q->chars, .unicode_upper = q->chars };
+
+    // The same filters file_tree_manager_tree_manager_shard sets up
+    memset(&q->query, 0, sizeof(q->query));
+    q->query.mask = fp_needle_mask(q->chars, len);
+    q->query.dir_len = fp_leading_components(q->chars, len, q->leading, sizeof(q->leading));
+    q->query.dir_chars = q->leading;
+    q->query.path_len = fp_ordered_chars(q->chars, len, q->ordered, sizeof(q->ordered));
+    q->query.path_chars = q->ordered;
+}
+
+static size_t table_bytes(const FileTable* ft) {
+    return ft->capacity +
+           ft->index_capacity * sizeof(uint32_t) +
+           (size_t)ft->slot_capacity * (sizeof(FileSlot) + sizeof(uint64_t) + sizeof(FileMeta)) +
+           (size_t)ft->free_capacity * sizeof(uint32_t) +
+           ft->dirs.capacity +
+           (size_t)ft->dirs.offsets_capacity * sizeof(uint32_t) +
+           (size_t)ft->dirs.bucket_count * sizeof(uint32_t) +
+           sizeof(FileTable);
+}
+
+typedef struct {
+    uint32_t* slots;
+    uint16_t* generations;
+    size_t count;
+} SlotList;
+
+static void collect_slot(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    SlotList* list = data;
+    list->slots[list->count] = slot;
+    list->generations[list->count] = generation;
+    list->count++;
+}
+
+typedef struct {
+    size_t candidates;
+    size_t matches;
+} ScanCounts;
+
+typedef struct {
+    FileTable* ft;
+    BenchQuery* queries;
+    size_t query_count;
+    bool filtered;
+    ScanCounts counts;
+    double seconds;
+} ScanJob;
+
+typedef struct {
+    ScanCounts counts;
+    const needle_info* needle;
+} ScoreContext;
+
+static void score_entry(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    ScoreContext* ctx = data;
+    ctx->counts.candidates++;
+    ctx->counts.matches += match_score(ctx->needle, path) > SCORE_MIN;
+}
+
+static void* scan_worker(void* data) {
+    ScanJob* job = data;
+    FileQuery unfiltered = { 0 };
+    double start = now_seconds();
+
+    for (size_t i = 0; i < job->query_count; i++) {
+        ScoreContext ctx = { { 0, 0 }, &job->queries[i].needle };
+        ft_iterate_filtered(job->ft, job->filtered ? &job->queries[i].query : &unfiltered, score_entry, &ctx);
+        job->counts.candidates += ctx.counts.candidates;
+        job->counts.matches += ctx.counts.matches;
+    }
+
+    job->seconds = now_seconds() - start;
+    return NULL;
+}
+
+// Every thread runs the full query list against the same table, as
+// concurrent searches of one shard would.
+static void bench_scan(FileTable* ft, BenchQuery* queries, size_t query_count,
+                       unsigned int threads, bool filtered, const char* name) {
+    ScanJob* jobs = calloc(threads, sizeof(ScanJob));
+    pthread_t* ids = calloc(threads, sizeof(pthread_t));
+
+    double start = now_seconds();
+    for (unsigned int t = 0; t < threads; t++) {
+        jobs[t] = (ScanJob){ ft, queries, query_count, filtered };
+        pthread_create(&ids[t], NULL, scan_worker, &jobs[t]);
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double wall = now_seconds() - start;
+
+    // The slowest thread bounds what one core sustains under contention
+    size_t per_thread = ft_size(ft) * query_count;
+    size_t entries = per_thread * threads;
+    ScanCounts total = { 0, 0 };
+    double busiest = 0;
+    for (unsigned int t = 0; t < threads; t++) {
+        total.candidates += jobs[t].counts.candidates;
+        total.matches += jobs[t].counts.matches;
+        if (jobs[t].seconds > busiest) busiest = jobs[t].seconds;
+    }
+
+    printf("    \"%s\": { \"threads\": %u, \"queries\": %zu, \"seconds\": %.6f, "
+           "\"entries_per_sec\": %.0f, \"entries_per_sec_per_thread\": %.0f, "
+           "\"scored\": %zu, \"matched\": %zu },\n",
+           name, threads, query_count * threads, wall,
+           entries / wall, per_thread / busiest,
+           total.candidates, total.matches);
+
+    free(jobs);
+    free(ids);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    return remove(path);
+}
+
+// Lays out crawl_files empty files below a temporary directory, crawls
+// them into the index and removes them again.
+static void bench_crawl(unsigned int threads) {
+    gchar* root = g_dir_make_tmp("file-search-bench-XXXXXX", NULL);
+    if (!root) {
+        fprintf(stderr, "Failed to create crawl directory\n");
+        return;
+    }
+
+    char path[PATH_MAX];
+    int dirs = 0;
+    for (int i = 0; i < crawl_files; i++) {
+        if (i % 64 == 0) {
+            // Fan out two levels so there is work to steal
+            snprintf(path, sizeof(path), "%s/%s%d", root, words[dirs % WORD_COUNT], dirs / 32);
+            mkdir(path, 0700);
+            snprintf(path, sizeof(path), "%s/%s%d/%s%d", root, words[dirs % WORD_COUNT], dirs / 32,
+                     words[(dirs * 7) % WORD_COUNT], dirs);
+            mkdir(path, 0700);
+            dirs++;
+        }
+        snprintf(path, sizeof(path), "%s/%s%d/%s%d/file%d.%s", root,
+                 words[(dirs - 1) % WORD_COUNT], (dirs - 1) / 32,
+                 words[((dirs - 1) * 7) % WORD_COUNT], dirs - 1, i, extensions[i % EXTENSION_COUNT]);
+        int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        if (fd >= 0) close(fd);
+    }
+
+    file_tree_manager_initialize(0);
+    FileCrawler* crawler = file_crawler_new(NULL, NULL);
+    int cancelled = 0;
+
+    double start = now_seconds();
+    file_crawler_add_root(crawler, root, 0, 64, true, false, NULL);
+    size_t indexed = file_crawler_run(crawler, threads, &cancelled);
+    double seconds = now_seconds() - start;
+
+    printf("  \"crawl\": { \"threads\": %u, \"directories\": %d, \"indexed\": %zu, "
+           "\"seconds\": %.6f, \"files_per_sec\": %.0f },\n",
+           threads, dirs * 2, indexed, seconds, indexed / seconds);
+
+    file_crawler_free(crawler);
+    file_tree_manager_cleanup();
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    g_free(root);
+}
+
+int main(int argc, char** argv) {
+    GError* error = NULL;
+    GOptionContext* context = g_option_context_new("- benchmark the file search index");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    rng_state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)seed;
+    unsigned int threads = thread_count > 0 ? (unsigned int)thread_count : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads == 0) threads = 1;
+
+    GPtrArray* paths = paths_file ? read_paths(paths_file) : generate_paths((size_t)entry_target);
+    if (!paths || paths->len == 0) {
+        fprintf(stderr, "No paths to index\n");
+        return 1;
+    }
+    size_t n = paths->len;
+    char** list = (char**)paths->pdata;
+
+    printf("{\n  \"source\": \"%s\",\n  \"paths\": %zu,\n  \"threads\": %u,\n",
+           paths_file ? "file" : "synthetic", n, threads);
+
+    // Inserting one at a time in crawl order is what file events do
+    FileTable* ft = ft_create();
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i++) {
+        ft_insert(ft, list[i]);
+    }
+    double single = now_seconds() - start;
+    ft_destroy(ft);
+
+    // Crawls hand over sorted batches
+    char** sorted = g_memdup2(list, n * sizeof(char*));
+    qsort(sorted, n, sizeof(char*), compare_paths);
+    ft = ft_create();
+    start = now_seconds();
+    ft_insert_batch(ft, (const char* const*)sorted, NULL, n);
+    double batch = now_seconds() - start;
+    size_t entries = ft_size(ft);
+
+    printf("  \"insert\": { \"entries\": %zu, \"single_per_sec\": %.0f, \"batch_per_sec\": %.0f },\n",
+           entries, n / single, n / batch);
+    printf("  \"memory\": { \"bytes\": %zu, \"bytes_per_entry\": %.1f, \"blob_bytes\": %zu, "
+           "\"directories\": %u },\n",
+           table_bytes(ft), (double)table_bytes(ft) / entries, ft->used, ft->dirs.count);
+
+    // Lookups of random indexed paths, by path and by slot handle
+    SlotList handles = { malloc(entries * sizeof(uint32_t)), malloc(entries * sizeof(uint16_t)), 0 };
+    ft_iterate(ft, collect_slot, &handles);
+
+    size_t samples = LOOKUP_SAMPLES;
+    size_t hits = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < samples; i++) {
+        hits += ft_contains(ft, list[rng_next() % n]);
+    }
+    double contains = now_seconds() - start;
+
+    start = now_seconds();
+    for (size_t i = 0; i < samples; i++) {
+        size_t k = rng_next() % handles.count;
+        char* path = ft_lookup_by_slot(ft, handles.slots[k], handles.generations[k], NULL);
+        hits += path != NULL;
+        free(path);
+    }
+    double by_slot = now_seconds() - start;
+
+    printf("  \"lookup\": { \"samples\": %zu, \"hits\": %zu, \"contains_ns\": %.1f, \"by_slot_ns\": %.1f },\n",
+           samples * 2, hits, contains / samples * 1e9, by_slot / samples * 1e9);
+    free(handles.slots);
+    free(handles.generations);
+
+    BenchQuery* queries = calloc(QUERY_COUNT, sizeof(BenchQuery));
+    printf("  \"queries\": [");
+    for (size_t i = 0; i < QUERY_COUNT; i++) {
+        char* text = make_query(list[rng_next() % n]);
+        bench_query_init(&queries[i], text);
+        printf("%s\"%s\"", i ? ", " : "", text);
+        g_free(text);
+    }
+    printf("],\n  \"scan\": {\n");
+
+    // Scoring every entry against scoring what the filters let through,
+    // on one thread and on all of them
+    bench_scan(ft, queries, QUERY_COUNT, 1, false, "unfiltered_1");
+    bench_scan(ft, queries, QUERY_COUNT, 1, true, "filtered_1");
+    bench_scan(ft, queries, QUERY_COUNT, threads, true, "filtered_all");
+    printf("    \"entries\": %zu\n  },\n", entries);
+
+    // Drop every other path, sorted, then half of the rest one by one;
+    // both trigger compaction along the way
+    size_t half = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        sorted[half++] = sorted[i];
+    }
+    start = now_seconds();
+    size_t removed = ft_remove_batch(ft, (const char* const*)sorted, half);
+    double remove_batch = now_seconds() - start;
+
+    size_t removed_single = 0;
+    start = now_seconds();
+    for (size_t i = 1; i < n; i += 4) {
+        removed_single += ft_remove(ft, list[i]);
+    }
+    double remove_single = now_seconds() - start;
+
+    printf("  \"remove\": { \"batch\": %zu, \"batch_per_sec\": %.0f, \"single\": %zu, "
+           "\"single_per_sec\": %.0f, \"remaining\": %zu, \"bytes_per_entry\": %.1f },\n",
+           removed, removed / remove_batch, removed_single,
+           removed_single / remove_single, ft_size(ft),
+           ft_size(ft) ? (double)table_bytes(ft) / ft_size(ft) : 0.0);
+
+    ft_destroy(ft);
+    free(queries);
+    g_free(sorted);
+    g_ptr_array_free(paths, TRUE);
+
+    if (crawl_files > 0) bench_crawl(threads);
+    printf("  \"ok\": true\n}\n");
+    return 0;
+}
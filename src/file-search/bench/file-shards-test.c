@@ -0,0 +1,96 @@
+// Checks that the directory sharding policy can rebalance an index loaded
+// from a snapshot. Loading drops the group routes, and balancing a shard
+// used to look the kept groups up in the shards while holding the lock of
+// the one being split, which never returned. Builds one shard holding well
+// over its share, snapshots it, loads it back and adds a file to that
+// shard, then checks every path is still indexed. Meant to run under a
+// timeout.
+
+#include "file-tree-manager.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The shard size above which the index adapts, as in file-tree-manager.c
+#define TARGET_SHARD_SIZE 65536
+#define GROUP_FILES 1024
+#define CONFIG_HASH 0x5eed
+
+static void add_group(GPtrArray* paths, const char* group, size_t first, size_t n) {
+    GPtrArray* batch = g_ptr_array_new_with_free_func(g_free);
+    for (size_t i = first; i < first + n; i++) {
+        g_ptr_array_add(batch, g_strdup_printf("%sfile%06zu", group, i));
+    }
+    file_tree_manager_add_batch((char* const*)batch->pdata, batch->len);
+
+    if (paths) {
+        for (guint i = 0; i < batch->len; i++) {
+            g_ptr_array_add(paths, g_strdup(g_ptr_array_index(batch, i)));
+        }
+    }
+    g_ptr_array_free(batch, TRUE);
+}
+
+int main(void) {
+    file_tree_manager_set_shard_policy(FILE_TREE_SHARD_BY_DIRECTORY);
+    file_tree_manager_initialize(0);
+
+    // Grow to enough shards for one of them to hold over twice its share,
+    // then empty them again; shards never shrink
+    for (unsigned int g = 0; file_tree_manager_get_shard_count() < 4; g++) {
+        gchar* group = g_strdup_printf("/fill/%u/x/y/", g);
+        add_group(NULL, group, 0, GROUP_FILES);
+        g_free(group);
+    }
+    file_tree_manager_remove_subtree("/fill");
+    unsigned int count = file_tree_manager_get_shard_count();
+
+    // All shards are empty, so the lowest ones are picked first: the large
+    // group lands on shard 0, one small group on each other shard, and the
+    // movable group back on shard 0 as the least loaded one
+    GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+    const char* large = "/home/user/large/x/";
+    const char* movable = "/home/user/movable/x/";
+    add_group(paths, large, 0, 1);
+    for (unsigned int i = 1; i < count; i++) {
+        gchar* group = g_strdup_printf("/home/user/small%u/x/", i);
+        add_group(paths, group, 0, 2);
+        g_free(group);
+    }
+    add_group(paths, movable, 0, GROUP_FILES);
+    // Shard 0 exactly at the target, so nothing adapts before the snapshot
+    add_group(paths, large, 1, TARGET_SHARD_SIZE - GROUP_FILES - 1);
+
+    gchar* dir = g_dir_make_tmp("file-shards-test-XXXXXX", NULL);
+    gchar* snapshot = g_build_filename(dir, "snapshot", NULL);
+    bool ok = file_tree_manager_save_snapshot(snapshot, CONFIG_HASH);
+    if (!ok) fprintf(stderr, "Failed to save the snapshot\n");
+
+    if (ok) {
+        file_tree_manager_initialize(0);
+        ok = file_tree_manager_load_snapshot(snapshot, CONFIG_HASH);
+        if (!ok) fprintf(stderr, "Failed to load the snapshot\n");
+    }
+
+    if (ok) {
+        // Tips shard 0 over the target and into a balance
+        add_group(paths, large, TARGET_SHARD_SIZE, 1);
+        for (guint i = 0; i < paths->len && ok; i++) {
+            if (!file_tree_manager_contains(g_ptr_array_index(paths, i))) {
+                fprintf(stderr, "Lost %s\n", (char*)g_ptr_array_index(paths, i));
+                ok = false;
+            }
+        }
+    }
+
+    printf("%s: %u shards, %u paths\n", ok ? "ok" : "FAILED", count, paths->len);
+    file_tree_manager_cleanup();
+    unlink(snapshot);
+    rmdir(dir);
+    g_free(snapshot);
+    g_free(dir);
+    g_ptr_array_free(paths, TRUE);
+    return ok ? 0 : 1;
+}
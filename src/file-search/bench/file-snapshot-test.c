@@ -0,0 +1,122 @@
+// Checks that ft_create_from_image turns down damaged images, as a
+// corrupt snapshot file would map them, instead of handing scans entries
+// that loop or read out of bounds. Exports a table, damages one invariant
+// per copy and expects each copy to be refused while the intact one loads
+// and iterates in full.
+
+#include "file-hashtable.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_COUNT 2000
+
+typedef void (*Damage)(FileTableImage* image);
+
+static FileEntry* entry_at_index(FileTableImage* image, size_t i) {
+    return (FileEntry*)(image->data + image->index[i]);
+}
+
+static void zero_entry_size(FileTableImage* image) {
+    entry_at_index(image, image->count / 2)->entry_size = 0;
+}
+
+static void oversized_entry(FileTableImage* image) {
+    entry_at_index(image, image->count - 1)->entry_size = (uint32_t)image->used * 2;
+}
+
+static void index_past_data(FileTableImage* image) {
+    image->index[image->count / 3] = (uint32_t)image->used + 64;
+}
+
+static void slot_past_data(FileTableImage* image) {
+    image->slots[entry_at_index(image, 0)->slot].offset = (uint32_t)image->used;
+}
+
+static void unknown_directory(FileTableImage* image) {
+    entry_at_index(image, image->count / 4)->dir = image->dir_count;
+}
+
+static void directory_past_data(FileTableImage* image) {
+    image->dir_offsets[image->dir_count - 1] = (uint32_t)image->dir_used;
+}
+
+static void unterminated_name(FileTableImage* image) {
+    FileEntry* entry = entry_at_index(image, 1);
+    memset(entry->name, 'a', entry->entry_size - sizeof(FileEntry));
+}
+
+static void unknown_bucket(FileTableImage* image) {
+    for (uint32_t i = 0; i < image->dir_bucket_count; i++) {
+        if (image->dir_buckets[i] == 0) {
+            image->dir_buckets[i] = image->dir_count + 1;
+            return;
+        }
+    }
+}
+
+static const struct {
+    const char* name;
+    Damage damage;
+} damages[] = {
+    { "zero entry size", zero_entry_size },
+    { "entry past the data", oversized_entry },
+    { "index past the data", index_past_data },
+    { "slot past the data", slot_past_data },
+    { "unknown directory id", unknown_directory },
+    { "directory past its data", directory_past_data },
+    { "unterminated name", unterminated_name },
+    { "unknown directory bucket", unknown_bucket },
+};
+
+static void count_entry(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    (*(size_t*)data)++;
+}
+
+int main(void) {
+    FileTable* ft = ft_create();
+    for (int i = 0; i < ENTRY_COUNT; i++) {
+        gchar* path = g_strdup_printf("/home/user/dir%d/sub%d/file%d.txt", i % 37, i % 5, i);
+        ft_insert(ft, path);
+        g_free(path);
+    }
+    // Leave a tombstone behind too
+    ft_remove(ft, "/home/user/dir0/sub0/file0.txt");
+
+    bool ok = true;
+    FileTableImage image;
+    if (!ft_export(ft, &image)) {
+        fprintf(stderr, "Failed to export the table\n");
+        return 1;
+    }
+
+    FileTable* loaded = ft_create_from_image(&image);
+    size_t seen = 0;
+    if (loaded) ft_iterate(loaded, count_entry, &seen);
+    if (!loaded || seen != ft_size(ft)) {
+        fprintf(stderr, "Intact image did not load: %zu of %zu entries\n", seen, ft_size(ft));
+        ok = false;
+    }
+    ft_destroy(loaded);
+    ft_image_free(&image);
+
+    for (size_t i = 0; i < G_N_ELEMENTS(damages); i++) {
+        if (!ft_export(ft, &image)) {
+            fprintf(stderr, "Failed to export the table\n");
+            return 1;
+        }
+        damages[i].damage(&image);
+        loaded = ft_create_from_image(&image);
+        if (loaded) {
+            fprintf(stderr, "Accepted an image with %s\n", damages[i].name);
+            ft_destroy(loaded);
+            ok = false;
+        }
+        ft_image_free(&image);
+    }
+
+    printf("%s: %zu damaged images\n", ok ? "ok" : "FAILED", G_N_ELEMENTS(damages));
+    ft_destroy(ft);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include "file-crawler.h"
+#include "file-tree-manager.h"
+#include "file-gitignore.h"
+#include "file-hashtable.h"
+#include <glib.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE_SIZE 64
+#define MAX_CRAWL_THREADS 8
+#define DENTS_BUFFER_SIZE 32768
+// Paths a worker collects before handing them to the index
+#define CRAWL_BATCH 512
+// Failed steal attempts before an idle worker parks
+#define IDLE_SPINS 64
+// Parked workers recheck this often in case a wakeup raced their sleep
+#define IDLE_PARK_NS 1000000
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    unsigned int max_depth;
+    bool show_hidden;
+    bool respect_gitignore;
+} CrawlRoot;
+
+typedef struct {
+    char* path;
+    int depth;
+    const CrawlRoot* root;
+    GitignoreMatcher* ignore;
+} DirWork;
+
+typedef struct {
+    atomic_flag lock;
+    DirWork** items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} __attribute__((aligned(CACHE_LINE_SIZE))) WorkDeque;
+
+typedef struct {
+    WorkDeque deque;
+    FileCrawler* crawler;
+    unsigned int id;
+    pthread_t thread;
+    size_t indexed;
+    size_t batch_len;
+    char* batch[CRAWL_BATCH];
+    uint8_t batch_types[CRAWL_BATCH];
+    char path[PATH_MAX];
+    char dents[DENTS_BUFFER_SIZE];
+} Worker;
+
+struct FileCrawler {
+    FileCrawlerDirectoryFunc on_directory;
+    void* user_data;
+    GHashTable* suffixes;
+    GHashTable* excluded;
+    GPtrArray* roots;
+    GPtrArray* pending;
+    // Matchers of the directories above added roots, by path
+    GHashTable* ancestors;
+
+    Worker** workers;
+    unsigned int worker_count;
+    // Started by worker 0 on the calling thread, which also joins them
+    atomic_bool helpers_started;
+    unsigned int helper_count;
+    atomic_size_t outstanding;
+    const int* cancelled;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_uint sleepers;
+};
+
+static inline void spin_lock(atomic_flag* lock) {
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+        __builtin_ia32_pause();
+    }
+}
+
+static inline void spin_unlock(atomic_flag* lock) {
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static inline bool is_cancelled(const FileCrawler* crawler) {
+    return crawler->cancelled && __atomic_load_n(crawler->cancelled, __ATOMIC_RELAXED) != 0;
+}
+
+static bool has_ignored_suffix(const FileCrawler* crawler, const char* name) {
+    const char* dot = strrchr(name, '.');
+    return dot && g_hash_table_contains(crawler->suffixes, dot);
+}
+
+// Fails only when the deque cannot grow; the work stays the caller's.
+static bool deque_push(WorkDeque* deque, DirWork* work) {
+    spin_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(DirWork*));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            DirWork** items = realloc(deque->items, capacity * sizeof(DirWork*));
+            if (!items) {
+                spin_unlock(&deque->lock);
+                return false;
+            }
+            deque->items = items;
+            deque->capacity = capacity;
+        }
+    }
+    deque->items[deque->tail++] = work;
+    spin_unlock(&deque->lock);
+    return true;
+}
+
+// The owner takes the most recently pushed directory, which keeps its
+// walk depth first and its path buffer and dentry cache warm.
+static DirWork* deque_pop(WorkDeque* deque) {
+    spin_lock(&deque->lock);
+    DirWork* work = NULL;
+    if (deque->tail > deque->head) {
+        work = deque->items[--deque->tail];
+        if (deque->tail == deque->head) deque->head = deque->tail = 0;
+    }
+    spin_unlock(&deque->lock);
+    return work;
+}
+
+// Thieves take the oldest directory, the one nearest the root and so
+// likely the largest remaining subtree.
+static DirWork* deque_steal(WorkDeque* deque) {
+    spin_lock(&deque->lock);
+    DirWork* work = NULL;
+    if (deque->tail > deque->head) {
+        work = deque->items[deque->head++];
+    }
+    spin_unlock(&deque->lock);
+    return work;
+}
+
+static size_t deque_size(WorkDeque* deque) {
+    spin_lock(&deque->lock);
+    size_t size = deque->tail - deque->head;
+    spin_unlock(&deque->lock);
+    return size;
+}
+
+static void free_work(DirWork* work) {
+    gitignore_matcher_unref(work->ignore);
+    free(work->path);
+    free(work);
+}
+
+// Skips a directory that cannot be queued, like ft_insert skips an entry
+// it cannot store.
+static bool queue_work(FileCrawler* crawler, WorkDeque* deque, DirWork* work) {
+    atomic_fetch_add_explicit(&crawler->outstanding, 1, memory_order_relaxed);
+    if (deque_push(deque, work)) return true;
+
+    fprintf(stderr, "Out of memory, not crawling %s\n", work->path);
+    atomic_fetch_sub_explicit(&crawler->outstanding, 1, memory_order_relaxed);
+    free_work(work);
+    return false;
+}
+
+static void push_work(Worker* worker, const char* path, int depth, const CrawlRoot* root, GitignoreMatcher* ignore) {
+    DirWork* work = malloc(sizeof(DirWork));
+    char* copy = strdup(path);
+    if (!work || !copy) {
+        free(work);
+        free(copy);
+        return;
+    }
+
+    work->path = copy;
+    work->depth = depth;
+    work->root = root;
+    work->ignore = gitignore_matcher_ref(ignore);
+
+    FileCrawler* crawler = worker->crawler;
+    if (!queue_work(crawler, &worker->deque, work)) return;
+
+    if (atomic_load_explicit(&crawler->sleepers, memory_order_acquire) > 0) {
+        pthread_mutex_lock(&crawler->idle_lock);
+        pthread_cond_signal(&crawler->idle_cond);
+        pthread_mutex_unlock(&crawler->idle_lock);
+    }
+}
+
+static void flush_batch(Worker* worker) {
+    file_tree_manager_add_typed_batch(worker->batch, worker->batch_types, worker->batch_len);
+    for (size_t i = 0; i < worker->batch_len; i++) {
+        free(worker->batch[i]);
+    }
+    worker->indexed += worker->batch_len;
+    worker->batch_len = 0;
+}
+
+static void batch_add(Worker* worker, const char* path, uint8_t type) {
+    char* copy = strdup(path);
+    if (!copy) return;
+
+    worker->batch_types[worker->batch_len] = type;
+    worker->batch[worker->batch_len++] = copy;
+    if (worker->batch_len == CRAWL_BATCH) flush_batch(worker);
+}
+
+static inline uint8_t entry_type(const struct linux_dirent64* entry) {
+    switch (entry->d_type) {
+        case DT_REG: return FT_TYPE_FILE;
+        case DT_DIR: return FT_TYPE_DIRECTORY;
+        case DT_LNK: return FT_TYPE_SYMLINK;
+        default: return FT_TYPE_UNKNOWN;
+    }
+}
+
+// Git matches links as files, so they are not followed here
+static bool entry_is_own_directory(int dir_fd, const struct linux_dirent64* entry) {
+    if (entry->d_type != DT_UNKNOWN) return entry->d_type == DT_DIR;
+
+    struct stat st;
+    return fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool entry_is_directory(int dir_fd, const struct linux_dirent64* entry) {
+    if (entry->d_type == DT_DIR) return true;
+    if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) return false;
+
+    // Links are followed, as opening them by path would
+    struct stat st;
+    return fstatat(dir_fd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void start_helpers(FileCrawler* crawler);
+
+static void process_directory(Worker* worker, DirWork* work) {
+    FileCrawler* crawler = worker->crawler;
+    const CrawlRoot* root = work->root;
+
+    int fd = open(work->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOTDIR && errno != ENOENT) {
+            fprintf(stderr, "Error enumerating directory %s: %s\n", work->path, strerror(errno));
+        }
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        file_tree_manager_record_directory_mtime(work->path,
+            (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    }
+    if (crawler->on_directory) crawler->on_directory(work->path, crawler->user_data);
+
+    GitignoreMatcher* ignore = root->respect_gitignore
+        ? gitignore_matcher_load(work->ignore, work->path, fd)
+        : gitignore_matcher_ref(work->ignore);
+
+    size_t prefix_len = strlen(work->path);
+    memcpy(worker->path, work->path, prefix_len);
+    if (prefix_len == 0 || worker->path[prefix_len - 1] != '/') {
+        worker->path[prefix_len++] = '/';
+    }
+
+    bool descend = (unsigned int)(work->depth + 1) < root->max_depth;
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, worker->dents, DENTS_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; offset < nread;) {
+            const struct linux_dirent64* entry = (const struct linux_dirent64*)(worker->dents + offset);
+            offset += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (!root->show_hidden && name[0] == '.') continue;
+            if (has_ignored_suffix(crawler, name)) continue;
+
+            size_t name_len = strlen(name);
+            if (prefix_len + name_len >= PATH_MAX) continue;
+            memcpy(worker->path + prefix_len, name, name_len + 1);
+
+            if (ignore && gitignore_matcher_matches(ignore, worker->path, prefix_len + name_len, prefix_len,
+                                                    entry_is_own_directory(fd, entry))) {
+                continue;
+            }
+
+            if (g_hash_table_contains(crawler->excluded, worker->path)) continue;
+
+            batch_add(worker, worker->path, entry_type(entry));
+            if (descend && entry_is_directory(fd, entry)) {
+                push_work(worker, worker->path, work->depth + 1, root, ignore);
+            }
+        }
+        if (is_cancelled(crawler)) break;
+    }
+    close(fd);
+    gitignore_matcher_unref(ignore);
+
+    if (worker->id == 0 && !atomic_load_explicit(&crawler->helpers_started, memory_order_relaxed) &&
+        deque_size(&worker->deque) > 1) {
+        start_helpers(crawler);
+    }
+}
+
+static DirWork* steal_work(Worker* worker) {
+    FileCrawler* crawler = worker->crawler;
+    for (unsigned int i = 1; i < crawler->worker_count; i++) {
+        Worker* victim = crawler->workers[(worker->id + i) % crawler->worker_count];
+        DirWork* work = deque_steal(&victim->deque);
+        if (work) return work;
+    }
+    return NULL;
+}
+
+// Sleeps until a directory is pushed or the crawl ends. A spinning worker
+// would compete for the CPU with the ones that still have work.
+static void park(FileCrawler* crawler) {
+    pthread_mutex_lock(&crawler->idle_lock);
+    atomic_fetch_add_explicit(&crawler->sleepers, 1, memory_order_acq_rel);
+
+    if (atomic_load_explicit(&crawler->outstanding, memory_order_acquire) != 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += IDLE_PARK_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&crawler->idle_cond, &crawler->idle_lock, &deadline);
+    }
+
+    atomic_fetch_sub_explicit(&crawler->sleepers, 1, memory_order_acq_rel);
+    pthread_mutex_unlock(&crawler->idle_lock);
+}
+
+static void* worker_main(void* data) {
+    Worker* worker = data;
+    FileCrawler* crawler = worker->crawler;
+    unsigned int idle = 0;
+
+    while (true) {
+        DirWork* work = deque_pop(&worker->deque);
+        if (!work) work = steal_work(worker);
+
+        if (work) {
+            idle = 0;
+            if (!is_cancelled(crawler)) process_directory(worker, work);
+            free_work(work);
+
+            if (atomic_fetch_sub_explicit(&crawler->outstanding, 1, memory_order_acq_rel) == 1) {
+                pthread_mutex_lock(&crawler->idle_lock);
+                pthread_cond_broadcast(&crawler->idle_cond);
+                pthread_mutex_unlock(&crawler->idle_lock);
+            }
+            continue;
+        }
+
+        if (atomic_load_explicit(&crawler->outstanding, memory_order_acquire) == 0) break;
+
+        // Nothing to steal right now; publish what we have meanwhile
+        if (idle++ == 0) flush_batch(worker);
+        if (idle < IDLE_SPINS) {
+            __builtin_ia32_pause();
+        } else {
+            park(crawler);
+        }
+    }
+
+    flush_batch(worker);
+    return NULL;
+}
+
+static void start_helpers(FileCrawler* crawler) {
+    atomic_store_explicit(&crawler->helpers_started, true, memory_order_relaxed);
+    for (unsigned int i = 1; i < crawler->worker_count; i++) {
+        Worker* worker = crawler->workers[i];
+        // Whatever started still drains every deque
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) break;
+        crawler->helper_count = i;
+    }
+}
+
+FileCrawler* file_crawler_new(FileCrawlerDirectoryFunc on_directory, void* user_data) {
+    FileCrawler* crawler = calloc(1, sizeof(FileCrawler));
+    if (!crawler) return NULL;
+
+    crawler->on_directory = on_directory;
+    crawler->user_data = user_data;
+    crawler->suffixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    crawler->excluded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    crawler->roots = g_ptr_array_new_with_free_func(free);
+    crawler->pending = g_ptr_array_new();
+    crawler->ancestors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)gitignore_matcher_unref);
+    pthread_mutex_init(&crawler->idle_lock, NULL);
+    pthread_cond_init(&crawler->idle_cond, NULL);
+    return crawler;
+}
+
+void file_crawler_free(FileCrawler* crawler) {
+    if (!crawler) return;
+
+    for (guint i = 0; i < crawler->pending->len; i++) {
+        free_work(g_ptr_array_index(crawler->pending, i));
+    }
+    g_ptr_array_free(crawler->pending, TRUE);
+    g_ptr_array_free(crawler->roots, TRUE);
+    g_hash_table_destroy(crawler->ancestors);
+    g_hash_table_destroy(crawler->excluded);
+    g_hash_table_destroy(crawler->suffixes);
+    pthread_cond_destroy(&crawler->idle_cond);
+    pthread_mutex_destroy(&crawler->idle_lock);
+    free(crawler);
+}
+
+void file_crawler_ignore_suffix(FileCrawler* crawler, const char* suffix) {
+    g_hash_table_add(crawler->suffixes, g_strdup(suffix));
+}
+
+void file_crawler_exclude(FileCrawler* crawler, const char* path) {
+    g_hash_table_add(crawler->excluded, g_strdup(path));
+}
+
+// Returns the matcher in effect inside dir: the .gitignore files of
+// every directory from top down to dir, top's own included. A borrowed
+// reference, cached for the other roots below the same directory.
+static GitignoreMatcher* ancestor_matcher(FileCrawler* crawler, const char* top, const char* dir) {
+    size_t top_len = strlen(top);
+    size_t dir_len = strlen(dir);
+    if (dir_len < top_len || strncmp(dir, top, top_len) != 0) return NULL;
+
+    GitignoreMatcher* matcher = NULL;
+    char path[PATH_MAX];
+    if (dir_len >= sizeof(path)) return NULL;
+    memcpy(path, dir, dir_len + 1);
+
+    // Walk down from top one component at a time
+    size_t end = top_len;
+    while (true) {
+        char saved = path[end];
+        path[end] = '\0';
+
+        GitignoreMatcher* cached = NULL;
+        if (g_hash_table_lookup_extended(crawler->ancestors, path, NULL, (gpointer*)&cached)) {
+            matcher = cached;
+        } else {
+            int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            GitignoreMatcher* loaded = fd >= 0
+                ? gitignore_matcher_load(matcher, path, fd)
+                : gitignore_matcher_ref(matcher);
+            if (fd >= 0) close(fd);
+            g_hash_table_insert(crawler->ancestors, g_strdup(path), loaded);
+            matcher = loaded;
+        }
+
+        path[end] = saved;
+        if (end >= dir_len) break;
+
+        end++;
+        while (end < dir_len && path[end] != '/') {
+            end++;
+        }
+    }
+    return matcher;
+}
+
+// Roots below a configured directory get the checks their parent's
+// listing would have applied.
+static bool root_is_skipped(FileCrawler* crawler, const char* path, const CrawlRoot* root,
+                            GitignoreMatcher* ignore) {
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+
+    if (!root->show_hidden && name[0] == '.') return true;
+    if (g_hash_table_contains(crawler->excluded, path)) return true;
+
+    // Roots queued from change events may be gone by the time they run
+    struct stat st;
+    if (lstat(path, &st) != 0) return errno == ENOENT || errno == ENOTDIR;
+    if (!ignore) return false;
+
+    return gitignore_matcher_matches(ignore, path, strlen(path), name - path, S_ISDIR(st.st_mode));
+}
+
+void file_crawler_add_root(FileCrawler* crawler, const char* path, int depth, unsigned int max_depth,
+                           bool show_hidden, bool respect_gitignore, const char* gitignore_top) {
+    CrawlRoot* root = malloc(sizeof(CrawlRoot));
+    DirWork* work = malloc(sizeof(DirWork));
+    if (!root || !work) {
+        free(root);
+        free(work);
+        return;
+    }
+
+    root->max_depth = max_depth;
+    root->show_hidden = show_hidden;
+    root->respect_gitignore = respect_gitignore;
+    g_ptr_array_add(crawler->roots, root);
+
+    GitignoreMatcher* ignore = NULL;
+    if (respect_gitignore && gitignore_top && depth > 0) {
+        char* dir = g_path_get_dirname(path);
+        ignore = ancestor_matcher(crawler, gitignore_top, dir);
+        g_free(dir);
+    }
+
+    if (depth > 0 && root_is_skipped(crawler, path, root, ignore)) {
+        free(work);
+        return;
+    }
+
+    work->path = strdup(path);
+    work->depth = depth;
+    work->root = root;
+    work->ignore = gitignore_matcher_ref(ignore);
+    g_ptr_array_add(crawler->pending, work);
+}
+
+static unsigned int default_thread_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > MAX_CRAWL_THREADS ? MAX_CRAWL_THREADS : (unsigned int)cpus;
+}
+
+size_t file_crawler_run(FileCrawler* crawler, unsigned int threads, const int* cancelled) {
+    if (threads == 0) threads = default_thread_count();
+    if (threads > MAX_CRAWL_THREADS) threads = MAX_CRAWL_THREADS;
+
+    crawler->workers = calloc(threads, sizeof(Worker*));
+    if (!crawler->workers) return 0;
+
+    crawler->worker_count = 0;
+    for (unsigned int i = 0; i < threads; i++) {
+        Worker* worker = aligned_alloc(CACHE_LINE_SIZE, sizeof(Worker));
+        if (!worker) break;
+        memset(worker, 0, sizeof(Worker));
+        atomic_flag_clear(&worker->deque.lock);
+        worker->crawler = crawler;
+        worker->id = i;
+        crawler->workers[crawler->worker_count++] = worker;
+    }
+    if (crawler->worker_count == 0) {
+        free(crawler->workers);
+        crawler->workers = NULL;
+        return 0;
+    }
+
+    crawler->cancelled = cancelled;
+    atomic_store(&crawler->helpers_started, false);
+    crawler->helper_count = 0;
+    atomic_store(&crawler->outstanding, 0);
+
+    // Roots are indexed themselves and entered when they may have children
+    Worker* main_worker = crawler->workers[0];
+    for (guint i = 0; i < crawler->pending->len; i++) {
+        DirWork* work = g_ptr_array_index(crawler->pending, i);
+        const char* base = work->path ? strrchr(work->path, '/') : NULL;
+
+        if (!work->path || has_ignored_suffix(crawler, base ? base + 1 : work->path)) {
+            free_work(work);
+            continue;
+        }
+
+        batch_add(main_worker, work->path, FT_TYPE_UNKNOWN);
+        if ((unsigned int)work->depth < work->root->max_depth) {
+            queue_work(crawler, &main_worker->deque, work);
+        } else {
+            free_work(work);
+        }
+    }
+    g_ptr_array_set_size(crawler->pending, 0);
+
+    worker_main(main_worker);
+
+    for (unsigned int i = 1; i <= crawler->helper_count; i++) {
+        pthread_join(crawler->workers[i]->thread, NULL);
+    }
+
+    size_t indexed = 0;
+    for (unsigned int i = 0; i < crawler->worker_count; i++) {
+        Worker* worker = crawler->workers[i];
+        indexed += worker->indexed;
+        free(worker->deque.items);
+        free(worker);
+    }
+    free(crawler->workers);
+    crawler->workers = NULL;
+    crawler->worker_count = 0;
+    return indexed;
+}
@@ -0,0 +1,43 @@
+#ifndef FILE_CRAWLER_H
+#define FILE_CRAWLER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Walks directory trees into the file index with a bounded pool of worker
+// threads. Each worker owns a deque of directories: it pushes and pops at
+// the back and idle workers steal from the front, so a worker keeps
+// descending into its own subtree while siblings spread across the pool.
+// Entries are typed by getdents64's d_type; only directories are opened
+// and only entries the kernel could not type are stat'ed.
+
+typedef struct FileCrawler FileCrawler;
+
+// Called from a worker thread for every directory the crawler enters.
+typedef void (*FileCrawlerDirectoryFunc)(const char* path, void* user_data);
+
+FileCrawler* file_crawler_new(FileCrawlerDirectoryFunc on_directory, void* user_data);
+void file_crawler_free(FileCrawler* crawler);
+
+// Entries whose extension, from the last '.' of the name, equals suffix
+// are neither indexed nor descended into.
+void file_crawler_ignore_suffix(FileCrawler* crawler, const char* suffix);
+
+// Paths that are crawled as roots of their own and must not be entered
+// from a parent root.
+void file_crawler_exclude(FileCrawler* crawler, const char* path);
+
+// Indexes path and, while depth < max_depth, everything below it. A root
+// below its configured directory, gitignore_top, is first checked the way
+// its parent's listing would check it, against the hidden flag, the
+// excluded paths and the .gitignore files from gitignore_top down.
+void file_crawler_add_root(FileCrawler* crawler, const char* path, int depth, unsigned int max_depth,
+                           bool show_hidden, bool respect_gitignore, const char* gitignore_top);
+
+// Crawls every root added so far on the calling thread plus up to
+// threads - 1 helpers, 0 choosing one per CPU. Helpers only start once
+// there is more than one directory to share. Returns the number of paths
+// indexed; stops early once *cancelled becomes nonzero.
+size_t file_crawler_run(FileCrawler* crawler, unsigned int threads, const int* cancelled);
+
+#endif // FILE_CRAWLER_H
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include "file-events.h"
+#include "file-tree-manager.h"
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    // The path was in the index before the window and has to go
+    bool remove;
+    // The path exists at the end of the window and has to be crawled
+    bool add;
+    // The path did not exist before the window, so deleting it again
+    // leaves nothing to do
+    bool created;
+} PathState;
+
+typedef struct {
+    char* from;
+    char* to;
+} Rename;
+
+struct FileEventQueue {
+    FileEventAddedFunc on_added;
+    void* added_data;
+    FileCrawlerDirectoryFunc on_directory;
+    void* directory_data;
+    unsigned int window_ms;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+
+    // Coalesced state of the current window
+    GHashTable* states;
+    GPtrArray* renames;
+    // A MOVED_FROM waiting for its MOVED_TO, and how many flushes it has
+    // already waited through
+    char* moved_from;
+    unsigned int moved_from_age;
+};
+
+static void rename_free(gpointer data) {
+    Rename* rename = data;
+    g_free(rename->from);
+    g_free(rename->to);
+    g_free(rename);
+}
+
+static void reset_window(FileEventQueue* queue) {
+    queue->states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    queue->renames = g_ptr_array_new_with_free_func(rename_free);
+}
+
+static bool window_is_empty(const FileEventQueue* queue) {
+    return g_hash_table_size(queue->states) == 0 && queue->renames->len == 0 && !queue->moved_from;
+}
+
+static PathState* state_for(FileEventQueue* queue, const char* path, bool* fresh) {
+    PathState* state = g_hash_table_lookup(queue->states, path);
+    *fresh = state == NULL;
+    if (!state) {
+        state = g_new0(PathState, 1);
+        g_hash_table_insert(queue->states, g_strdup(path), state);
+    }
+    return state;
+}
+
+static void apply_added(FileEventQueue* queue, const char* path, bool created) {
+    bool fresh;
+    PathState* state = state_for(queue, path, &fresh);
+    state->add = true;
+    if (fresh) state->created = created;
+}
+
+static void apply_deleted(FileEventQueue* queue, const char* path) {
+    bool fresh;
+    PathState* state = state_for(queue, path, &fresh);
+    if (state->created && !state->remove) {
+        g_hash_table_remove(queue->states, path);
+        return;
+    }
+    state->remove = true;
+    state->add = false;
+    state->created = false;
+}
+
+// Re-keys pending states of paths below from to the same place below to.
+static void move_states(FileEventQueue* queue, const char* from, const char* to) {
+    char* prefix = g_strconcat(from, "/", NULL);
+    size_t from_len = strlen(from);
+    GPtrArray* moved = g_ptr_array_new();
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, queue->states);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!g_str_has_prefix(key, prefix)) continue;
+        g_ptr_array_add(moved, g_strconcat(to, (const char*)key + from_len, NULL));
+        g_ptr_array_add(moved, value);
+        g_hash_table_iter_steal(&iter);
+        g_free(key);
+    }
+
+    for (guint i = 0; i < moved->len; i += 2) {
+        g_hash_table_replace(queue->states, g_ptr_array_index(moved, i), g_ptr_array_index(moved, i + 1));
+    }
+
+    g_ptr_array_free(moved, TRUE);
+    g_free(prefix);
+}
+
+static void apply_renamed(FileEventQueue* queue, const char* from, const char* to) {
+    PathState* state = g_hash_table_lookup(queue->states, from);
+    // The index does not hold what is at from right now, so there is
+    // nothing to move; drop what it does hold and crawl the target
+    bool replaced = state && state->remove;
+    bool created = state && state->created;
+    bool changed = state && state->add;
+
+    if (replaced) {
+        state->add = false;
+    } else if (state) {
+        g_hash_table_remove(queue->states, from);
+    }
+
+    move_states(queue, from, to);
+
+    // Whatever was pending for the target is replaced by what moves in
+    g_hash_table_remove(queue->states, to);
+
+    if (replaced || created) {
+        bool fresh;
+        PathState* target = state_for(queue, to, &fresh);
+        target->remove = true;
+        target->add = true;
+        return;
+    }
+
+    Rename* rename = g_new(Rename, 1);
+    rename->from = g_strdup(from);
+    rename->to = g_strdup(to);
+    g_ptr_array_add(queue->renames, rename);
+    if (changed) apply_added(queue, to, false);
+}
+
+static void settle_moved_from(FileEventQueue* queue) {
+    if (!queue->moved_from) return;
+    apply_deleted(queue, queue->moved_from);
+    g_free(queue->moved_from);
+    queue->moved_from = NULL;
+}
+
+void file_event_queue_push(FileEventQueue* queue, const char* path, FileEventKind kind) {
+    pthread_mutex_lock(&queue->lock);
+
+    bool was_empty = window_is_empty(queue);
+
+    if (kind == FILE_EVENT_MOVED_TO && queue->moved_from) {
+        apply_renamed(queue, queue->moved_from, path);
+        g_free(queue->moved_from);
+        queue->moved_from = NULL;
+    } else {
+        settle_moved_from(queue);
+        switch (kind) {
+            case FILE_EVENT_CREATED:
+            case FILE_EVENT_MOVED_TO:
+                apply_added(queue, path, true);
+                break;
+            case FILE_EVENT_CHANGED:
+                apply_added(queue, path, false);
+                break;
+            case FILE_EVENT_DELETED:
+                apply_deleted(queue, path);
+                break;
+            case FILE_EVENT_MOVED_FROM:
+                queue->moved_from = g_strdup(path);
+                queue->moved_from_age = 0;
+                break;
+        }
+    }
+
+    if (was_empty) pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void apply_window(FileEventQueue* queue, GHashTable* states, GPtrArray* renames) {
+    GPtrArray* removals = g_ptr_array_new();
+    GPtrArray* additions = g_ptr_array_new_with_free_func(g_free);
+
+    // Renames first: later events in the window already use the new names
+    for (guint i = 0; i < renames->len; i++) {
+        Rename* rename = g_ptr_array_index(renames, i);
+        file_tree_manager_remove_subtree(rename->to);
+
+        char** moved = file_tree_manager_rename_subtree(rename->from, rename->to);
+        if (!moved) {
+            if (!g_hash_table_contains(states, rename->to)) g_ptr_array_add(additions, g_strdup(rename->to));
+            continue;
+        }
+        for (char** dir = moved; *dir; dir++) {
+            if (queue->on_directory) queue->on_directory(*dir, queue->directory_data);
+        }
+        g_strfreev(moved);
+    }
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, states);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const PathState* state = value;
+        if (state->remove) g_ptr_array_add(removals, key);
+        if (state->add) g_ptr_array_add(additions, g_strdup(key));
+    }
+
+    if (removals->len > 0) {
+        file_tree_manager_remove_batch((char* const*)removals->pdata, removals->len);
+    }
+    if (additions->len > 0 && queue->on_added) {
+        queue->on_added((char**)additions->pdata, additions->len, queue->added_data);
+    }
+
+    g_ptr_array_free(removals, TRUE);
+    g_ptr_array_free(additions, TRUE);
+}
+
+static void* queue_main(void* data) {
+    FileEventQueue* queue = data;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->stopping) {
+        if (window_is_empty(queue)) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+            continue;
+        }
+
+        // Let the window fill up; pushes in the meantime only add to it
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t nsec = (uint64_t)deadline.tv_nsec + (uint64_t)queue->window_ms * 1000000ULL;
+        deadline.tv_sec += nsec / 1000000000ULL;
+        deadline.tv_nsec = nsec % 1000000000ULL;
+        while (!queue->stopping &&
+               pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline) == 0) { }
+        if (queue->stopping) break;
+
+        // A MOVED_FROM gets one extra window to find its MOVED_TO before
+        // it counts as a deletion
+        if (queue->moved_from && queue->moved_from_age++ > 0) settle_moved_from(queue);
+
+        GHashTable* states = queue->states;
+        GPtrArray* renames = queue->renames;
+        reset_window(queue);
+        pthread_mutex_unlock(&queue->lock);
+
+        apply_window(queue, states, renames);
+        g_hash_table_destroy(states);
+        g_ptr_array_free(renames, TRUE);
+
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+FileEventQueue* file_event_queue_new(unsigned int window_ms,
+                                     FileEventAddedFunc on_added, void* added_data,
+                                     FileCrawlerDirectoryFunc on_directory, void* directory_data) {
+    FileEventQueue* queue = calloc(1, sizeof(FileEventQueue));
+    if (!queue) return NULL;
+
+    queue->on_added = on_added;
+    queue->added_data = added_data;
+    queue->on_directory = on_directory;
+    queue->directory_data = directory_data;
+    queue->window_ms = window_ms;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    reset_window(queue);
+
+    if (pthread_create(&queue->thread, NULL, queue_main, queue) != 0) {
+        fprintf(stderr, "Failed to start file event queue\n");
+        g_hash_table_destroy(queue->states);
+        g_ptr_array_free(queue->renames, TRUE);
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->cond);
+        free(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+void file_event_queue_free(FileEventQueue* queue) {
+    if (!queue) return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = true;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+
+    g_hash_table_destroy(queue->states);
+    g_ptr_array_free(queue->renames, TRUE);
+    g_free(queue->moved_from);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
@@ -0,0 +1,38 @@
+#ifndef FILE_EVENTS_H
+#define FILE_EVENTS_H
+
+#include <stddef.h>
+#include "file-crawler.h"
+
+// Collects filesystem events for a short window and applies what is left
+// of them to the file index in one go. A path created and deleted inside
+// the window never reaches the index, repeated changes to a path become a
+// single crawl, and a MOVED_FROM directly followed by a MOVED_TO moves the
+// indexed subtree instead of dropping and re-crawling it.
+
+typedef struct FileEventQueue FileEventQueue;
+
+typedef enum {
+    FILE_EVENT_CREATED,
+    FILE_EVENT_CHANGED,
+    FILE_EVENT_DELETED,
+    FILE_EVENT_MOVED_FROM,
+    FILE_EVENT_MOVED_TO
+} FileEventKind;
+
+// Called on the queue's thread with the paths that must be crawled once
+// the window's removals and renames are in the index.
+typedef void (*FileEventAddedFunc)(char** paths, size_t n, void* user_data);
+
+// on_directory is called for every directory a rename moved, under its
+// new name, so it can be watched again.
+FileEventQueue* file_event_queue_new(unsigned int window_ms,
+                                     FileEventAddedFunc on_added, void* added_data,
+                                     FileCrawlerDirectoryFunc on_directory, void* directory_data);
+
+// Drops whatever is still pending.
+void file_event_queue_free(FileEventQueue* queue);
+
+void file_event_queue_push(FileEventQueue* queue, const char* path, FileEventKind kind);
+
+#endif // FILE_EVENTS_H
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include "file-fanotify.h"
+#include "file-tree-manager.h"
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#define EVENT_BUFFER_SIZE 16384
+
+// Only changes to which paths exist matter to the index
+#define WATCH_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+typedef struct {
+    fsid_t fsid;
+    // Any descriptor on the filesystem, for open_by_handle_at
+    int mount_fd;
+} MarkedFilesystem;
+
+struct FileFanotify {
+    int fd;
+    int wake_fd;
+    FileEventQueue* queue;
+    pthread_t thread;
+    bool running;
+    GPtrArray* roots;
+    GArray* filesystems;
+};
+
+FileFanotify* file_fanotify_new(FileEventQueue* queue) {
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                           O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        fprintf(stderr, "fanotify unavailable: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    FileFanotify* watcher = wake_fd >= 0 ? calloc(1, sizeof(FileFanotify)) : NULL;
+    if (!watcher) {
+        if (wake_fd >= 0) close(wake_fd);
+        close(fd);
+        return NULL;
+    }
+
+    watcher->fd = fd;
+    watcher->wake_fd = wake_fd;
+    watcher->queue = queue;
+    watcher->roots = g_ptr_array_new_with_free_func(g_free);
+    watcher->filesystems = g_array_new(FALSE, FALSE, sizeof(MarkedFilesystem));
+    return watcher;
+}
+
+static MarkedFilesystem* find_filesystem(FileFanotify* watcher, const void* fsid) {
+    for (guint i = 0; i < watcher->filesystems->len; i++) {
+        MarkedFilesystem* fs = &g_array_index(watcher->filesystems, MarkedFilesystem, i);
+        if (memcmp(&fs->fsid, fsid, sizeof(fsid_t)) == 0) return fs;
+    }
+    return NULL;
+}
+
+bool file_fanotify_add_root(FileFanotify* watcher, const char* path) {
+    struct statfs sfs;
+    if (statfs(path, &sfs) != 0) return false;
+
+    if (!find_filesystem(watcher, &sfs.f_fsid)) {
+        int mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mount_fd < 0) return false;
+
+        if (fanotify_mark(watcher->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, WATCH_MASK, AT_FDCWD, path) != 0) {
+            fprintf(stderr, "Failed to mark filesystem of %s: %s\n", path, strerror(errno));
+            close(mount_fd);
+            return false;
+        }
+
+        MarkedFilesystem fs = { sfs.f_fsid, mount_fd };
+        g_array_append_val(watcher->filesystems, fs);
+    }
+
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    g_ptr_array_add(watcher->roots, g_strndup(path, len));
+    return true;
+}
+
+static bool below_root(const FileFanotify* watcher, const char* path) {
+    for (guint i = 0; i < watcher->roots->len; i++) {
+        const char* root = g_ptr_array_index(watcher->roots, i);
+        size_t len = strlen(root);
+        if (strncmp(path, root, len) == 0 && (path[len] == '/' || path[len] == '\0')) return true;
+    }
+    return false;
+}
+
+// Resolves the directory handle of an event into path, appending name.
+static bool event_path(FileFanotify* watcher, const struct fanotify_event_info_fid* info,
+                       char* path, size_t size) {
+    MarkedFilesystem* fs = find_filesystem(watcher, &info->fsid);
+    if (!fs) return false;
+
+    struct file_handle* handle = (struct file_handle*)info->handle;
+    const char* name = (const char*)handle->f_handle + handle->handle_bytes;
+
+    // Fails with ESTALE once the directory itself is gone, in which case
+    // its own deletion event covers everything below it
+    int dir_fd = open_by_handle_at(fs->mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (dir_fd < 0) return false;
+
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    ssize_t len = readlink(link, path, size - 1);
+    close(dir_fd);
+    if (len <= 0) return false;
+    path[len] = '\0';
+
+    if (!below_root(watcher, path) || !file_tree_manager_has_directory(path)) return false;
+    if (strcmp(name, ".") == 0) return true;
+
+    return snprintf(path + len, size - len, "%s%s", len > 1 ? "/" : "", name) < (int)(size - len);
+}
+
+static void queue_event(FileFanotify* watcher, const char* path, uint64_t mask) {
+    // Merged events of one entry in the order they can have happened
+    if (mask & FAN_MOVED_FROM) file_event_queue_push(watcher->queue, path, FILE_EVENT_MOVED_FROM);
+    if (mask & FAN_CREATE) file_event_queue_push(watcher->queue, path, FILE_EVENT_CREATED);
+    if (mask & FAN_MOVED_TO) file_event_queue_push(watcher->queue, path, FILE_EVENT_MOVED_TO);
+    if (mask & FAN_DELETE) file_event_queue_push(watcher->queue, path, FILE_EVENT_DELETED);
+}
+
+static void read_events(FileFanotify* watcher) {
+    char buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    char path[PATH_MAX];
+
+    for (;;) {
+        ssize_t len = read(watcher->fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "Error reading fanotify events: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        struct fanotify_event_metadata* meta = (struct fanotify_event_metadata*)buffer;
+        for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+            if (meta->vers != FANOTIFY_METADATA_VERSION) continue;
+
+            // Events were lost; have every root crawled again
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                for (guint i = 0; i < watcher->roots->len; i++) {
+                    file_event_queue_push(watcher->queue, g_ptr_array_index(watcher->roots, i),
+                                          FILE_EVENT_CHANGED);
+                }
+                continue;
+            }
+
+            const char* info_end = (const char*)meta + meta->event_len;
+            const char* cursor = (const char*)meta + meta->metadata_len;
+            while (cursor + sizeof(struct fanotify_event_info_header) <= info_end) {
+                const struct fanotify_event_info_fid* info = (const struct fanotify_event_info_fid*)cursor;
+                if (info->hdr.len == 0) break;
+                cursor += info->hdr.len;
+
+                if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) continue;
+                if (event_path(watcher, info, path, sizeof(path))) queue_event(watcher, path, meta->mask);
+            }
+        }
+    }
+}
+
+static void* watcher_main(void* data) {
+    FileFanotify* watcher = data;
+    struct pollfd fds[2] = {
+        { .fd = watcher->fd, .events = POLLIN },
+        { .fd = watcher->wake_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error polling fanotify: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents & POLLIN) read_events(watcher);
+    }
+
+    return NULL;
+}
+
+bool file_fanotify_start(FileFanotify* watcher) {
+    if (watcher->running || watcher->roots->len == 0) return watcher->running;
+    watcher->running = pthread_create(&watcher->thread, NULL, watcher_main, watcher) == 0;
+    return watcher->running;
+}
+
+void file_fanotify_free(FileFanotify* watcher) {
+    if (!watcher) return;
+
+    if (watcher->running) {
+        uint64_t one = 1;
+        if (write(watcher->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Failed to stop fanotify watcher: %s\n", strerror(errno));
+        }
+        pthread_join(watcher->thread, NULL);
+    }
+
+    for (guint i = 0; i < watcher->filesystems->len; i++) {
+        close(g_array_index(watcher->filesystems, MarkedFilesystem, i).mount_fd);
+    }
+    g_array_free(watcher->filesystems, TRUE);
+    g_ptr_array_free(watcher->roots, TRUE);
+    close(watcher->wake_fd);
+    close(watcher->fd);
+    free(watcher);
+}
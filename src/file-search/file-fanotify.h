@@ -0,0 +1,30 @@
+#ifndef FILE_FANOTIFY_H
+#define FILE_FANOTIFY_H
+
+#include <stdbool.h>
+#include "file-events.h"
+
+// Watches whole filesystems with fanotify instead of placing an inotify
+// watch on every crawled directory. Events carry the parent directory's
+// file handle and the entry name; the handle is resolved to a path and
+// the event is forwarded to a FileEventQueue only if it lies below one of
+// the roots and in a directory the crawler entered, which is what the
+// per-directory watches would have covered.
+//
+// Filesystem marks need CAP_SYS_ADMIN and resolving handles needs
+// CAP_DAC_READ_SEARCH, so callers keep inotify as the fallback.
+
+typedef struct FileFanotify FileFanotify;
+
+// Returns NULL if fanotify with directory file handles is unavailable.
+FileFanotify* file_fanotify_new(FileEventQueue* queue);
+void file_fanotify_free(FileFanotify* watcher);
+
+// Marks the filesystem holding path and restricts events to below it.
+// Returns false if the filesystem could not be marked.
+bool file_fanotify_add_root(FileFanotify* watcher, const char* path);
+
+// Starts delivering events; roots must all be added before.
+bool file_fanotify_start(FileFanotify* watcher);
+
+#endif // FILE_FANOTIFY_H
@@ -0,0 +1,210 @@
+#include "file-frecency.h"
+#include <glib.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRECENCY_SLOTS 4096
+#define FRECENCY_SLOT_MASK (FRECENCY_SLOTS - 1)
+// A hash is looked for this many slots from its home, then given up on
+#define FRECENCY_PROBES 16
+// 2020-01-01; weights are log2 of launches scaled by half-lives since then
+#define FRECENCY_EPOCH 1577836800
+#define FRECENCY_MAGIC "BOBFREC1"
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t half_life;
+} FrecencyHeader;
+
+// Hash in the high half, weight as float bits in the low half; 0 is free
+static _Atomic uint64_t slots[FRECENCY_SLOTS];
+static _Atomic uint32_t used;
+static atomic_bool dirty;
+static atomic_flag lock = ATOMIC_FLAG_INIT;
+
+static inline void spin_lock(void) {
+    while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire)) {
+        __builtin_ia32_pause();
+    }
+}
+
+static inline void spin_unlock(void) {
+    atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+static inline uint32_t slot_key(uint32_t hash) {
+    return hash ? hash : 1;
+}
+
+static inline uint64_t pack(uint32_t key, float weight) {
+    uint32_t bits;
+    memcpy(&bits, &weight, sizeof(bits));
+    return (uint64_t)key << 32 | bits;
+}
+
+static inline float unpack_weight(uint64_t value) {
+    uint32_t bits = (uint32_t)value;
+    float weight;
+    memcpy(&weight, &bits, sizeof(weight));
+    return weight;
+}
+
+// log2(2^a + 2^b) without leaving the log domain
+static inline float log_add(float a, float b) {
+    float hi = a > b ? a : b;
+    float lo = a > b ? b : a;
+    return hi + log2f(1.0f + exp2f(lo - hi));
+}
+
+float file_frecency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (float)((double)(ts.tv_sec - FRECENCY_EPOCH) / FRECENCY_HALF_LIFE);
+}
+
+// Adds weight to key's slot, or takes a free one. With the probe window
+// full the weakest entry in it is replaced.
+static void place_locked(uint32_t key, float weight) {
+    size_t home = key & FRECENCY_SLOT_MASK;
+    size_t weakest = home;
+    float weakest_weight = INFINITY;
+
+    for (size_t probe = 0; probe < FRECENCY_PROBES; probe++) {
+        size_t index = (home + probe) & FRECENCY_SLOT_MASK;
+        uint64_t value = atomic_load_explicit(&slots[index], memory_order_relaxed);
+
+        if (value == 0) {
+            atomic_store_explicit(&slots[index], pack(key, weight), memory_order_release);
+            atomic_fetch_add_explicit(&used, 1, memory_order_release);
+            return;
+        }
+        if ((uint32_t)(value >> 32) == key) {
+            atomic_store_explicit(&slots[index], pack(key, log_add(unpack_weight(value), weight)),
+                                  memory_order_release);
+            return;
+        }
+        if (unpack_weight(value) < weakest_weight) {
+            weakest_weight = unpack_weight(value);
+            weakest = index;
+        }
+    }
+
+    atomic_store_explicit(&slots[weakest], pack(key, weight), memory_order_release);
+}
+
+void file_frecency_record(uint32_t hash) {
+    float now = file_frecency_now();
+    spin_lock();
+    place_locked(slot_key(hash), now);
+    atomic_store(&dirty, true);
+    spin_unlock();
+}
+
+void file_frecency_record_path(const char* path) {
+    file_frecency_record(g_str_hash(path));
+}
+
+int file_frecency_bonus(uint32_t hash, float now) {
+    if (atomic_load_explicit(&used, memory_order_relaxed) == 0) return 0;
+
+    uint32_t key = slot_key(hash);
+    size_t home = key & FRECENCY_SLOT_MASK;
+    for (size_t probe = 0; probe < FRECENCY_PROBES; probe++) {
+        uint64_t value = atomic_load_explicit(&slots[(home + probe) & FRECENCY_SLOT_MASK],
+                                              memory_order_acquire);
+        // Slots are replaced but never freed, so a gap ends the chain
+        if (value == 0) return 0;
+        if ((uint32_t)(value >> 32) != key) continue;
+
+        float launches = exp2f(unpack_weight(value) - now);
+        int bonus = (int)(FRECENCY_BONUS_STEP * log2f(1.0f + launches));
+        return bonus > FRECENCY_MAX_BONUS ? FRECENCY_MAX_BONUS : bonus;
+    }
+    return 0;
+}
+
+bool file_frecency_is_dirty(void) {
+    return atomic_load(&dirty);
+}
+
+void file_frecency_clear(void) {
+    spin_lock();
+    for (size_t i = 0; i < FRECENCY_SLOTS; i++) {
+        atomic_store_explicit(&slots[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&used, 0);
+    atomic_store(&dirty, false);
+    spin_unlock();
+}
+
+bool file_frecency_load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+
+    FrecencyHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              memcmp(header.magic, FRECENCY_MAGIC, sizeof(header.magic)) == 0 &&
+              header.half_life == FRECENCY_HALF_LIFE && header.count <= FRECENCY_SLOTS;
+
+    uint64_t* values = ok ? malloc(header.count * sizeof(uint64_t) + 1) : NULL;
+    ok = values && fread(values, sizeof(uint64_t), header.count, f) == header.count;
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Ignoring invalid frecency table %s\n", path);
+        free(values);
+        return false;
+    }
+
+    file_frecency_clear();
+    spin_lock();
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (values[i] >> 32) place_locked((uint32_t)(values[i] >> 32), unpack_weight(values[i]));
+    }
+    spin_unlock();
+
+    free(values);
+    return true;
+}
+
+// Writes to a temporary file and renames it into place, like the index
+// snapshot.
+bool file_frecency_save(const char* path) {
+    uint64_t* values = malloc(FRECENCY_SLOTS * sizeof(uint64_t));
+    if (!values) return false;
+
+    FrecencyHeader header = { .half_life = FRECENCY_HALF_LIFE };
+    memcpy(header.magic, FRECENCY_MAGIC, sizeof(header.magic));
+
+    spin_lock();
+    for (size_t i = 0; i < FRECENCY_SLOTS; i++) {
+        uint64_t value = atomic_load_explicit(&slots[i], memory_order_relaxed);
+        if (value) values[header.count++] = value;
+    }
+    atomic_store(&dirty, false);
+    spin_unlock();
+
+    char* tmp_path = g_strconcat(path, ".tmp", NULL);
+    FILE* f = fopen(tmp_path, "wb");
+    bool ok = f != NULL;
+    ok = ok && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(values, sizeof(uint64_t), header.count, f) == header.count;
+    if (f) ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "Failed to save frecency table to %s\n", path);
+        unlink(tmp_path);
+        atomic_store(&dirty, true);
+    }
+
+    g_free(tmp_path);
+    free(values);
+    return ok;
+}
@@ -0,0 +1,34 @@
+#ifndef FILE_FRECENCY_H
+#define FILE_FRECENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How often and how recently indexed files were opened, keyed by the
+// path hash FileEntry already stores. Every launch adds a weight that
+// halves each FRECENCY_HALF_LIFE; weights are kept as log2 relative to a
+// fixed epoch, so nothing ever needs to be decayed in place.
+//
+// Each slot packs hash and weight into one 64-bit word: readers on the
+// scoring path use plain atomic loads, only launches take the lock.
+
+#define FRECENCY_HALF_LIFE (7 * 24 * 3600)
+
+// Score added at one launch, growing by the same amount per doubling
+#define FRECENCY_BONUS_STEP 150
+#define FRECENCY_MAX_BONUS 600
+
+void file_frecency_record(uint32_t hash);
+void file_frecency_record_path(const char* path);
+
+// The weight of now in half-lives since the epoch, for file_frecency_bonus.
+float file_frecency_now(void);
+int file_frecency_bonus(uint32_t hash, float now);
+
+// Whether anything was recorded since the last load or save.
+bool file_frecency_is_dirty(void);
+bool file_frecency_load(const char* path);
+bool file_frecency_save(const char* path);
+void file_frecency_clear(void);
+
+#endif // FILE_FRECENCY_H
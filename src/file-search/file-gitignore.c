@@ -0,0 +1,492 @@
+#include "file-gitignore.h"
+#include <glib.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_GITIGNORE_SIZE (1 << 20)
+#define RULE_NONE (-1)
+
+typedef enum {
+    TOKEN_LITERAL,
+    TOKEN_ANY,
+    TOKEN_CLASS,
+    TOKEN_STAR,
+    // "**/": nothing, or any run of whole directories
+    TOKEN_GLOBSTAR_DIRS,
+    // A trailing "/**": everything below
+    TOKEN_GLOBSTAR_ALL
+} TokenType;
+
+typedef struct {
+    uint8_t type;
+    uint8_t c;
+    uint16_t class_index;
+} GlobToken;
+
+typedef struct {
+    int32_t rule;
+    bool anchored;
+    uint32_t first_token;
+    uint32_t token_count;
+} Glob;
+
+typedef struct {
+    bool negate;
+    bool dir_only;
+} Rule;
+
+// The highest rule matching any entry, and the highest matching only
+// directories, for one key
+typedef struct {
+    int32_t any;
+    int32_t dir;
+} RuleSlot;
+
+typedef struct {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint8_t c;
+    RuleSlot rules;
+} TrieNode;
+
+typedef struct {
+    TrieNode* nodes;
+    uint32_t count;
+    uint32_t capacity;
+} Trie;
+
+struct GitignoreMatcher {
+    atomic_int refcount;
+    GitignoreMatcher* parent;
+    size_t base_len;
+
+    Rule* rules;
+    int32_t rule_count;
+
+    GHashTable* names;
+    GHashTable* anchored;
+    Trie prefixes;
+    Trie suffixes;
+
+    Glob* globs;
+    uint32_t glob_count;
+    GlobToken* tokens;
+    uint32_t token_count;
+    uint64_t (*classes)[4];
+    uint32_t class_count;
+};
+
+static inline void slot_init(RuleSlot* slot) {
+    slot->any = RULE_NONE;
+    slot->dir = RULE_NONE;
+}
+
+static inline void slot_set(RuleSlot* slot, int32_t rule, bool dir_only) {
+    if (dir_only) {
+        slot->dir = rule;
+    } else {
+        slot->any = rule;
+    }
+}
+
+static inline void consider(const RuleSlot* slot, bool is_dir, int32_t* best) {
+    if (slot->any > *best) *best = slot->any;
+    if (is_dir && slot->dir > *best) *best = slot->dir;
+}
+
+static uint32_t trie_child(Trie* trie, uint32_t node, uint8_t c, bool create) {
+    for (uint32_t i = trie->nodes[node].first_child; i; i = trie->nodes[i].next_sibling) {
+        if (trie->nodes[i].c == c) return i;
+    }
+    if (!create) return 0;
+
+    if (trie->count == trie->capacity) {
+        uint32_t capacity = trie->capacity * 2;
+        TrieNode* nodes = realloc(trie->nodes, capacity * sizeof(TrieNode));
+        if (!nodes) return 0;
+        trie->nodes = nodes;
+        trie->capacity = capacity;
+    }
+
+    uint32_t child = trie->count++;
+    TrieNode* n = &trie->nodes[child];
+    n->first_child = 0;
+    n->next_sibling = trie->nodes[node].first_child;
+    n->c = c;
+    slot_init(&n->rules);
+    trie->nodes[node].first_child = child;
+    return child;
+}
+
+static bool trie_init(Trie* trie) {
+    trie->capacity = 16;
+    trie->count = 1;
+    trie->nodes = malloc(trie->capacity * sizeof(TrieNode));
+    if (!trie->nodes) return false;
+    memset(&trie->nodes[0], 0, sizeof(TrieNode));
+    slot_init(&trie->nodes[0].rules);
+    return true;
+}
+
+static void trie_insert(Trie* trie, const char* key, size_t len, bool reversed, int32_t rule, bool dir_only) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)(reversed ? key[len - 1 - i] : key[i]);
+        node = trie_child(trie, node, c, true);
+        if (!node) return;
+    }
+    slot_set(&trie->nodes[node].rules, rule, dir_only);
+}
+
+// Every key along the walk is a prefix (or reversed, a suffix) of name
+static void trie_lookup(const Trie* trie, const char* name, size_t len, bool reversed, bool is_dir, int32_t* best) {
+    if (trie->count <= 1) return;
+
+    consider(&trie->nodes[0].rules, is_dir, best);
+    uint32_t node = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)(reversed ? name[len - 1 - i] : name[i]);
+        node = trie_child((Trie*)trie, node, c, false);
+        if (!node) return;
+        consider(&trie->nodes[node].rules, is_dir, best);
+    }
+}
+
+static void table_set(GHashTable* table, const char* key, size_t len, int32_t rule, bool dir_only) {
+    char* k = g_strndup(key, len);
+    RuleSlot* slot = g_hash_table_lookup(table, k);
+    if (!slot) {
+        slot = g_new(RuleSlot, 1);
+        slot_init(slot);
+        g_hash_table_insert(table, k, slot);
+    } else {
+        g_free(k);
+    }
+    slot_set(slot, rule, dir_only);
+}
+
+static void table_lookup(GHashTable* table, const char* key, bool is_dir, int32_t* best) {
+    if (g_hash_table_size(table) == 0) return;
+    const RuleSlot* slot = g_hash_table_lookup(table, key);
+    if (slot) consider(slot, is_dir, best);
+}
+
+static bool push_token(GitignoreMatcher* m, uint8_t type, uint8_t c, uint16_t class_index) {
+    if ((m->token_count & (m->token_count - 1)) == 0) {
+        uint32_t capacity = m->token_count ? m->token_count * 2 : 1;
+        GlobToken* tokens = realloc(m->tokens, capacity * sizeof(GlobToken));
+        if (!tokens) return false;
+        m->tokens = tokens;
+    }
+    m->tokens[m->token_count++] = (GlobToken){ type, c, class_index };
+    return true;
+}
+
+// Parses the bracket expression at p, returning the position after it,
+// or NULL if it is unterminated and '[' should be taken literally.
+static const char* compile_class(GitignoreMatcher* m, const char* p, const char* end) {
+    const char* q = p + 1;
+    bool negate = q < end && (*q == '!' || *q == '^');
+    if (negate) q++;
+
+    uint64_t bits[4] = { 0 };
+    bool first = true;
+    while (q < end && (*q != ']' || first)) {
+        uint8_t lo = (uint8_t)*q;
+        if (lo == '\\' && q + 1 < end) lo = (uint8_t)*++q;
+        uint8_t hi = lo;
+        if (q + 2 < end && q[1] == '-' && q[2] != ']') {
+            hi = (uint8_t)q[2];
+            q += 2;
+        }
+        for (unsigned int c = lo; c <= hi; c++) {
+            bits[c >> 6] |= 1ULL << (c & 63);
+        }
+        q++;
+        first = false;
+    }
+    if (q >= end) return NULL;
+
+    if (negate) {
+        for (int i = 0; i < 4; i++) bits[i] = ~bits[i];
+    }
+    bits['/' >> 6] &= ~(1ULL << ('/' & 63));
+
+    if ((m->class_count & (m->class_count - 1)) == 0) {
+        uint32_t capacity = m->class_count ? m->class_count * 2 : 1;
+        uint64_t (*classes)[4] = realloc(m->classes, capacity * sizeof(*classes));
+        if (!classes) return NULL;
+        m->classes = classes;
+    }
+    memcpy(m->classes[m->class_count], bits, sizeof(bits));
+    if (!push_token(m, TOKEN_CLASS, 0, (uint16_t)m->class_count++)) return NULL;
+    return q + 1;
+}
+
+static bool compile_glob(GitignoreMatcher* m, const char* p, size_t len, int32_t rule, bool anchored) {
+    const char* start = p;
+    const char* end = p + len;
+    uint32_t first = m->token_count;
+
+    while (p < end) {
+        char c = *p;
+        if (c == '*') {
+            bool whole = (p == start || p[-1] == '/') && p + 1 < end && p[1] == '*' &&
+                         (p + 2 == end || p[2] == '/');
+            if (whole && anchored) {
+                if (p + 2 == end) {
+                    if (!push_token(m, TOKEN_GLOBSTAR_ALL, 0, 0)) return false;
+                    p += 2;
+                } else {
+                    if (!push_token(m, TOKEN_GLOBSTAR_DIRS, 0, 0)) return false;
+                    p += 3;
+                }
+                continue;
+            }
+            while (p < end && *p == '*') p++;
+            if (!push_token(m, TOKEN_STAR, 0, 0)) return false;
+        } else if (c == '?') {
+            if (!push_token(m, TOKEN_ANY, 0, 0)) return false;
+            p++;
+        } else if (c == '[') {
+            const char* next = compile_class(m, p, end);
+            if (next) {
+                p = next;
+            } else {
+                if (!push_token(m, TOKEN_LITERAL, '[', 0)) return false;
+                p++;
+            }
+        } else {
+            if (c == '\\' && p + 1 < end) c = *++p;
+            if (!push_token(m, TOKEN_LITERAL, (uint8_t)c, 0)) return false;
+            p++;
+        }
+    }
+
+    if ((m->glob_count & (m->glob_count - 1)) == 0) {
+        uint32_t capacity = m->glob_count ? m->glob_count * 2 : 1;
+        Glob* globs = realloc(m->globs, capacity * sizeof(Glob));
+        if (!globs) return false;
+        m->globs = globs;
+    }
+    m->globs[m->glob_count++] = (Glob){ rule, anchored, first, m->token_count - first };
+    return true;
+}
+
+static bool glob_match(const GitignoreMatcher* m, const GlobToken* t, uint32_t n, const char* s) {
+    for (uint32_t i = 0; i < n; i++, s++) {
+        switch (t[i].type) {
+            case TOKEN_LITERAL:
+                if (*s != (char)t[i].c) return false;
+                break;
+            case TOKEN_ANY:
+                if (*s == '\0' || *s == '/') return false;
+                break;
+            case TOKEN_CLASS: {
+                uint8_t c = (uint8_t)*s;
+                if (c == '\0' || !(m->classes[t[i].class_index][c >> 6] & (1ULL << (c & 63)))) return false;
+                break;
+            }
+            case TOKEN_STAR:
+                // Within one component; try the shortest expansion first
+                for (;; s++) {
+                    if (glob_match(m, t + i + 1, n - i - 1, s)) return true;
+                    if (*s == '\0' || *s == '/') return false;
+                }
+            case TOKEN_GLOBSTAR_DIRS:
+                for (;;) {
+                    if (glob_match(m, t + i + 1, n - i - 1, s)) return true;
+                    const char* slash = strchr(s, '/');
+                    if (!slash) return false;
+                    s = slash + 1;
+                }
+            case TOKEN_GLOBSTAR_ALL:
+                return *s != '\0';
+        }
+    }
+    return *s == '\0';
+}
+
+static bool has_glob_chars(const char* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\') return true;
+    }
+    return false;
+}
+
+static void add_rule(GitignoreMatcher* m, const char* line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r') len--;
+
+    // Trailing spaces are dropped unless escaped
+    while (len > 0 && line[len - 1] == ' ' && !(len > 1 && line[len - 2] == '\\')) len--;
+    if (len == 0 || line[0] == '#') return;
+
+    bool negate = line[0] == '!';
+    if (negate || (line[0] == '\\' && len > 1 && (line[1] == '#' || line[1] == '!'))) {
+        line++;
+        len--;
+    }
+
+    bool dir_only = false;
+    while (len > 0 && line[len - 1] == '/') {
+        dir_only = true;
+        len--;
+    }
+    if (len == 0) return;
+
+    bool anchored = memchr(line, '/', len) != NULL;
+    if (line[0] == '/') {
+        line++;
+        len--;
+    }
+    // A leading "**/" matches in every directory, like no slash at all
+    if (len > 3 && memcmp(line, "**/", 3) == 0 && !memchr(line + 3, '/', len - 3)) {
+        line += 3;
+        len -= 3;
+        anchored = false;
+    }
+    if (len == 0) return;
+
+    if ((m->rule_count & (m->rule_count - 1)) == 0) {
+        int32_t capacity = m->rule_count ? m->rule_count * 2 : 1;
+        Rule* rules = realloc(m->rules, capacity * sizeof(Rule));
+        if (!rules) return;
+        m->rules = rules;
+    }
+    int32_t rule = m->rule_count;
+
+    bool literal = !has_glob_chars(line, len);
+    if (anchored) {
+        if (literal) {
+            table_set(m->anchored, line, len, rule, dir_only);
+        } else if (!compile_glob(m, line, len, rule, true)) {
+            return;
+        }
+    } else if (literal) {
+        table_set(m->names, line, len, rule, dir_only);
+    } else if (line[0] == '*' && len > 1 && !has_glob_chars(line + 1, len - 1)) {
+        trie_insert(&m->suffixes, line + 1, len - 1, true, rule, dir_only);
+    } else if (line[len - 1] == '*' && len > 1 && !has_glob_chars(line, len - 1)) {
+        trie_insert(&m->prefixes, line, len - 1, false, rule, dir_only);
+    } else if (!compile_glob(m, line, len, rule, false)) {
+        return;
+    }
+
+    m->rules[rule] = (Rule){ negate, dir_only };
+    m->rule_count++;
+}
+
+static void matcher_free(GitignoreMatcher* m) {
+    if (m->names) g_hash_table_destroy(m->names);
+    if (m->anchored) g_hash_table_destroy(m->anchored);
+    free(m->prefixes.nodes);
+    free(m->suffixes.nodes);
+    free(m->rules);
+    free(m->globs);
+    free(m->tokens);
+    free(m->classes);
+    free(m);
+}
+
+GitignoreMatcher* gitignore_matcher_new(GitignoreMatcher* parent, const char* base,
+                                        const char* contents, size_t len) {
+    GitignoreMatcher* m = calloc(1, sizeof(GitignoreMatcher));
+    if (!m) return gitignore_matcher_ref(parent);
+
+    m->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    m->anchored = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    if (!trie_init(&m->prefixes) || !trie_init(&m->suffixes)) {
+        matcher_free(m);
+        return gitignore_matcher_ref(parent);
+    }
+
+    const char* end = contents + len;
+    for (const char* line = contents; line < end;) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        add_rule(m, line, eol - line);
+        line = eol + 1;
+    }
+
+    if (m->rule_count == 0) {
+        matcher_free(m);
+        return gitignore_matcher_ref(parent);
+    }
+
+    size_t base_len = strlen(base);
+    m->base_len = base_len > 0 && base[base_len - 1] == '/' ? base_len : base_len + 1;
+    atomic_init(&m->refcount, 1);
+    m->parent = gitignore_matcher_ref(parent);
+    return m;
+}
+
+GitignoreMatcher* gitignore_matcher_load(GitignoreMatcher* parent, const char* base, int dir_fd) {
+    int fd = openat(dir_fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return gitignore_matcher_ref(parent);
+
+    struct stat st;
+    char* contents = NULL;
+    ssize_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= MAX_GITIGNORE_SIZE) {
+        contents = malloc(st.st_size);
+        if (contents) size = read(fd, contents, st.st_size);
+    }
+    close(fd);
+
+    GitignoreMatcher* m = size > 0
+        ? gitignore_matcher_new(parent, base, contents, (size_t)size)
+        : gitignore_matcher_ref(parent);
+    free(contents);
+    return m;
+}
+
+GitignoreMatcher* gitignore_matcher_ref(GitignoreMatcher* matcher) {
+    if (matcher) atomic_fetch_add_explicit(&matcher->refcount, 1, memory_order_relaxed);
+    return matcher;
+}
+
+void gitignore_matcher_unref(GitignoreMatcher* matcher) {
+    while (matcher && atomic_fetch_sub_explicit(&matcher->refcount, 1, memory_order_acq_rel) == 1) {
+        GitignoreMatcher* parent = matcher->parent;
+        matcher_free(matcher);
+        matcher = parent;
+    }
+}
+
+bool gitignore_matcher_matches(const GitignoreMatcher* matcher, const char* path, size_t path_len,
+                               size_t name_offset, bool is_dir) {
+    const char* name = path + name_offset;
+    size_t name_len = path_len - name_offset;
+
+    for (const GitignoreMatcher* m = matcher; m; m = m->parent) {
+        // Rules only see paths below their own directory
+        if (path_len <= m->base_len) continue;
+        const char* relative = path + m->base_len;
+
+        int32_t best = RULE_NONE;
+        table_lookup(m->names, name, is_dir, &best);
+        table_lookup(m->anchored, relative, is_dir, &best);
+        trie_lookup(&m->suffixes, name, name_len, true, is_dir, &best);
+        trie_lookup(&m->prefixes, name, name_len, false, is_dir, &best);
+
+        // Globs are in rule order, so stop at the first that cannot win
+        for (uint32_t i = m->glob_count; i > 0; i--) {
+            const Glob* glob = &m->globs[i - 1];
+            if (glob->rule <= best) break;
+            if (m->rules[glob->rule].dir_only && !is_dir) continue;
+            if (glob_match(m, m->tokens + glob->first_token, glob->token_count,
+                           glob->anchored ? relative : name)) {
+                best = glob->rule;
+                break;
+            }
+        }
+
+        if (best != RULE_NONE) return !m->rules[best].negate;
+    }
+    return false;
+}
@@ -0,0 +1,34 @@
+#ifndef FILE_GITIGNORE_H
+#define FILE_GITIGNORE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// The rules of one .gitignore, compiled once and shared by reference with
+// every directory below it. Each matcher points at the one of its parent
+// directory, so a lookup walks up the chain until some rule decides.
+//
+// Rules are sorted by shape: plain names go into a hash set, "*.ext" into
+// a reversed suffix trie, "name*" into a prefix trie and anything else
+// into compiled globs. Within a file the last matching rule wins, '!'
+// re-includes, a trailing '/' restricts a rule to directories and a rule
+// containing '/' is anchored to the directory of its .gitignore.
+
+typedef struct GitignoreMatcher GitignoreMatcher;
+
+// Compiles contents, the .gitignore found in directory base, on top of
+// parent. Returns a new reference, or one to parent if there are no rules.
+GitignoreMatcher* gitignore_matcher_new(GitignoreMatcher* parent, const char* base,
+                                        const char* contents, size_t len);
+
+// Reads base/.gitignore through dir_fd, an open descriptor of base.
+GitignoreMatcher* gitignore_matcher_load(GitignoreMatcher* parent, const char* base, int dir_fd);
+
+GitignoreMatcher* gitignore_matcher_ref(GitignoreMatcher* matcher);
+void gitignore_matcher_unref(GitignoreMatcher* matcher);
+
+// Whether path, whose last component starts at name_offset, is ignored.
+bool gitignore_matcher_matches(const GitignoreMatcher* matcher, const char* path, size_t path_len,
+                               size_t name_offset, bool is_dir);
+
+#endif // FILE_GITIGNORE_H
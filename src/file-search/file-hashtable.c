@@ -1,8 +1,29 @@
 #include "file-hashtable.h"
+#include "file-prefilter.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <xxhash.h>
 
 #define INITIAL_CAPACITY 65536
+#define INITIAL_INDEX_CAPACITY 1024
+#define INITIAL_SLOT_CAPACITY 1024
+#define INITIAL_DIR_CAPACITY 16384
+#define INITIAL_DIR_COUNT 256
+#define ENTRY_ALIGN 4
+#define SCAN_BLOCK 256
+
+// Compact once tombstones make up this fraction of the blob
+#define COMPACT_MIN_DEAD_BYTES 16384
+#define COMPACT_DEAD_RATIO 2
+
+// Reassembles full paths for callbacks. Consecutive entries mostly share a
+// directory, so its part of the buffer is only rewritten when it changes.
+typedef struct {
+    uint32_t dir;
+    uint32_t dir_len;
+    char buf[FT_MAX_PATH];
+} PathBuffer;
 
 static inline void spin_lock(atomic_flag* lock) {
     while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
@@ -14,166 +35,1363 @@ static inline void spin_unlock(atomic_flag* lock) {
     atomic_flag_clear_explicit(lock, memory_order_release);
 }
 
+// What lock-free readers scan: the lanes as of the last write. Entries at
+// or past `used` and slots at or past `slot_count` are not part of it.
+typedef struct FileTableView {
+    const char* data;
+    size_t used;
+    const FileSlot* slots;
+    const uint64_t* masks;
+    uint32_t slot_count;
+    FileDirTable dirs;
+    uint64_t version;
+} FileTableView;
+
+// A pinned view; `parity` is -1 when the scan fell back to the lock.
+typedef struct {
+    const FileTableView* view;
+    int parity;
+    FileTableView fallback;
+} ViewGuard;
+
+static inline uint16_t entry_flags(const FileEntry* entry) {
+    return __atomic_load_n(&entry->flags, __ATOMIC_RELAXED);
+}
+
+// Queues ptr to be freed once no reader can reach it. If the queue cannot
+// grow, ptr is leaked rather than freed under a reader.
+static void retire(FileTable* ft, void* ptr) {
+    if (!ptr) return;
+
+    FileRetired* list = &ft->retired[atomic_load(&ft->epoch) & 1];
+    if (list->count == list->capacity) {
+        size_t new_cap = list->capacity ? list->capacity * 2 : 16;
+        void** items = realloc(list->items, new_cap * sizeof(void*));
+        if (!items) return;
+        list->items = items;
+        list->capacity = new_cap;
+    }
+    list->items[list->count++] = ptr;
+}
+
+static void retired_free(FileRetired* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    list->count = 0;
+}
+
+// Readers count themselves under the parity of the epoch they pinned and
+// retry if it moved on meanwhile, so a writer that finds the previous
+// parity at zero knows every reader of that epoch has left.
+static inline int reader_enter(FileTable* ft) {
+    for (;;) {
+        uint64_t epoch = atomic_load(&ft->epoch);
+        atomic_fetch_add(&ft->readers[epoch & 1], 1);
+        if (atomic_load(&ft->epoch) == epoch) return (int)(epoch & 1);
+        atomic_fetch_sub(&ft->readers[epoch & 1], 1);
+    }
+}
+
+static inline void reader_exit(FileTable* ft, int parity) {
+    atomic_fetch_sub_explicit(&ft->readers[parity], 1, memory_order_release);
+}
+
+// Frees what was retired two epochs ago and starts a new epoch, unless a
+// reader of the previous one is still scanning; then a later write tries
+// again. Writers never wait for readers.
+static void reclaim(FileTable* ft) {
+    uint64_t epoch = atomic_load(&ft->epoch);
+    if (atomic_load(&ft->readers[(epoch + 1) & 1]) != 0) return;
+
+    retired_free(&ft->retired[(epoch + 1) & 1]);
+    atomic_store(&ft->epoch, epoch + 1);
+}
+
+static void fill_view(const FileTable* ft, FileTableView* view) {
+    view->data = ft->data;
+    view->used = ft->used;
+    view->slots = ft->slots;
+    view->masks = ft->masks;
+    view->slot_count = ft->slot_count;
+    view->dirs = ft->dirs;
+    view->version = ft->version;
+}
+
+// Makes the table as it is now what new scans see. Writers call it under
+// the lock after any change, before readers could reach retired memory
+// through the old view.
+static void publish(FileTable* ft) {
+    FileTableView* view = malloc(sizeof(FileTableView));
+    if (view) fill_view(ft, view);
+
+    // Without a view scans take the lock until the next publish
+    retire(ft, atomic_exchange_explicit(&ft->view, view, memory_order_acq_rel));
+    reclaim(ft);
+}
+
+static const FileTableView* view_enter(FileTable* ft, ViewGuard* guard) {
+    guard->parity = reader_enter(ft);
+    guard->view = atomic_load_explicit(&ft->view, memory_order_acquire);
+    if (guard->view) return guard->view;
+
+    reader_exit(ft, guard->parity);
+    guard->parity = -1;
+    spin_lock(&ft->lock);
+    fill_view(ft, &guard->fallback);
+    guard->view = &guard->fallback;
+    return guard->view;
+}
+
+static void view_exit(FileTable* ft, ViewGuard* guard) {
+    if (guard->parity < 0) {
+        spin_unlock(&ft->lock);
+    } else {
+        reader_exit(ft, guard->parity);
+    }
+}
+
+static inline FileEntry* entry_at(FileTable* ft, size_t pos) {
+    return (FileEntry*)(ft->data + ft->index[pos]);
+}
+
+static inline FileDir* dir_at(const FileDirTable* dirs, uint32_t id) {
+    return (FileDir*)(dirs->data + dirs->offsets[id]);
+}
+
+// Grows an array that may still point into a mapped snapshot; borrowed
+// memory is copied out instead of reallocated.
+static void* grow_array(uint8_t* borrowed, void* ptr, size_t old_size, size_t new_size, uint8_t borrowed_flag) {
+    if (!(*borrowed & borrowed_flag)) {
+        return realloc(ptr, new_size);
+    }
+
+    void* copy = malloc(new_size);
+    if (!copy) return NULL;
+    memcpy(copy, ptr, old_size);
+    *borrowed &= ~borrowed_flag;
+    return copy;
+}
+
+static inline void release_array(uint8_t* borrowed, void* ptr, uint8_t borrowed_flag) {
+    if (!(*borrowed & borrowed_flag)) {
+        free(ptr);
+    }
+    *borrowed &= ~borrowed_flag;
+}
+
+// Like release_array, for arrays a published view may reach.
+static inline void retire_array(FileTable* ft, void* ptr, uint8_t borrowed_flag) {
+    if (!(ft->borrowed & borrowed_flag)) {
+        retire(ft, ptr);
+    }
+    ft->borrowed &= ~borrowed_flag;
+}
+
+// Like grow_array, for arrays a published view may reach: they are always
+// copied, and the old copy is retired instead of reallocated.
+static void* grow_shared(FileTable* ft, void* ptr, size_t old_size, size_t new_size, uint8_t borrowed_flag) {
+    void* copy = malloc(new_size);
+    if (!copy) return NULL;
+    if (old_size) memcpy(copy, ptr, old_size);
+    retire_array(ft, ptr, borrowed_flag);
+    return copy;
+}
+
+static void dirs_release(FileDirTable* dirs, uint8_t* borrowed) {
+    release_array(borrowed, dirs->data, FT_BORROWED_DIR_DATA);
+    release_array(borrowed, dirs->offsets, FT_BORROWED_DIR_OFFSETS);
+    release_array(borrowed, dirs->buckets, FT_BORROWED_DIR_BUCKETS);
+    memset(dirs, 0, sizeof(*dirs));
+}
+
+static bool dirs_rehash(FileDirTable* dirs, uint8_t* borrowed, uint32_t bucket_count) {
+    uint32_t* buckets = calloc(bucket_count, sizeof(uint32_t));
+    if (!buckets) return false;
+
+    uint32_t mask = bucket_count - 1;
+    for (uint32_t id = 0; id < dirs->count; id++) {
+        uint32_t i = dir_at(dirs, id)->hash & mask;
+        while (buckets[i]) {
+            i = (i + 1) & mask;
+        }
+        buckets[i] = id + 1;
+    }
+
+    release_array(borrowed, dirs->buckets, FT_BORROWED_DIR_BUCKETS);
+    dirs->buckets = buckets;
+    dirs->bucket_count = bucket_count;
+    return true;
+}
+
+// Returns the id of the directory string, adding it if it is new. With an
+// owner, dirs is the one its views share; without, a private table.
+static uint32_t intern_dir(FileTable* owner, FileDirTable* dirs, uint8_t* borrowed,
+                           const char* str, uint32_t len, uint32_t hash) {
+    if (dirs->bucket_count) {
+        uint32_t mask = dirs->bucket_count - 1;
+        for (uint32_t i = hash & mask; dirs->buckets[i]; i = (i + 1) & mask) {
+            uint32_t id = dirs->buckets[i] - 1;
+            FileDir* dir = dir_at(dirs, id);
+            if (dir->hash == hash && dir->len == len && memcmp(dir->str, str, len) == 0) {
+                return id;
+            }
+        }
+    }
+
+    // Keep the bucket array at most half full
+    if ((dirs->count + 1) * 2 > dirs->bucket_count) {
+        uint32_t new_count = dirs->bucket_count ? dirs->bucket_count * 2 : INITIAL_DIR_COUNT * 2;
+        if (!dirs_rehash(dirs, borrowed, new_count)) return FT_DIR_NONE;
+    }
+
+    if (dirs->count >= dirs->offsets_capacity) {
+        uint32_t new_cap = dirs->offsets_capacity ? dirs->offsets_capacity * 2 : INITIAL_DIR_COUNT;
+        size_t old_size = dirs->count * sizeof(uint32_t);
+        uint32_t* new_offsets = owner
+            ? grow_shared(owner, dirs->offsets, old_size, new_cap * sizeof(uint32_t), FT_BORROWED_DIR_OFFSETS)
+            : grow_array(borrowed, dirs->offsets, old_size, new_cap * sizeof(uint32_t), FT_BORROWED_DIR_OFFSETS);
+        if (!new_offsets) return FT_DIR_NONE;
+        dirs->offsets = new_offsets;
+        dirs->offsets_capacity = new_cap;
+    }
+
+    size_t record_size = (sizeof(FileDir) + len + 1 + ENTRY_ALIGN - 1) & ~(size_t)(ENTRY_ALIGN - 1);
+    if (dirs->used + record_size > UINT32_MAX) return FT_DIR_NONE;
+
+    if (dirs->used + record_size > dirs->capacity) {
+        size_t new_cap = dirs->capacity ? dirs->capacity : INITIAL_DIR_CAPACITY;
+        while (dirs->used + record_size > new_cap) {
+            new_cap *= 2;
+        }
+        char* new_data = owner
+            ? grow_shared(owner, dirs->data, dirs->used, new_cap, FT_BORROWED_DIR_DATA)
+            : grow_array(borrowed, dirs->data, dirs->used, new_cap, FT_BORROWED_DIR_DATA);
+        if (!new_data) return FT_DIR_NONE;
+        dirs->data = new_data;
+        dirs->capacity = new_cap;
+    }
+
+    FileDir* dir = (FileDir*)(dirs->data + dirs->used);
+    dir->len = len;
+    dir->hash = hash;
+    memcpy(dir->str, str, len);
+    dir->str[len] = '\0';
+
+    uint32_t id = dirs->count;
+    dirs->offsets[id] = (uint32_t)dirs->used;
+    dirs->count++;
+    dirs->used += record_size;
+
+    uint32_t mask = dirs->bucket_count - 1;
+    uint32_t i = hash & mask;
+    while (dirs->buckets[i]) {
+        i = (i + 1) & mask;
+    }
+    dirs->buckets[i] = id + 1;
+    return id;
+}
+
+// Compares the entry's full path with path, as strcmp would, without
+// assembling it.
+static inline int entry_cmp(FileTable* ft, const FileEntry* entry, const char* path) {
+    const FileDir* dir = dir_at(&ft->dirs, entry->dir);
+    int cmp = strncmp(dir->str, path, dir->len);
+    if (cmp != 0) return cmp;
+    return strcmp(entry->name, path + dir->len);
+}
+
+static inline bool entry_has_prefix(FileTable* ft, const FileEntry* entry, const char* prefix, size_t prefix_len) {
+    const FileDir* dir = dir_at(&ft->dirs, entry->dir);
+    if (prefix_len <= dir->len) {
+        return memcmp(dir->str, prefix, prefix_len) == 0;
+    }
+    return memcmp(dir->str, prefix, dir->len) == 0 &&
+           strncmp(entry->name, prefix + dir->len, prefix_len - dir->len) == 0;
+}
+
+static inline const char* assemble_path(const FileDirTable* dirs, PathBuffer* pb, const FileEntry* entry) {
+    if (entry->dir != pb->dir) {
+        const FileDir* dir = dir_at(dirs, entry->dir);
+        memcpy(pb->buf, dir->str, dir->len);
+        pb->dir = entry->dir;
+        pb->dir_len = dir->len;
+    }
+    strcpy(pb->buf + pb->dir_len, entry->name);
+    return pb->buf;
+}
+
+static inline void path_buffer_init(PathBuffer* pb) {
+    pb->dir = FT_DIR_NONE;
+    pb->dir_len = 0;
+}
+
+static uint32_t alloc_slot(FileTable* ft) {
+    if (ft->free_count > 0) {
+        uint32_t slot = ft->free_slots[--ft->free_count];
+        ft->slots[slot].in_use = 1;
+        return slot;
+    }
+
+    if (ft->slot_count >= FT_MAX_SLOTS) return FT_SLOT_NONE;
+
+    if (ft->slot_count >= ft->slot_capacity) {
+        uint32_t new_cap = ft->slot_capacity ? ft->slot_capacity * 2 : INITIAL_SLOT_CAPACITY;
+        FileSlot* new_slots = grow_shared(ft, ft->slots,
+                                          ft->slot_count * sizeof(FileSlot),
+                                          new_cap * sizeof(FileSlot),
+                                          FT_BORROWED_SLOTS);
+        if (!new_slots) return FT_SLOT_NONE;
+        ft->slots = new_slots;
+
+        uint64_t* new_masks = grow_shared(ft, ft->masks,
+                                          ft->slot_count * sizeof(uint64_t),
+                                          new_cap * sizeof(uint64_t),
+                                          FT_BORROWED_MASKS);
+        if (!new_masks) return FT_SLOT_NONE;
+        ft->masks = new_masks;
+
+        FileMeta* new_meta = grow_array(&ft->borrowed, ft->meta,
+                                        ft->slot_count * sizeof(FileMeta),
+                                        new_cap * sizeof(FileMeta),
+                                        FT_BORROWED_META);
+        if (!new_meta) return FT_SLOT_NONE;
+        ft->meta = new_meta;
+        ft->slot_capacity = new_cap;
+    }
+
+    uint32_t slot = ft->slot_count++;
+    ft->slots[slot].generation = 0;
+    ft->slots[slot].in_use = 1;
+    return slot;
+}
+
+// A slot that cannot be pushed is simply never reused.
+static void push_free_slot(FileTable* ft, uint32_t slot) {
+    if (ft->free_count == ft->free_capacity) {
+        uint32_t new_cap = ft->free_capacity ? ft->free_capacity * 2 : INITIAL_SLOT_CAPACITY;
+        uint32_t* free_slots = realloc(ft->free_slots, new_cap * sizeof(uint32_t));
+        if (!free_slots) return;
+        ft->free_slots = free_slots;
+        ft->free_capacity = new_cap;
+    }
+    ft->free_slots[ft->free_count++] = slot;
+}
+
+static void release_slot(FileTable* ft, uint32_t slot) {
+    ft->slots[slot].generation++;
+    ft->slots[slot].in_use = 0;
+    __atomic_store_n(&ft->masks[slot], 0, __ATOMIC_RELAXED);
+    memset(&ft->meta[slot], 0, sizeof(FileMeta));
+    push_free_slot(ft, slot);
+}
+
+// Returns the position of the first indexed entry not less than path.
+static size_t lower_bound(FileTable* ft, const char* path, bool* found) {
+    size_t lo = 0;
+    size_t hi = ft->count;
+
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        int cmp = entry_cmp(ft, entry_at(ft, mid), path);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (found) {
+        *found = lo < ft->count && entry_cmp(ft, entry_at(ft, lo), path) == 0;
+    }
+    return lo;
+}
+
+// Returns the position one past the last indexed entry starting with prefix.
+static size_t prefix_end(FileTable* ft, size_t pos, const char* prefix, size_t prefix_len) {
+    while (pos < ft->count && entry_has_prefix(ft, entry_at(ft, pos), prefix, prefix_len)) {
+        pos++;
+    }
+    return pos;
+}
+
+// Rewrites the live entries in path order, dropping tombstones. The
+// directory table is rebuilt alongside so directories nothing refers to
+// any more are dropped too. Readers may still be scanning the old blob, so
+// the slots pointing into it are copied rather than rewritten.
+static bool compact(FileTable* ft) {
+    size_t live_bytes = ft->used - ft->dead_bytes;
+    size_t new_cap = INITIAL_CAPACITY;
+    while (new_cap < live_bytes) {
+        new_cap *= 2;
+    }
+
+    char* new_data = malloc(new_cap);
+    FileSlot* new_slots = malloc(ft->slot_capacity * sizeof(FileSlot));
+    if (!new_data || !new_slots) {
+        free(new_data);
+        free(new_slots);
+        return false;
+    }
+    memcpy(new_slots, ft->slots, ft->slot_count * sizeof(FileSlot));
+    for (uint32_t i = 0; i < ft->free_count; i++) {
+        new_slots[ft->free_slots[i]].offset = UINT32_MAX;
+    }
+
+    FileDirTable dirs = { 0 };
+    uint8_t dirs_borrowed = 0;
+    uint32_t last_old_dir = FT_DIR_NONE;
+    uint32_t last_new_dir = FT_DIR_NONE;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < ft->count; i++) {
+        FileEntry* entry = entry_at(ft, i);
+
+        // Sorted order keeps siblings adjacent, so most lookups are skipped
+        if (entry->dir != last_old_dir) {
+            const FileDir* dir = dir_at(&ft->dirs, entry->dir);
+            last_new_dir = intern_dir(NULL, &dirs, &dirs_borrowed, dir->str, dir->len, dir->hash);
+            last_old_dir = entry->dir;
+            if (last_new_dir == FT_DIR_NONE) {
+                free(new_data);
+                free(new_slots);
+                dirs_release(&dirs, &dirs_borrowed);
+                return false;
+            }
+        }
+
+        FileEntry* moved = (FileEntry*)(new_data + offset);
+        memcpy(moved, entry, entry->entry_size);
+        moved->dir = last_new_dir;
+        ft->index[i] = (uint32_t)offset;
+        new_slots[entry->slot].offset = (uint32_t)offset;
+        offset += entry->entry_size;
+    }
+
+    retire_array(ft, ft->data, FT_BORROWED_DATA);
+    retire_array(ft, ft->slots, FT_BORROWED_SLOTS);
+    retire_array(ft, ft->dirs.data, FT_BORROWED_DIR_DATA);
+    retire_array(ft, ft->dirs.offsets, FT_BORROWED_DIR_OFFSETS);
+    release_array(&ft->borrowed, ft->dirs.buckets, FT_BORROWED_DIR_BUCKETS);
+    ft->data = new_data;
+    ft->slots = new_slots;
+    ft->capacity = new_cap;
+    ft->used = offset;
+    ft->dead_bytes = 0;
+    ft->dirs = dirs;
+    return true;
+}
+
+static inline void maybe_compact(FileTable* ft) {
+    if (ft->dead_bytes >= COMPACT_MIN_DEAD_BYTES &&
+        ft->dead_bytes * COMPACT_DEAD_RATIO >= ft->used) {
+        compact(ft);
+    }
+}
+
+static FileTable* ft_alloc(void) {
+    FileTable* ft = NULL;
+    if (posix_memalign((void**)&ft, CACHE_LINE_SIZE, sizeof(FileTable)) != 0) {
+        return NULL;
+    }
+    memset(ft, 0, sizeof(FileTable));
+    atomic_flag_clear(&ft->lock);
+    return ft;
+}
+
 FileTable* ft_create() {
-    FileTable* ft = calloc(1, sizeof(FileTable));
+    FileTable* ft = ft_alloc();
     if (!ft) return NULL;
 
     ft->data = malloc(INITIAL_CAPACITY);
-    atomic_flag_clear(&ft->lock);
-    if (!ft->data) {
+    ft->index = malloc(INITIAL_INDEX_CAPACITY * sizeof(uint32_t));
+    ft->slots = malloc(INITIAL_SLOT_CAPACITY * sizeof(FileSlot));
+    ft->masks = malloc(INITIAL_SLOT_CAPACITY * sizeof(uint64_t));
+    ft->meta = malloc(INITIAL_SLOT_CAPACITY * sizeof(FileMeta));
+    if (!ft->data || !ft->index || !ft->slots || !ft->masks || !ft->meta) {
+        free(ft->data);
+        free(ft->index);
+        free(ft->slots);
+        free(ft->masks);
+        free(ft->meta);
         free(ft);
         return NULL;
     }
 
     ft->capacity = INITIAL_CAPACITY;
+    ft->index_capacity = INITIAL_INDEX_CAPACITY;
+    ft->slot_capacity = INITIAL_SLOT_CAPACITY;
+    ft->slot_count = 0;
     ft->used = 0;
     ft->count = 0;
+    ft->dead_bytes = 0;
+
+    publish(ft);
+    return ft;
+}
+
+// Checks what scans and lookups take for granted, since an image may come
+// from a damaged file: every entry and directory record lies within its
+// blob, names fit a path buffer, live entries and in-use slots point at
+// each other, and the index and buckets only hold what exists.
+static bool image_valid(const FileTableImage* image) {
+    for (uint32_t id = 0; id < image->dir_count; id++) {
+        uint32_t offset = image->dir_offsets[id];
+        if (offset % ENTRY_ALIGN != 0 || offset > image->dir_used ||
+            image->dir_used - offset < sizeof(FileDir)) {
+            return false;
+        }
+        const FileDir* dir = (const FileDir*)(image->dir_data + offset);
+        if (dir->len >= FT_MAX_PATH || image->dir_used - offset - sizeof(FileDir) <= dir->len) return false;
+    }
+
+    uint32_t occupied = 0;
+    for (uint32_t i = 0; i < image->dir_bucket_count; i++) {
+        if (image->dir_buckets[i] > image->dir_count) return false;
+        occupied += image->dir_buckets[i] != 0;
+    }
+    if (occupied != image->dir_count) return false;
+
+    size_t live = 0;
+    size_t offset = 0;
+    while (offset < image->used) {
+        if (image->used - offset < sizeof(FileEntry)) return false;
+        const FileEntry* entry = (const FileEntry*)(image->data + offset);
+        size_t name_room = entry->entry_size - sizeof(FileEntry);
+        if (entry->entry_size <= sizeof(FileEntry) || entry->entry_size % ENTRY_ALIGN != 0 ||
+            entry->entry_size > image->used - offset ||
+            entry->dir >= image->dir_count ||
+            !memchr(entry->name, '\0', name_room)) {
+            return false;
+        }
+
+        const FileDir* dir = (const FileDir*)(image->dir_data + image->dir_offsets[entry->dir]);
+        if (dir->len + strlen(entry->name) >= FT_MAX_PATH) return false;
+
+        if (!(entry->flags & FT_ENTRY_DEAD)) {
+            if (entry->slot >= image->slot_count || !image->slots[entry->slot].in_use ||
+                image->slots[entry->slot].offset != offset) {
+                return false;
+            }
+            live++;
+        }
+        offset += entry->entry_size;
+    }
 
+    size_t in_use = 0;
+    for (uint32_t slot = 0; slot < image->slot_count; slot++) {
+        in_use += image->slots[slot].in_use != 0;
+    }
+    if (live != in_use || live != image->count) return false;
+
+    for (size_t i = 0; i < image->count; i++) {
+        uint32_t offset = image->index[i];
+        if (offset % ENTRY_ALIGN != 0 || offset > image->used ||
+            image->used - offset < sizeof(FileEntry)) {
+            return false;
+        }
+        const FileEntry* entry = (const FileEntry*)(image->data + offset);
+        if (entry->slot >= image->slot_count || !image->slots[entry->slot].in_use ||
+            image->slots[entry->slot].offset != offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Builds a table on top of an image without copying it. The arrays stay
+// borrowed until the first write that needs to grow or compact them, so
+// the image memory must outlive the table. Returns NULL for an image that
+// fails image_valid.
+FileTable* ft_create_from_image(const FileTableImage* image) {
+    if (!image || !image_valid(image)) return NULL;
+
+    FileTable* ft = ft_alloc();
+    if (!ft) return NULL;
+
+    ft->data = image->data;
+    ft->capacity = image->used;
+    ft->used = image->used;
+    ft->dead_bytes = image->dead_bytes;
+    ft->index = image->index;
+    ft->index_capacity = image->count;
+    ft->count = image->count;
+    ft->slots = image->slots;
+    ft->masks = image->masks;
+    ft->meta = image->meta;
+    ft->slot_capacity = image->slot_count;
+    ft->slot_count = image->slot_count;
+    ft->dirs.data = image->dir_data;
+    ft->dirs.used = image->dir_used;
+    ft->dirs.capacity = image->dir_used;
+    ft->dirs.offsets = image->dir_offsets;
+    ft->dirs.count = image->dir_count;
+    ft->dirs.offsets_capacity = image->dir_count;
+    ft->dirs.buckets = image->dir_buckets;
+    ft->dirs.bucket_count = image->dir_bucket_count;
+    ft->borrowed = FT_BORROWED_DATA | FT_BORROWED_INDEX | FT_BORROWED_SLOTS | FT_BORROWED_MASKS |
+                   FT_BORROWED_DIR_DATA | FT_BORROWED_DIR_OFFSETS | FT_BORROWED_DIR_BUCKETS |
+                   FT_BORROWED_META;
+
+    for (uint32_t slot = image->slot_count; slot-- > 0;) {
+        if (!ft->slots[slot].in_use) push_free_slot(ft, slot);
+    }
+
+    publish(ft);
     return ft;
 }
 
+static void* copy_out(const void* src, size_t len) {
+    void* copy = malloc(len ? len : 1);
+    if (copy && len) memcpy(copy, src, len);
+    return copy;
+}
+
+// Copies the table out under the lock; release with ft_image_free.
+bool ft_export(FileTable* ft, FileTableImage* image) {
+    if (!ft || !image) return false;
+    memset(image, 0, sizeof(*image));
+    spin_lock(&ft->lock);
+
+    image->data = copy_out(ft->data, ft->used);
+    image->index = copy_out(ft->index, ft->count * sizeof(uint32_t));
+    image->slots = copy_out(ft->slots, ft->slot_count * sizeof(FileSlot));
+    image->masks = copy_out(ft->masks, ft->slot_count * sizeof(uint64_t));
+    image->meta = copy_out(ft->meta, ft->slot_count * sizeof(FileMeta));
+    image->dir_data = copy_out(ft->dirs.data, ft->dirs.used);
+    image->dir_offsets = copy_out(ft->dirs.offsets, ft->dirs.count * sizeof(uint32_t));
+    image->dir_buckets = copy_out(ft->dirs.buckets, ft->dirs.bucket_count * sizeof(uint32_t));
+    if (!image->data || !image->index || !image->slots || !image->masks || !image->meta ||
+        !image->dir_data || !image->dir_offsets || !image->dir_buckets) {
+        spin_unlock(&ft->lock);
+        ft_image_free(image);
+        return false;
+    }
+
+    image->used = ft->used;
+    image->dead_bytes = ft->dead_bytes;
+    image->count = ft->count;
+    image->slot_count = ft->slot_count;
+    image->dir_used = ft->dirs.used;
+    image->dir_count = ft->dirs.count;
+    image->dir_bucket_count = ft->dirs.bucket_count;
+
+    spin_unlock(&ft->lock);
+    return true;
+}
+
+void ft_image_free(FileTableImage* image) {
+    if (!image) return;
+    free(image->data);
+    free(image->index);
+    free(image->slots);
+    free(image->masks);
+    free(image->meta);
+    free(image->dir_data);
+    free(image->dir_offsets);
+    free(image->dir_buckets);
+    memset(image, 0, sizeof(*image));
+}
+
 void ft_destroy(FileTable* ft) {
     if (!ft) return;
-    free(ft->data);
+    release_array(&ft->borrowed, ft->data, FT_BORROWED_DATA);
+    release_array(&ft->borrowed, ft->index, FT_BORROWED_INDEX);
+    release_array(&ft->borrowed, ft->slots, FT_BORROWED_SLOTS);
+    release_array(&ft->borrowed, ft->masks, FT_BORROWED_MASKS);
+    release_array(&ft->borrowed, ft->meta, FT_BORROWED_META);
+    dirs_release(&ft->dirs, &ft->borrowed);
+    free(ft->free_slots);
+    free(atomic_load(&ft->view));
+    for (int i = 0; i < 2; i++) {
+        retired_free(&ft->retired[i]);
+        free(ft->retired[i].items);
+    }
     free(ft);
 }
 
+static inline void tombstone(FileTable* ft, FileEntry* entry) {
+    __atomic_store_n(&entry->flags, entry->flags | FT_ENTRY_DEAD, __ATOMIC_RELAXED);
+    ft->dead_bytes += entry->entry_size;
+    release_slot(ft, entry->slot);
+}
+
+static bool reserve_index(FileTable* ft, size_t count) {
+    if (count <= ft->index_capacity) return true;
+
+    size_t new_cap = ft->index_capacity ? ft->index_capacity : INITIAL_INDEX_CAPACITY;
+    while (new_cap < count) {
+        new_cap *= 2;
+    }
+    uint32_t* new_index = grow_array(&ft->borrowed, ft->index,
+                                     ft->count * sizeof(uint32_t),
+                                     new_cap * sizeof(uint32_t),
+                                     FT_BORROWED_INDEX);
+    if (!new_index) return false;
+    ft->index = new_index;
+    ft->index_capacity = new_cap;
+    return true;
+}
+
+typedef struct {
+    const char* ext;
+    uint8_t mime_class;
+} ExtensionClass;
+
+// Common extensions only; anything else is left for GIO to sniff once the
+// file is opened
+static const ExtensionClass extension_classes[] = {
+    { "txt", FT_MIME_TEXT }, { "md", FT_MIME_TEXT }, { "rst", FT_MIME_TEXT },
+    { "org", FT_MIME_TEXT }, { "csv", FT_MIME_TEXT }, { "log", FT_MIME_TEXT },
+    { "c", FT_MIME_CODE }, { "h", FT_MIME_CODE }, { "cc", FT_MIME_CODE },
+    { "cpp", FT_MIME_CODE }, { "hpp", FT_MIME_CODE }, { "rs", FT_MIME_CODE },
+    { "go", FT_MIME_CODE }, { "py", FT_MIME_CODE }, { "js", FT_MIME_CODE },
+    { "ts", FT_MIME_CODE }, { "java", FT_MIME_CODE }, { "vala", FT_MIME_CODE },
+    { "vapi", FT_MIME_CODE }, { "sh", FT_MIME_CODE }, { "lua", FT_MIME_CODE },
+    { "json", FT_MIME_CODE }, { "xml", FT_MIME_CODE }, { "html", FT_MIME_CODE },
+    { "css", FT_MIME_CODE }, { "toml", FT_MIME_CODE }, { "yaml", FT_MIME_CODE },
+    { "yml", FT_MIME_CODE },
+    { "png", FT_MIME_IMAGE }, { "jpg", FT_MIME_IMAGE }, { "jpeg", FT_MIME_IMAGE },
+    { "gif", FT_MIME_IMAGE }, { "webp", FT_MIME_IMAGE }, { "svg", FT_MIME_IMAGE },
+    { "bmp", FT_MIME_IMAGE }, { "tif", FT_MIME_IMAGE }, { "tiff", FT_MIME_IMAGE },
+    { "heic", FT_MIME_IMAGE }, { "avif", FT_MIME_IMAGE },
+    { "mp3", FT_MIME_AUDIO }, { "flac", FT_MIME_AUDIO }, { "ogg", FT_MIME_AUDIO },
+    { "opus", FT_MIME_AUDIO }, { "wav", FT_MIME_AUDIO }, { "m4a", FT_MIME_AUDIO },
+    { "mp4", FT_MIME_VIDEO }, { "mkv", FT_MIME_VIDEO }, { "webm", FT_MIME_VIDEO },
+    { "avi", FT_MIME_VIDEO }, { "mov", FT_MIME_VIDEO },
+    { "zip", FT_MIME_ARCHIVE }, { "tar", FT_MIME_ARCHIVE }, { "gz", FT_MIME_ARCHIVE },
+    { "xz", FT_MIME_ARCHIVE }, { "zst", FT_MIME_ARCHIVE }, { "bz2", FT_MIME_ARCHIVE },
+    { "7z", FT_MIME_ARCHIVE }, { "rar", FT_MIME_ARCHIVE },
+    { "pdf", FT_MIME_DOCUMENT }, { "odt", FT_MIME_DOCUMENT }, { "ods", FT_MIME_DOCUMENT },
+    { "odp", FT_MIME_DOCUMENT }, { "doc", FT_MIME_DOCUMENT }, { "docx", FT_MIME_DOCUMENT },
+    { "xls", FT_MIME_DOCUMENT }, { "xlsx", FT_MIME_DOCUMENT }, { "ppt", FT_MIME_DOCUMENT },
+    { "pptx", FT_MIME_DOCUMENT }, { "epub", FT_MIME_DOCUMENT },
+};
+
+static uint8_t guess_mime_class(const char* name) {
+    const char* dot = strrchr(name, '.');
+    if (!dot || dot == name || strlen(dot + 1) > 4) return FT_MIME_UNKNOWN;
+
+    for (size_t i = 0; i < sizeof(extension_classes) / sizeof(extension_classes[0]); i++) {
+        if (strcasecmp(dot + 1, extension_classes[i].ext) == 0) return extension_classes[i].mime_class;
+    }
+    return FT_MIME_UNKNOWN;
+}
+
+// Appends the entry for path to the blob and gives it a slot, leaving the
+// index alone. Returns its offset, or UINT32_MAX if the table is full.
+static uint32_t append_entry(FileTable* ft, const char* path, size_t len, uint8_t type) {
+    const char* slash = strrchr(path, '/');
+    uint32_t dir_len = slash ? (uint32_t)(slash - path + 1) : 0;
+    const char* name = path + dir_len;
+    size_t name_len = len - dir_len;
+
+    size_t entry_size = (sizeof(FileEntry) + name_len + 1 + ENTRY_ALIGN - 1) & ~(size_t)(ENTRY_ALIGN - 1);
+
+    // Offsets into the blob are 32 bits wide
+    if (ft->used + entry_size >= UINT32_MAX) return UINT32_MAX;
+
+    if (ft->used + entry_size > ft->capacity) {
+        size_t new_cap = ft->capacity ? ft->capacity : INITIAL_CAPACITY;
+        while (ft->used + entry_size > new_cap) {
+            new_cap *= 2;
+        }
+        char* new_data = grow_shared(ft, ft->data, ft->used, new_cap, FT_BORROWED_DATA);
+        if (!new_data) return UINT32_MAX;
+        ft->data = new_data;
+        ft->capacity = new_cap;
+    }
+
+    uint32_t dir = intern_dir(ft, &ft->dirs, &ft->borrowed, path, dir_len, (uint32_t)XXH3_64bits(path, dir_len));
+    if (dir == FT_DIR_NONE) return UINT32_MAX;
+
+    uint32_t slot = alloc_slot(ft);
+    if (slot == FT_SLOT_NONE) return UINT32_MAX;
+
+    size_t offset = ft->used;
+    FileEntry* new_entry = (FileEntry*)(ft->data + offset);
+    new_entry->entry_size = (uint32_t)entry_size;
+    new_entry->flags = 0;
+    new_entry->hash = g_str_hash(path);
+    new_entry->slot = slot;
+    new_entry->dir = dir;
+    new_entry->generation = ft->slots[slot].generation;
+    memcpy(new_entry->name, name, name_len + 1);
+    ft->meta[slot] = (FileMeta){
+        .type = type,
+        .mime_class = type == FT_TYPE_DIRECTORY ? FT_MIME_UNKNOWN : guess_mime_class(name),
+    };
+
+    // A reused slot may be under a reader's view: the offset is past what
+    // the view covers until it is republished, and the mask goes last
+    __atomic_store_n(&ft->slots[slot].offset, (uint32_t)offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&ft->masks[slot], fp_path_mask(path), __ATOMIC_RELEASE);
+    ft->used += entry_size;
+    return (uint32_t)offset;
+}
+
 bool ft_insert(FileTable* ft, const char* path) {
+    return ft_insert_meta(ft, path, NULL);
+}
+
+bool ft_insert_meta(FileTable* ft, const char* path, const FileMeta* meta) {
     if (!ft || !path) return false;
+
+    size_t len = strlen(path);
+    if (len >= FT_MAX_PATH) return false;
+
     spin_lock(&ft->lock);
 
-    if (ft->count >= UINT16_MAX) {
+    bool found;
+    size_t pos = lower_bound(ft, path, &found);
+    if (found) {
+        spin_unlock(&ft->lock);
+        return true;
+    }
+
+    uint8_t type = meta ? meta->type : FT_TYPE_UNKNOWN;
+    uint32_t offset = reserve_index(ft, ft->count + 1) ? append_entry(ft, path, len, type) : UINT32_MAX;
+    if (offset == UINT32_MAX) {
         spin_unlock(&ft->lock);
         return false;
     }
+    if (meta) ft->meta[((FileEntry*)(ft->data + offset))->slot] = *meta;
 
-    size_t len = strlen(path);
-    size_t entry_size = (sizeof(FileEntry) + len + 1 + 1) & ~(size_t)1;
-
-    // 1. Ensure capacity - grow if needed
-    while (ft->used + entry_size > ft->capacity) {
-        size_t new_cap = ft->capacity * 2;
-        char* new_data = realloc(ft->data, new_cap);
-        if (!new_data) {
-            spin_unlock(&ft->lock);
-            return false;
+    memmove(ft->index + pos + 1, ft->index + pos, (ft->count - pos) * sizeof(uint32_t));
+    ft->index[pos] = offset;
+    ft->count++;
+    ft->version++;
+
+    publish(ft);
+    spin_unlock(&ft->lock);
+    return true;
+}
+
+// Like lower_bound, but for a path known to sort at or after position
+// start. Probes at doubling distances first, so a sorted batch costs
+// O(n log(count / n)) comparisons instead of O(n log count).
+static size_t lower_bound_from(FileTable* ft, size_t start, const char* path, bool* found) {
+    size_t lo = start;
+    size_t hi = start;
+    size_t step = 1;
+
+    while (hi < ft->count && entry_cmp(ft, entry_at(ft, hi), path) < 0) {
+        lo = hi + 1;
+        hi = start + step;
+        step *= 2;
+    }
+    if (hi > ft->count) hi = ft->count;
+
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        if (entry_cmp(ft, entry_at(ft, mid), path) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        ft->data = new_data;
-        ft->capacity = new_cap;
     }
 
-    // 2. Find insertion point (first entry where path < entry->str)
-    size_t ins_offset = ft->used;  // default: append at end
-    size_t offset = 0;
+    *found = lo < ft->count && entry_cmp(ft, entry_at(ft, lo), path) == 0;
+    return lo;
+}
 
-    while (offset < ft->used) {
-        FileEntry* entry = (FileEntry*)(ft->data + offset);
-        int cmp = strcmp(path, entry->str);
+size_t ft_insert_batch(FileTable* ft, const char* const* paths, const uint8_t* types, size_t n) {
+    if (!ft || !paths || n == 0) return 0;
 
-        if (cmp < 0) {
-            ins_offset = offset;
-            break;
-        } else if (cmp == 0) {
-            spin_unlock(&ft->lock);
-            return true;
+    // Where each new path goes and where its entry landed in the blob
+    size_t* positions = malloc(n * sizeof(size_t));
+    uint32_t* offsets = malloc(n * sizeof(uint32_t));
+    if (!positions || !offsets) {
+        free(positions);
+        free(offsets);
+        return 0;
+    }
+
+    spin_lock(&ft->lock);
+
+    size_t indexed = 0;
+    size_t added = 0;
+    size_t cursor = 0;
+    const char* previous = NULL;
+
+    for (size_t i = 0; i < n; i++) {
+        const char* path = paths[i];
+        size_t len = strlen(path);
+        if (len >= FT_MAX_PATH) continue;
+
+        if (previous && strcmp(previous, path) == 0) {
+            indexed++;
+            continue;
         }
 
-        offset += entry->entry_size;
+        bool found;
+        cursor = lower_bound_from(ft, cursor, path, &found);
+        if (found) {
+            previous = path;
+            indexed++;
+            continue;
+        }
+
+        // Appending does not move the index, so positions stay valid
+        uint32_t offset = append_entry(ft, path, len, types ? types[i] : FT_TYPE_UNKNOWN);
+        if (offset == UINT32_MAX) break;
+
+        positions[added] = cursor;
+        offsets[added] = offset;
+        added++;
+        previous = path;
+        indexed++;
     }
 
-    // 3. Shift data after insertion point
-    size_t bytes_to_move = ft->used - ins_offset;
-    if (bytes_to_move > 0) {
-        memmove(ft->data + ins_offset + entry_size,
-                ft->data + ins_offset,
-                bytes_to_move);
+    if (added > 0 && !reserve_index(ft, ft->count + added)) {
+        // The entries are in the blob but unreachable; account them as
+        // dead so compaction reclaims them
+        for (size_t k = 0; k < added; k++) {
+            tombstone(ft, (FileEntry*)(ft->data + offsets[k]));
+        }
+        indexed -= added;
+        added = 0;
     }
 
-    // 4. Write new entry
-    FileEntry* new_entry = (FileEntry*)(ft->data + ins_offset);
-    new_entry->entry_size = (uint16_t)entry_size;
-    new_entry->hash = g_str_hash(path);
-    strcpy(new_entry->str, path);
+    // Merge from the back so every existing offset moves exactly once
+    size_t end = ft->count;
+    for (size_t k = added; k > 0; k--) {
+        size_t pos = positions[k - 1];
+        memmove(ft->index + pos + k, ft->index + pos, (end - pos) * sizeof(uint32_t));
+        ft->index[pos + k - 1] = offsets[k - 1];
+        end = pos;
+    }
 
-    ft->used += entry_size;
-    ft->count++;
+    if (added > 0) {
+        ft->count += added;
+        ft->version++;
+    }
 
+    publish(ft);
     spin_unlock(&ft->lock);
-    return true;
+    free(positions);
+    free(offsets);
+    return indexed;
 }
 
 bool ft_remove(FileTable* ft, const char* path) {
     if (!ft || !path) return false;
     spin_lock(&ft->lock);
 
-    size_t offset = 0;
-    while (offset < ft->used) {
-        FileEntry* entry = (FileEntry*)(ft->data + offset);
-        int cmp = strcmp(path, entry->str);
-
-        if (cmp == 0) {
-            // Found it - shift everything after it back
-            size_t entry_size = entry->entry_size;
-            size_t bytes_after = ft->used - offset - entry_size;
-
-            if (bytes_after > 0) {
-                memmove(ft->data + offset,
-                        ft->data + offset + entry_size,
-                        bytes_after);
-            }
+    bool found;
+    size_t pos = lower_bound(ft, path, &found);
+    if (!found) {
+        spin_unlock(&ft->lock);
+        return false;
+    }
+
+    tombstone(ft, entry_at(ft, pos));
+
+    memmove(ft->index + pos, ft->index + pos + 1, (ft->count - pos - 1) * sizeof(uint32_t));
+    ft->count--;
+    ft->version++;
+
+    maybe_compact(ft);
+
+    publish(ft);
+    spin_unlock(&ft->lock);
+    return true;
+}
+
+// Removes paths, sorted as strcmp orders them, under one lock acquisition
+// and closes the gaps in the index in a single pass.
+size_t ft_remove_batch(FileTable* ft, const char* const* paths, size_t n) {
+    if (!ft || !paths || n == 0) return 0;
+    spin_lock(&ft->lock);
+
+    size_t removed = 0;
+    size_t cursor = 0;
+    size_t write = 0;
+    for (size_t i = 0; i < n && cursor < ft->count; i++) {
+        bool found;
+        size_t pos = lower_bound_from(ft, cursor, paths[i], &found);
 
-            ft->used -= entry_size;
-            ft->count--;
-            spin_unlock(&ft->lock);
-            return true;
+        // Keep everything between the previous hit and this one
+        if (removed > 0) {
+            memmove(ft->index + write, ft->index + cursor, (pos - cursor) * sizeof(uint32_t));
         }
+        write += pos - cursor;
+        cursor = pos;
 
-        if (cmp < 0) {
-            // Past where it would be - not found
-            spin_unlock(&ft->lock);
-            return false;
+        if (found) {
+            tombstone(ft, entry_at(ft, pos));
+            cursor++;
+            removed++;
         }
+    }
 
-        offset += entry->entry_size;
+    if (removed > 0) {
+        memmove(ft->index + write, ft->index + cursor, (ft->count - cursor) * sizeof(uint32_t));
+        ft->count -= removed;
+        ft->version++;
+        maybe_compact(ft);
+        publish(ft);
     }
 
     spin_unlock(&ft->lock);
-    return false;
+    return removed;
 }
 
-const char* ft_lookup_by_index(FileTable* ft, uint16_t index) {
-    if (!ft || index >= ft->count) return NULL;
+// Removes every entry starting with prefix. The matches form one contiguous
+// run of the sorted index, so this is a single splice.
+size_t ft_remove_prefix(FileTable* ft, const char* prefix) {
+    if (!ft || !prefix) return 0;
     spin_lock(&ft->lock);
 
-    size_t offset = 0;
-    uint16_t i = 0;
+    size_t prefix_len = strlen(prefix);
+    size_t start = lower_bound(ft, prefix, NULL);
+    size_t end = prefix_end(ft, start, prefix, prefix_len);
+
+    for (size_t i = start; i < end; i++) {
+        tombstone(ft, entry_at(ft, i));
+    }
+
+    size_t removed = end - start;
+    if (removed > 0) {
+        memmove(ft->index + start, ft->index + end, (ft->count - end) * sizeof(uint32_t));
+        ft->count -= removed;
+        ft->version++;
+        maybe_compact(ft);
+        publish(ft);
+    }
+
+    spin_unlock(&ft->lock);
+    return removed;
+}
+
+// Tombstones every entry the predicate selects and rebuilds the index in a
+// single pass. Returns the number of entries removed.
+size_t ft_remove_if(FileTable* ft, ft_predicate predicate, void* user_data) {
+    if (!ft || !predicate) return 0;
+    spin_lock(&ft->lock);
 
-    while (offset < ft->used) {
-        FileEntry* entry = (FileEntry*)(ft->data + offset);
-        if (i == index) {
-            char* dup = strdup(entry->str);
-            spin_unlock(&ft->lock);
-            return dup;
+    PathBuffer pb;
+    path_buffer_init(&pb);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < ft->count; i++) {
+        FileEntry* entry = entry_at(ft, i);
+        if (predicate(entry, assemble_path(&ft->dirs, &pb, entry), user_data)) {
+            tombstone(ft, entry);
+        } else {
+            ft->index[kept++] = ft->index[i];
         }
-        offset += entry->entry_size;
-        i++;
+    }
+
+    size_t removed = ft->count - kept;
+    ft->count = kept;
+    if (removed > 0) {
+        ft->version++;
+        maybe_compact(ft);
+        publish(ft);
     }
 
     spin_unlock(&ft->lock);
-    return NULL;
+    return removed;
 }
 
-void ft_iterate(FileTable* ft, ft_iterator callback, void* user_data) {
-    if (!ft || !callback) return;
+bool ft_contains(FileTable* ft, const char* path) {
+    if (!ft || !path) return false;
+    spin_lock(&ft->lock);
+
+    bool found;
+    lower_bound(ft, path, &found);
+
+    spin_unlock(&ft->lock);
+    return found;
+}
+
+// Returns whether any entry starts with prefix or, with direct_child,
+// whether any entry sits directly in the directory prefix, which must then
+// end in '/'. Subdirectories are skipped as in ft_iterate_children.
+bool ft_has_prefix(FileTable* ft, const char* prefix, bool direct_child) {
+    if (!ft || !prefix) return false;
+    spin_lock(&ft->lock);
+
+    size_t prefix_len = strlen(prefix);
+    size_t pos = lower_bound(ft, prefix, NULL);
+    bool found = false;
+
+    while (pos < ft->count) {
+        FileEntry* entry = entry_at(ft, pos);
+        if (!entry_has_prefix(ft, entry, prefix, prefix_len)) break;
+
+        const FileDir* dir = dir_at(&ft->dirs, entry->dir);
+        if (!direct_child || dir->len == prefix_len) {
+            found = true;
+            break;
+        }
+
+        // The entry is deeper down, so its child directory is in dir->str
+        const char* slash = memchr(dir->str + prefix_len, '/', dir->len - prefix_len);
+        size_t key_len = slash - dir->str;
+        char key[key_len + 2];
+        memcpy(key, dir->str, key_len);
+        key[key_len] = '/' + 1;
+        key[key_len + 1] = '\0';
+        pos = lower_bound(ft, key, NULL);
+    }
+
+    spin_unlock(&ft->lock);
+    return found;
+}
+
+size_t ft_size(FileTable* ft) {
+    if (!ft) return 0;
+    return __atomic_load_n(&ft->count, __ATOMIC_RELAXED);
+}
+
+uint64_t ft_version(FileTable* ft) {
+    if (!ft) return 0;
+    return __atomic_load_n(&ft->version, __ATOMIC_RELAXED);
+}
+
+char* ft_lookup_by_slot(FileTable* ft, uint32_t slot, uint16_t generation, FileMeta* meta) {
+    if (!ft) return NULL;
+    spin_lock(&ft->lock);
+
+    if (slot >= ft->slot_count ||
+        !ft->slots[slot].in_use ||
+        ft->slots[slot].generation != generation) {
+        spin_unlock(&ft->lock);
+        return NULL;
+    }
+
+    FileEntry* entry = (FileEntry*)(ft->data + ft->slots[slot].offset);
+    const FileDir* dir = dir_at(&ft->dirs, entry->dir);
+    size_t name_len = strlen(entry->name);
+
+    char* path = malloc(dir->len + name_len + 1);
+    if (path) {
+        memcpy(path, dir->str, dir->len);
+        memcpy(path + dir->len, entry->name, name_len + 1);
+    }
+    if (meta) *meta = ft->meta[slot];
+
+    spin_unlock(&ft->lock);
+    return path;
+}
+
+void ft_set_stat(FileTable* ft, uint32_t slot, uint16_t generation, uint64_t size, uint32_t mtime) {
+    if (!ft) return;
+    spin_lock(&ft->lock);
+
+    if (slot < ft->slot_count && ft->slots[slot].in_use && ft->slots[slot].generation == generation) {
+        FileMeta* meta = &ft->meta[slot];
+        meta->size = size;
+        meta->mtime = mtime;
+        meta->flags |= FT_META_STAT;
+    }
+
+    spin_unlock(&ft->lock);
+}
+
+// Calls back for the direct children of dir_prefix, which must end in '/'.
+// Deeper descendants are skipped by seeking past "<child>/" in the index.
+void ft_iterate_children(FileTable* ft, const char* dir_prefix, ft_path_iterator callback, void* user_data) {
+    if (!ft || !dir_prefix || !callback) return;
     spin_lock(&ft->lock);
 
+    PathBuffer pb;
+    path_buffer_init(&pb);
+
+    size_t prefix_len = strlen(dir_prefix);
+    size_t pos = lower_bound(ft, dir_prefix, NULL);
+
+    while (pos < ft->count) {
+        FileEntry* entry = entry_at(ft, pos);
+        if (!entry_has_prefix(ft, entry, dir_prefix, prefix_len)) break;
+
+        const char* path = assemble_path(&ft->dirs, &pb, entry);
+        const char* slash = strchr(path + prefix_len, '/');
+        if (!slash) {
+            callback(path, user_data);
+            pos++;
+            continue;
+        }
+
+        // '0' sorts right after '/', so this is the first key past the subtree
+        size_t key_len = slash - path;
+        char key[key_len + 2];
+        memcpy(key, path, key_len);
+        key[key_len] = '/' + 1;
+        key[key_len + 1] = '\0';
+        pos = lower_bound(ft, key, NULL);
+    }
+
+    spin_unlock(&ft->lock);
+}
+
+// Per-scan state of each directory, indexed by dir id: DIR_UNKNOWN until
+// tested, then DIR_FAIL, or DIR_PASS plus how many of FileQuery.path_chars
+// the directory part matched. Without either test, or if the array cannot
+// be allocated, every entry passes.
+typedef struct {
+    const FileQuery* query;
+    uint16_t* states;
+} DirFilter;
+
+enum { DIR_UNKNOWN, DIR_FAIL, DIR_PASS };
+
+static inline void dir_filter_init(const FileDirTable* dirs, DirFilter* filter, const FileQuery* query) {
+    filter->query = query;
+    filter->states = query && (query->dir_len || query->path_len) && dirs->count &&
+                     query->path_len <= UINT16_MAX - DIR_PASS
+        ? calloc(dirs->count, sizeof(uint16_t))
+        : NULL;
+}
+
+static inline bool dir_filter_passes(const FileDirTable* dirs, DirFilter* filter, const FileEntry* entry) {
+    if (!filter->states) return true;
+
+    const FileQuery* query = filter->query;
+    uint16_t* state = &filter->states[entry->dir];
+    if (*state == DIR_UNKNOWN) {
+        const FileDir* d = dir_at(dirs, entry->dir);
+        *state = fp_contains_subsequence(d->str, d->len, query->dir_chars, query->dir_len)
+            ? DIR_PASS + fp_subsequence_prefix(d->str, d->len, query->path_chars, query->path_len)
+            : DIR_FAIL;
+    }
+    if (*state == DIR_FAIL) return false;
+
+    // Matching resumes after the directory part, shared by its siblings
+    size_t matched = *state - DIR_PASS;
+    size_t rest = query->path_len - matched;
+    return rest == 0 || fp_subsequence_prefix(entry->name, SIZE_MAX, query->path_chars + matched, rest) == rest;
+}
+
+// Returns the live entry a slot of the view points to, or NULL if the slot
+// was released or reused since the view was published.
+static inline const FileEntry* view_entry(const FileTableView* view, uint32_t slot) {
+    uint32_t offset = __atomic_load_n(&view->slots[slot].offset, __ATOMIC_RELAXED);
+    if (offset >= view->used) return NULL;
+
+    const FileEntry* entry = (const FileEntry*)(view->data + offset);
+    return entry_flags(entry) & FT_ENTRY_DEAD ? NULL : entry;
+}
+
+static void iterate_view(const FileTableView* view, DirFilter* filter, ft_iterator callback, void* user_data) {
+    PathBuffer pb;
+    path_buffer_init(&pb);
+
     size_t offset = 0;
-    uint16_t i = 0;
 
-    while (offset < ft->used) {
-        FileEntry* entry = (FileEntry*)(ft->data + offset);
-        callback(i++, entry->str, entry->hash, user_data);
+    while (offset < view->used) {
+        const FileEntry* entry = (const FileEntry*)(view->data + offset);
         offset += entry->entry_size;
+        if (entry_flags(entry) & FT_ENTRY_DEAD) continue;
+        if (filter && !dir_filter_passes(&view->dirs, filter, entry)) continue;
+
+        callback(entry->slot, entry->generation, assemble_path(&view->dirs, &pb, entry), entry->hash, user_data);
     }
+}
+
+void ft_iterate_prefix(FileTable* ft, const char* prefix, ft_path_iterator callback, void* user_data) {
+    if (!ft || !prefix || !callback) return;
+    spin_lock(&ft->lock);
+
+    PathBuffer pb;
+    path_buffer_init(&pb);
+
+    size_t prefix_len = strlen(prefix);
+    for (size_t pos = lower_bound(ft, prefix, NULL); pos < ft->count; pos++) {
+        FileEntry* entry = entry_at(ft, pos);
+        if (!entry_has_prefix(ft, entry, prefix, prefix_len)) break;
+        callback(assemble_path(&ft->dirs, &pb, entry), user_data);
+    }
+
+    spin_unlock(&ft->lock);
+}
+
+void ft_iterate(FileTable* ft, ft_iterator callback, void* user_data) {
+    if (!ft || !callback) return;
+    spin_lock(&ft->lock);
+
+    FileTableView view;
+    fill_view(ft, &view);
+    iterate_view(&view, NULL, callback, user_data);
+
     spin_unlock(&ft->lock);
 }
+
+// Like ft_iterate, but skips what the query rules out, and without the
+// lock: writers may change the table meanwhile, and the scan sees it as of
+// the version returned. The mask lane is scanned in blocks and only the
+// survivors' entries are read from the blob.
+uint64_t ft_iterate_filtered(FileTable* ft, const FileQuery* query, ft_iterator callback, void* user_data) {
+    if (!ft || !query || !callback) return 0;
+
+    ViewGuard guard;
+    const FileTableView* view = view_enter(ft, &guard);
+
+    DirFilter filter;
+    dir_filter_init(&view->dirs, &filter, query);
+
+    if (!query->mask) {
+        iterate_view(view, &filter, callback, user_data);
+    } else {
+        PathBuffer pb;
+        path_buffer_init(&pb);
+        uint32_t survivors[SCAN_BLOCK];
+
+        for (uint32_t base = 0; base < view->slot_count; base += SCAN_BLOCK) {
+            uint32_t n = view->slot_count - base < SCAN_BLOCK ? view->slot_count - base : SCAN_BLOCK;
+            size_t found = fp_scan(view->masks + base, n, query->mask, survivors);
+            // Pairs with the release store of a reused slot's mask
+            atomic_thread_fence(memory_order_acquire);
+
+            for (size_t i = 0; i < found; i++) {
+                uint32_t slot = base + survivors[i];
+                const FileEntry* entry = view_entry(view, slot);
+                if (!entry || !dir_filter_passes(&view->dirs, &filter, entry)) continue;
+                callback(slot, entry->generation, assemble_path(&view->dirs, &pb, entry), entry->hash, user_data);
+            }
+        }
+    }
+
+    uint64_t version = view->version;
+    view_exit(ft, &guard);
+    free(filter.states);
+    return version;
+}
+
+// Calls back for the listed slots the query does not rule out, provided
+// the table is still at `version`. Returns false without calling back
+// otherwise. Like ft_iterate_filtered this runs without the lock.
+bool ft_iterate_slots(FileTable* ft, uint64_t version, const uint32_t* slots, size_t count,
+                      const FileQuery* query, ft_iterator callback, void* user_data) {
+    if (!ft || !query || !callback) return false;
+
+    ViewGuard guard;
+    const FileTableView* view = view_enter(ft, &guard);
+
+    if (view->version != version) {
+        view_exit(ft, &guard);
+        return false;
+    }
+
+    DirFilter filter;
+    dir_filter_init(&view->dirs, &filter, query);
+    PathBuffer pb;
+    path_buffer_init(&pb);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t slot = slots[i];
+        if (slot >= view->slot_count) continue;
+        uint64_t mask = __atomic_load_n(&view->masks[slot], __ATOMIC_ACQUIRE);
+        if ((mask & query->mask) != query->mask) continue;
+
+        const FileEntry* entry = view_entry(view, slot);
+        if (!entry || !dir_filter_passes(&view->dirs, &filter, entry)) continue;
+        callback(slot, entry->generation, assemble_path(&view->dirs, &pb, entry), entry->hash, user_data);
+    }
+
+    view_exit(ft, &guard);
+    free(filter.states);
+    return true;
+}
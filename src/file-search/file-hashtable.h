@@ -6,30 +6,220 @@
 #include <stdlib.h>
 #include <stdatomic.h>
 
+#define FT_ENTRY_DEAD 0x1
+
+// Paths are split at their last '/': the directory part is interned once
+// per table and entries only store its id next to the basename. `hash` is
+// still the hash of the full path.
 typedef struct {
-    uint16_t entry_size;
+    uint32_t entry_size;
     uint32_t hash;
-    char str[];
+    uint32_t slot;
+    uint32_t dir;
+    uint16_t generation;
+    uint16_t flags;
+    char name[];
 } FileEntry;
 
+// Interned directory part, including its trailing '/' (empty for paths
+// without one).
+typedef struct {
+    uint32_t len;
+    uint32_t hash;
+    char str[];
+} FileDir;
+
+#define FT_MAX_PATH 4096
+#define FT_DIR_NONE UINT32_MAX
+
+#define FT_SLOT_BITS 27
+#define FT_MAX_SLOTS (1u << FT_SLOT_BITS)
+#define FT_SLOT_NONE UINT32_MAX
+
+// Stable handle to an entry. `offset` is rewritten when compaction moves the
+// entry; `generation` is bumped whenever the slot is released, so handles to
+// a removed entry never resolve to whatever reuses the slot. A released
+// slot keeps its offset until reused, for readers still following it.
+typedef struct {
+    uint32_t offset;
+    uint16_t generation;
+    uint16_t in_use;
+} FileSlot;
+
+// Directory records are appended to `data`; `offsets` maps a dir id to its
+// record and `buckets` is an open-addressing set of id + 1 (0 = empty).
+typedef struct {
+    char* data;
+    size_t used;
+    size_t capacity;
+    uint32_t* offsets;
+    uint32_t count;
+    uint32_t offsets_capacity;
+    uint32_t* buckets;
+    uint32_t bucket_count;
+} FileDirTable;
+
+// What the crawler already knew about an entry (from d_type) and what
+// its name suggests, so a match can be shown without touching the disk.
+typedef enum {
+    FT_TYPE_UNKNOWN,
+    FT_TYPE_FILE,
+    FT_TYPE_DIRECTORY,
+    FT_TYPE_SYMLINK
+} FileEntryType;
+
+typedef enum {
+    FT_MIME_UNKNOWN,
+    FT_MIME_TEXT,
+    FT_MIME_CODE,
+    FT_MIME_IMAGE,
+    FT_MIME_AUDIO,
+    FT_MIME_VIDEO,
+    FT_MIME_ARCHIVE,
+    FT_MIME_DOCUMENT
+} FileMimeClass;
+
+// size and mtime are valid
+#define FT_META_STAT 0x1
+
+// Sidecar record per slot. size and mtime are filled in by the first
+// ft_set_stat, not by the crawl, which never stats regular files.
+typedef struct {
+    uint64_t size;
+    uint32_t mtime;
+    uint8_t type;
+    uint8_t mime_class;
+    uint16_t flags;
+} FileMeta;
+
 #define CACHE_LINE_SIZE 64
 
+// Memory retired by writers that readers may still be scanning.
+typedef struct {
+    void** items;
+    size_t count;
+    size_t capacity;
+} FileRetired;
+
+struct FileTableView;
+
+// Entries are appended to `data` and never move until the table is compacted.
+// `index` holds their offsets sorted by path, so insert/remove/lookup binary
+// search it instead of walking the blob. Removed entries are tombstoned and
+// reclaimed by compaction once enough dead bytes have accumulated.
+// `masks` runs parallel to `slots` and holds each live entry's
+// character-presence mask (0 for free slots) for ft_iterate_filtered;
+// `meta` runs parallel to it too and holds each entry's FileMeta.
+//
+// Scans do not take the lock. Writers publish a FileTableView of the
+// arrays after every change and never modify what a published view can
+// reach, except for dead flags, masks and offsets of released slots;
+// arrays they would reallocate are copied and the old ones retired. The
+// retired memory is freed once no reader that pinned an earlier epoch is
+// left, which writers check without waiting.
 typedef struct {
     char* data;
     size_t capacity;
     size_t used;
     size_t count;
+    uint32_t* index;
+    size_t index_capacity;
+    size_t dead_bytes;
+    FileSlot* slots;
+    uint64_t* masks;
+    FileMeta* meta;
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+    // Released slots, reused last in first out
+    uint32_t* free_slots;
+    uint32_t free_count;
+    uint32_t free_capacity;
+    FileDirTable dirs;
+    uint64_t version;
+    uint8_t borrowed;
     atomic_flag lock;
-    char _pad[CACHE_LINE_SIZE - sizeof(char*) - sizeof(size_t) * 3 - sizeof(atomic_flag)];
-} FileTable;
+    _Atomic(struct FileTableView*) view;
+    _Atomic uint64_t epoch;
+    // Readers inside a scan, by the parity of the epoch they pinned
+    atomic_uint readers[2];
+    FileRetired retired[2];
+} __attribute__((aligned(CACHE_LINE_SIZE))) FileTable;
+
+#define FT_BORROWED_DATA  0x1
+#define FT_BORROWED_INDEX 0x2
+#define FT_BORROWED_SLOTS 0x4
+#define FT_BORROWED_MASKS 0x8
+#define FT_BORROWED_DIR_DATA 0x10
+#define FT_BORROWED_DIR_OFFSETS 0x20
+#define FT_BORROWED_DIR_BUCKETS 0x40
+#define FT_BORROWED_META 0x80
+
+// Flat copy of a table's arrays, as written to and mapped from a snapshot.
+typedef struct {
+    char* data;
+    size_t used;
+    size_t dead_bytes;
+    uint32_t* index;
+    size_t count;
+    FileSlot* slots;
+    uint64_t* masks;
+    FileMeta* meta;
+    uint32_t slot_count;
+    char* dir_data;
+    size_t dir_used;
+    uint32_t* dir_offsets;
+    uint32_t dir_count;
+    uint32_t* dir_buckets;
+    uint32_t dir_bucket_count;
+} FileTableImage;
+
+// What a scan may reject without calling back: entries whose mask lacks a
+// bit of `mask`, entries whose directory part does not contain
+// `dir_chars` (case-folded ASCII) as a subsequence, and entries whose path
+// does not contain `path_chars` as one. Each directory is tested once per
+// scan and remembers how much of `path_chars` it matched, so an entry
+// only costs a pass over its name.
+typedef struct {
+    uint64_t mask;
+    const char* dir_chars;
+    size_t dir_len;
+    const char* path_chars;
+    size_t path_len;
+} FileQuery;
 
-typedef void (*ft_iterator)(uint16_t i, const char* path, uint32_t hash, void* user_data);
+typedef void (*ft_iterator)(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* user_data);
+typedef void (*ft_path_iterator)(const char* path, void* user_data);
+typedef bool (*ft_predicate)(const FileEntry* entry, const char* path, void* user_data);
 
 FileTable* ft_create();
+FileTable* ft_create_from_image(const FileTableImage* image);
 void ft_destroy(FileTable* ft);
+bool ft_export(FileTable* ft, FileTableImage* image);
+void ft_image_free(FileTableImage* image);
 bool ft_insert(FileTable* ft, const char* path);
+// Inserts path carrying over metadata from another table.
+bool ft_insert_meta(FileTable* ft, const char* path, const FileMeta* meta);
+// Inserts paths, sorted as strcmp orders them, in a single merge under one
+// lock acquisition. `types` holds a FileEntryType per path and may be
+// NULL. Returns how many of them are indexed afterwards.
+size_t ft_insert_batch(FileTable* ft, const char* const* paths, const uint8_t* types, size_t n);
 bool ft_remove(FileTable* ft, const char* path);
-const char* ft_lookup_by_index(FileTable* ft, uint16_t index);
+size_t ft_remove_batch(FileTable* ft, const char* const* paths, size_t n);
+size_t ft_remove_prefix(FileTable* ft, const char* prefix);
+bool ft_contains(FileTable* ft, const char* path);
+bool ft_has_prefix(FileTable* ft, const char* prefix, bool direct_child);
+size_t ft_remove_if(FileTable* ft, ft_predicate predicate, void* user_data);
+size_t ft_size(FileTable* ft);
+uint64_t ft_version(FileTable* ft);
+// Copies the entry's metadata to `meta` as well, unless it is NULL.
+char* ft_lookup_by_slot(FileTable* ft, uint32_t slot, uint16_t generation, FileMeta* meta);
+// Caches stat results for the entry; ignored if the handle is stale.
+void ft_set_stat(FileTable* ft, uint32_t slot, uint16_t generation, uint64_t size, uint32_t mtime);
+void ft_iterate_children(FileTable* ft, const char* dir_prefix, ft_path_iterator callback, void* user_data);
+void ft_iterate_prefix(FileTable* ft, const char* prefix, ft_path_iterator callback, void* user_data);
 void ft_iterate(FileTable* ft, ft_iterator callback, void* user_data);
+uint64_t ft_iterate_filtered(FileTable* ft, const FileQuery* query, ft_iterator callback, void* user_data);
+bool ft_iterate_slots(FileTable* ft, uint64_t version, const uint32_t* slots, size_t count,
+                      const FileQuery* query, ft_iterator callback, void* user_data);
 
 #endif // FILE_HASHTABLE_H
@@ -0,0 +1,159 @@
+#include "file-prefilter.h"
+#include <stdatomic.h>
+#include <immintrin.h>
+
+static inline int char_bit(uint32_t c) {
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + (c - '0');
+
+    switch (c) {
+        case '.': return 36;
+        case '_': return 37;
+        case '-': return 38;
+        case ' ':
+        case '/': return -1;
+    }
+
+    // Remaining ASCII shares 16 bits; a collision only weakens the filter
+    if (c < 0x80) return 40 + (c & 15);
+    return -1;
+}
+
+uint64_t fp_path_mask(const char* path) {
+    uint64_t mask = 0;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        int bit = char_bit(*p);
+        if (bit >= 0) mask |= 1ULL << bit;
+    }
+    return mask;
+}
+
+uint64_t fp_needle_mask(const uint32_t* chars, int len) {
+    if (!chars) return 0;
+
+    uint64_t mask = 0;
+    for (int i = 0; i < len; i++) {
+        int bit = char_bit(chars[i]);
+        if (bit >= 0) mask |= 1ULL << bit;
+    }
+    return mask;
+}
+
+static size_t fold_chars(const uint32_t* chars, int len, char* out, size_t out_size) {
+    size_t n = 0;
+    for (int i = 0; i < len && n < out_size; i++) {
+        uint32_t c = chars[i];
+        if (c >= 0x80 || c == ' ') continue;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        out[n++] = (char)c;
+    }
+    return n;
+}
+
+size_t fp_leading_components(const uint32_t* chars, int len, char* out, size_t out_size) {
+    if (!chars) return 0;
+
+    int last_slash = -1;
+    for (int i = 0; i < len; i++) {
+        if (chars[i] == '/') last_slash = i;
+    }
+    return fold_chars(chars, last_slash + 1, out, out_size);
+}
+
+size_t fp_ordered_chars(const uint32_t* chars, int len, char* out, size_t out_size) {
+    if (!chars) return 0;
+    return fold_chars(chars, len, out, out_size);
+}
+
+size_t fp_subsequence_prefix(const char* haystack, size_t haystack_len, const char* folded, size_t folded_len) {
+    size_t j = 0;
+    for (size_t i = 0; i < haystack_len && haystack[i] && j < folded_len; i++) {
+        char c = haystack[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        j += c == folded[j];
+    }
+    return j;
+}
+
+bool fp_contains_subsequence(const char* haystack, size_t haystack_len, const char* folded, size_t folded_len) {
+    return fp_subsequence_prefix(haystack, haystack_len, folded, folded_len) == folded_len;
+}
+
+static size_t scan_scalar(const uint64_t* masks, size_t n, uint64_t needle, uint32_t* out) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++) {
+        out[found] = (uint32_t)i;
+        found += (masks[i] & needle) == needle;
+    }
+    return found;
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const uint64_t* masks, size_t n, uint64_t needle, uint32_t* out) {
+    __m128i wanted = _mm_set1_epi64x((long long)needle);
+    size_t found = 0;
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(masks + i));
+        __m128i hit = _mm_cmpeq_epi64(_mm_and_si128(m, wanted), wanted);
+        int bits = _mm_movemask_pd(_mm_castsi128_pd(hit));
+        while (bits) {
+            out[found++] = (uint32_t)(i + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+
+    for (; i < n; i++) {
+        out[found] = (uint32_t)i;
+        found += (masks[i] & needle) == needle;
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint64_t* masks, size_t n, uint64_t needle, uint32_t* out) {
+    __m256i wanted = _mm256_set1_epi64x((long long)needle);
+    size_t found = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(masks + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(masks + i + 4));
+        __m256i hit_lo = _mm256_cmpeq_epi64(_mm256_and_si256(lo, wanted), wanted);
+        __m256i hit_hi = _mm256_cmpeq_epi64(_mm256_and_si256(hi, wanted), wanted);
+        int bits = _mm256_movemask_pd(_mm256_castsi256_pd(hit_lo)) |
+                   (_mm256_movemask_pd(_mm256_castsi256_pd(hit_hi)) << 4);
+        while (bits) {
+            out[found++] = (uint32_t)(i + __builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+
+    for (; i < n; i++) {
+        out[found] = (uint32_t)i;
+        found += (masks[i] & needle) == needle;
+    }
+    return found;
+}
+
+typedef size_t (*scan_func)(const uint64_t*, size_t, uint64_t, uint32_t*);
+
+static scan_func resolve_scan(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return scan_sse42;
+    return scan_scalar;
+}
+
+size_t fp_scan(const uint64_t* masks, size_t n, uint64_t needle, uint32_t* out) {
+    static _Atomic(scan_func) impl = NULL;
+
+    scan_func scan = atomic_load_explicit(&impl, memory_order_relaxed);
+    if (!scan) {
+        scan = resolve_scan();
+        atomic_store_explicit(&impl, scan, memory_order_relaxed);
+    }
+    return scan(masks, n, needle, out);
+}
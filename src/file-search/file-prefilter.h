@@ -0,0 +1,40 @@
+#ifndef FILE_PREFILTER_H
+#define FILE_PREFILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// 64-bit character-presence masks. A path can only match a needle if its
+// mask contains every bit of the needle's mask, so most of a shard can be
+// rejected by comparing masks before the scorer ever sees the path.
+//
+// Letters are case folded and characters whose matching is not a plain
+// byte comparison (non-ASCII, space, '/') set no bit, so the filter never
+// rejects a path the scorer would accept.
+
+uint64_t fp_path_mask(const char* path);
+uint64_t fp_needle_mask(const uint32_t* chars, int len);
+
+// Folds the needle up to and including its last '/' into out, keeping
+// ASCII only, lowercased and without spaces. Every match has to contain
+// the result within its directory part. Returns its length, or 0 when the
+// needle has no '/'; a result cut short at out_size is still a valid test.
+size_t fp_leading_components(const uint32_t* chars, int len, char* out, size_t out_size);
+bool fp_contains_subsequence(const char* haystack, size_t haystack_len, const char* folded, size_t folded_len);
+
+// Folds the whole needle into out the same way. Every match contains the
+// result as a subsequence, so matching can be resumed where a shared
+// directory part left off.
+size_t fp_ordered_chars(const uint32_t* chars, int len, char* out, size_t out_size);
+
+// Returns how many leading characters of folded the haystack contains in
+// order, matching each as early as possible. Stops at haystack_len or a
+// '\0', whichever comes first.
+size_t fp_subsequence_prefix(const char* haystack, size_t haystack_len, const char* folded, size_t folded_len);
+
+// Writes the indices i < n with (masks[i] & needle) == needle to out and
+// returns their count. Dispatches to AVX2, SSE4.2 or scalar code at runtime.
+size_t fp_scan(const uint64_t* masks, size_t n, uint64_t needle, uint32_t* out);
+
+#endif // FILE_PREFILTER_H
@@ -18,30 +18,105 @@ namespace BobLauncher {
         }
     }
 
-    private class DirectoryWork {
-        public string path;
-        public DirectoryConfig config;
-        public int depth;
-        public GenericArray<string> gitignore_patterns;
-
-        public DirectoryWork(
-            string path,
-            DirectoryConfig config,
-            int depth,
-            GenericArray<string> gitignore_patterns
-        ) {
-            this.path = path;
-            this.config = config;
-            this.depth = depth;
-            this.gitignore_patterns = gitignore_patterns;
+    // What the index hands out. Actions open a file through IFile, so
+    // resolving it there is what counts as a launch for frecency ranking,
+    // once per match since action ranking resolves it too.
+    // Type, MIME class and mtime come from the index's metadata sidecar, so
+    // building and drawing a row does not have to query the file.
+    public class IndexedFileMatch : FileMatch, IFile {
+        private FileTreeManager.EntryType file_type;
+        private FileTreeManager.MimeClass mime_class;
+        private bool recorded;
+
+        public IndexedFileMatch(string path,
+                                FileTreeManager.EntryType file_type = FileTreeManager.EntryType.UNKNOWN,
+                                FileTreeManager.MimeClass mime_class = FileTreeManager.MimeClass.UNKNOWN,
+                                int64 mtime = 0) {
+            Object(filename: path);
+            this.file_type = file_type;
+            this.mime_class = mime_class;
+            if (mtime > 0) {
+                timestamp = new DateTime.from_unix_local(mtime);
+            }
+        }
+
+        public override string get_icon_name() {
+            if (is_directory()) {
+                return "folder";
+            }
+
+            switch (mime_class) {
+                case FileTreeManager.MimeClass.TEXT:
+                    return "text-x-generic";
+                case FileTreeManager.MimeClass.CODE:
+                    return "text-x-script";
+                case FileTreeManager.MimeClass.IMAGE:
+                    return "image-x-generic";
+                case FileTreeManager.MimeClass.AUDIO:
+                    return "audio-x-generic";
+                case FileTreeManager.MimeClass.VIDEO:
+                    return "video-x-generic";
+                case FileTreeManager.MimeClass.ARCHIVE:
+                    return "package-x-generic";
+                case FileTreeManager.MimeClass.DOCUMENT:
+                    return "x-office-document";
+                default:
+                    return ContentType.get_generic_icon_name(get_mime_type()) ?? "text-x-generic";
+            }
+        }
+
+        public new File get_file() {
+            if (!recorded) {
+                recorded = true;
+                FileFrecency.record_path(filename);
+            }
+            return File.new_for_path(filename);
+        }
+
+        public new string get_file_path() {
+            return filename;
+        }
+
+        public new string get_uri() {
+            return File.new_for_path(filename).get_uri();
+        }
+
+        // Guessed from the name alone; the file is only read once it is
+        // opened
+        public new string get_mime_type() {
+            if (is_directory()) {
+                return "inode/directory";
+            }
+            return ContentType.get_mime_type(ContentType.guess(filename, null, null)) ?? "application/octet-stream";
+        }
+
+        public new bool is_directory() {
+            if (file_type != FileTreeManager.EntryType.UNKNOWN && file_type != FileTreeManager.EntryType.SYMLINK) {
+                return file_type == FileTreeManager.EntryType.DIRECTORY;
+            }
+            return FileUtils.test(filename, FileTest.IS_DIR);
         }
     }
 
     public class FileSearchPlugin : SearchBase {
         private static HashTable<string, DirectoryConfig>? directory_configs;
-        private HashTable<string,bool> ignored_suffixes;
         private INotify.Monitor? monitor;
+        private FileEvents.Queue? events;
+        // Replaces the per-directory inotify watches when available
+        private FileFanotify.Watcher? fanotify;
+        private bool use_fanotify;
+        // 0 lets the index size and resize itself
+        private int configured_shards;
         private int cancelled;
+        // Crawl tasks queued or running; a snapshot is only taken at zero so
+        // it never records a directory whose children were not all added.
+        private int pending_work;
+        private uint snapshot_timeout_id;
+        private uint64 snapshot_version;
+
+        private const uint SNAPSHOT_INTERVAL_SECONDS = 300;
+        // How long change events are collected before they reach the index
+        private const uint EVENT_WINDOW_MS = 100;
 
         const string[] suffixes = {
             ".git",
@@ -52,18 +127,6 @@ namespace BobLauncher {
 
         construct {
             icon_name = "system-file-manager";
-            ignored_suffixes = new HashTable<string,bool>(str_hash, str_equal);
-            foreach (var suffix in suffixes) {
-                ignored_suffixes.set(suffix, true);
-            }
-        }
-
-        private bool should_ignore_file(string path) {
-            long last_dot = path.last_index_of(".");
-            if (last_dot == -1) return false;
-
-            string extension = path.substring(last_dot);
-            return ignored_suffixes.contains(extension);
         }
 
         private static int compare_dirs(DirectoryConfig? a, DirectoryConfig? b) {
@@ -76,198 +139,273 @@ namespace BobLauncher {
             return configs;
         }
 
-        public override bool activate() {
-            const int num_shards = 128;
-            // TODO: make configurable and dynamic.
+        // The index doubles its shard count as the corpus grows, so always
+        // report the live value rather than the one chosen at activation.
+        public override uint shard_count {
+            get { return FileTreeManager.get_shard_count(); }
+            set { }
+        }
 
-            base.shard_count = num_shards;
-            FileTreeManager.initialize(num_shards);
+        public override bool activate() {
+            FileTreeManager.initialize(configured_shards);
 
             Threading.atomic_store(ref cancelled, 0);
 
             monitor = new INotify.Monitor(on_file_changed);
-
-            var configs = get_directory_configs_sorted();
-            foreach (unowned var cfg in configs) {
-                queue_addition(
-                    cfg.path,
-                    cfg,
-                    0,
-                    new GenericArray<string>()
-                );
+            events = new FileEvents.Queue(EVENT_WINDOW_MS, on_paths_added, on_directory_entered);
+            FileFrecency.load(get_frecency_path());
+            if (use_fanotify) fanotify = start_fanotify();
+
+            if (FileTreeManager.load_snapshot(get_snapshot_path(), get_config_fingerprint())) {
+                snapshot_version = FileTreeManager.get_version();
+                Threading.atomic_inc(ref pending_work);
+                Threading.run(reconcile_snapshot);
+            } else {
+                var crawler = new_crawler();
+                foreach (unowned var cfg in get_directory_configs_sorted()) {
+                    crawler.add_root(cfg.path, 0, cfg.max_depth, cfg.show_hidden, cfg.respect_gitignore, null);
+                }
+                crawl((owned)crawler);
             }
 
+            snapshot_timeout_id = Timeout.add_seconds(SNAPSHOT_INTERVAL_SECONDS, () => {
+                if (FileTreeManager.get_version() != snapshot_version) {
+                    uint32 fingerprint = get_config_fingerprint();
+                    Threading.run(() => save_snapshot(fingerprint));
+                }
+                if (FileFrecency.is_dirty()) save_frecency();
+                return Source.CONTINUE;
+            });
+
             return true;
         }
 
-        private void on_file_changed(string path, int event_type) {
-            if (Threading.atomic_load(ref cancelled) == 1) return;
-
-            bool is_deleted =
-                ((event_type & INotify.EventType.DELETE) != 0 ||
-                 (event_type & INotify.EventType.DELETE_SELF) != 0 ||
-                 (event_type & INotify.EventType.MOVED_FROM) != 0)
-                    ? true
-                    : false;
+        private static string get_snapshot_path() {
+            return Path.build_filename(
+                Environment.get_user_cache_dir(),
+                BOB_LAUNCHER_APP_ID,
+                "file-search.snapshot"
+            );
+        }
 
-            if (is_deleted) {
-                FileTreeManager.remove_file(path);
-            } else {
-                DirectoryConfig? config = find_best_dc(path);
-                if (config == null) return;
+        // Launch history outlives the index, so it is kept with user data
+        private static string get_frecency_path() {
+            return Path.build_filename(
+                Environment.get_user_data_dir(),
+                BOB_LAUNCHER_APP_ID,
+                "file-search.frecency"
+            );
+        }
 
-                int depth = 0;
-                string rel_path = path.substring(config.path.length);
+        private static void save_frecency() {
+            string path = get_frecency_path();
+            DirUtils.create_with_parents(Path.get_dirname(path), 0700);
+            FileFrecency.save(path);
+        }
 
-                for (int i = 0; i < rel_path.length; i++) {
-                    if (rel_path[i] == '/') depth++;
-                }
-                var work = new DirectoryWork(path, config, depth, new GenericArray<string>());
-                handle_file_add_or_change(work);
+        // Identifies the directory configuration a snapshot was built from;
+        // a snapshot taken under different settings is discarded.
+        private uint32 get_config_fingerprint() {
+            var builder = new StringBuilder();
+            foreach (unowned var cfg in get_directory_configs_sorted()) {
+                builder.append_printf("%s\x1f%u\x1f%d\x1f%d\x1e",
+                    cfg.path, cfg.max_depth, (int)cfg.show_hidden, (int)cfg.respect_gitignore);
             }
+            return str_hash(builder.str);
         }
 
-        private DirectoryConfig? find_best_dc(string path) {
-            DirectoryConfig? config = directory_configs.get(path); // exact match;
-            if (config != null) return config;
+        private void save_snapshot(uint32 fingerprint) {
+            if (Threading.atomic_load(ref pending_work) != 0) return;
 
-            var configs = get_directory_configs_sorted();
-            foreach (unowned var cfg in configs) {
-                if (path.has_prefix(cfg.path)) {
-                    return cfg;
-                }
+            uint64 version = FileTreeManager.get_version();
+            string path = get_snapshot_path();
+            DirUtils.create_with_parents(Path.get_dirname(path), 0700);
+            if (FileTreeManager.save_snapshot(path, fingerprint)) {
+                snapshot_version = version;
             }
-            return null;
         }
 
-        private GenericArray<string> load_gitignore_patterns(File gitignore_file) {
-            GenericArray<string> patterns = new GenericArray<string>();
-
-            try {
-                DataInputStream input_stream = new DataInputStream(gitignore_file.read());
-                string line;
-                while ((line = input_stream.read_line()) != null) {
-                    line = line.strip();
-                    if (line.length > 0 && !line.has_prefix("#")) {
-                        while (line.has_suffix("/") && line.length > 1) {
-                            line = line.substring(0, line.length - 1);
-                        }
-                        patterns.add(line);
-                    }
+        // Brings a loaded snapshot up to date. Adding or removing a name
+        // changes its directory's mtime, so only directories whose mtime
+        // moved are listed again; everything else just gets its watch back.
+        private void reconcile_snapshot() {
+            var crawler = new_crawler();
+            string[] directories = FileTreeManager.get_directories();
+            foreach (unowned string dir in directories) {
+                if (Threading.atomic_load(ref cancelled) == 1) break;
+
+                switch (FileTreeManager.check_directory(dir)) {
+                    case FileTreeManager.DirectoryState.GONE:
+                        FileTreeManager.remove_subtree(dir);
+                        break;
+                    case FileTreeManager.DirectoryState.CHANGED:
+                        if (fanotify == null) monitor.add_path(dir);
+                        rescan_directory(dir, crawler);
+                        break;
+                    default:
+                        if (fanotify == null) monitor.add_path(dir);
+                        break;
                 }
-            } catch (Error e) {
-                warning("Error while loading .gitignore patterns: %s", e.message);
             }
-
-            debug("loading gitignore for %s, %s", gitignore_file.get_path(), print_string_list(patterns));
-            return patterns;
+            crawler.run(0, ref cancelled);
+            Threading.atomic_dec(ref pending_work);
         }
 
-        public static string print_string_list(GenericArray<string> list) {
-            var builder = new StringBuilder ("[");
-            bool first = true;
-            foreach (var item in list) {
-                if (!first) {
-                    builder.append (", ");
-                }
-                builder.append ("\"");
-                builder.append ((string)item);
-                builder.append ("\"");
-                first = false;
+        // Removes what vanished from dir and queues its new children on
+        // crawler.
+        private void rescan_directory(string dir, FileCrawler.Crawler crawler) {
+            DirectoryConfig? config = find_best_dc(dir);
+            if (config == null) return;
+
+            int depth = get_depth(dir, config);
+            var on_disk = new GenericSet<string>(str_hash, str_equal);
+
+            Dir handle;
+            try {
+                handle = Dir.open(dir);
+            } catch (FileError e) {
+                warning("Error enumerating directory: %s", e.message);
+                return;
             }
-            builder.append ("]");
-            return builder.str;
-        }
 
-        private bool is_name_ignored(string name, GenericArray<string> patterns) {
-            foreach (string pattern in patterns) {
-                if (pattern.has_prefix("/")) {
-                    pattern = pattern.substring(1);
+            string? name;
+            while ((name = handle.read_name()) != null) {
+                var child_path = Path.build_filename(dir, name);
+                on_disk.add(child_path);
+
+                // The crawler skips what the configuration excludes
+                if (!FileTreeManager.contains(child_path)) {
+                    crawler.add_root(child_path, depth + 1, config.max_depth,
+                        config.show_hidden, config.respect_gitignore, config.path);
                 }
+            }
 
-                if (name == pattern || GLib.PatternSpec.match_simple(pattern, name)) {
-                    return true;
+            foreach (unowned string child in FileTreeManager.list_children(dir)) {
+                if (!on_disk.contains(child)) {
+                    FileTreeManager.remove_subtree(child);
                 }
             }
-            return false;
         }
 
-        public override void deactivate() {
-            Threading.atomic_store(ref cancelled, 1);
-            directory_configs = new HashTable<string, DirectoryConfig>(str_hash, str_equal);
-            monitor = null;
+        private static int get_depth(string path, DirectoryConfig config) {
+            int depth = 0;
+            string rel_path = path.substring(config.path.length);
+
+            for (int i = 0; i < rel_path.length; i++) {
+                if (rel_path[i] == '/') depth++;
+            }
+            return depth;
         }
 
-        private void queue_addition(
-            string path,
-            DirectoryConfig config,
-            int depth,
-            GenericArray<string>? gitignore_patterns
-        ) {
+        private void on_file_changed(string path, int event_type) {
             if (Threading.atomic_load(ref cancelled) == 1) return;
-            Threading.run(() => {
-                var work = new DirectoryWork(path, config, depth, gitignore_patterns);
-                handle_file_add_or_change(work);
-            });
-        }
 
-        private void handle_file_add_or_change(DirectoryWork work) {
-            if (should_ignore_file(work.path)) {
-                return;
+            FileEvents.Kind kind;
+            if ((event_type & INotify.EventType.MOVED_FROM) != 0) {
+                kind = FileEvents.Kind.MOVED_FROM;
+            } else if ((event_type & INotify.EventType.MOVED_TO) != 0) {
+                kind = FileEvents.Kind.MOVED_TO;
+            } else if ((event_type & INotify.EventType.DELETE) != 0 ||
+                       (event_type & INotify.EventType.DELETE_SELF) != 0) {
+                kind = FileEvents.Kind.DELETED;
+            } else if ((event_type & INotify.EventType.CREATE) != 0) {
+                kind = FileEvents.Kind.CREATED;
+            } else {
+                kind = FileEvents.Kind.CHANGED;
             }
+            events.push(path, kind);
+        }
 
-            FileTreeManager.add_file(work.path);
+        // Runs on the event queue's thread with what is left of a window
+        // once removals and renames are applied.
+        private void on_paths_added(string[] paths) {
+            if (Threading.atomic_load(ref cancelled) == 1) return;
 
-            if (work.depth >= work.config.max_depth) {
-                return;
+            var crawler = new_crawler();
+            foreach (unowned string path in paths) {
+                DirectoryConfig? config = find_best_dc(path);
+                if (config == null) continue;
+                crawler.add_root(path, get_depth(path, config), config.max_depth,
+                    config.show_hidden, config.respect_gitignore, config.path);
             }
 
-            if (!FileUtils.test(work.path, FileTest.IS_DIR)) {
-                return;
-            }
+            Threading.atomic_inc(ref pending_work);
+            crawler.run(0, ref cancelled);
+            Threading.atomic_dec(ref pending_work);
+        }
 
-            monitor.add_path(work.path);
+        private DirectoryConfig? find_best_dc(string path) {
+            DirectoryConfig? config = directory_configs.get(path); // exact match;
+            if (config != null) return config;
 
-            var gitignore_patterns = work.gitignore_patterns.copy((item) => item);
-            if (work.config.respect_gitignore) {
-                var gitignore_path = Path.build_filename(work.path, ".gitignore");
-                if (FileUtils.test(gitignore_path, FileTest.EXISTS)) {
-                    var current_patterns = load_gitignore_patterns(File.new_for_path(gitignore_path));
-                    gitignore_patterns.extend(current_patterns, (item) => item.strip());
+            var configs = get_directory_configs_sorted();
+            foreach (unowned var cfg in configs) {
+                if (path.has_prefix(cfg.path)) {
+                    return cfg;
                 }
             }
+            return null;
+        }
 
-            Dir dir;
-
-            try {
-                dir = Dir.open(work.path);
-            } catch (FileError e) {
-                warning("Error enumerating directory: %s", e.message);
-                return;
+        public override void deactivate() {
+            Threading.atomic_store(ref cancelled, 1);
+            fanotify = null;
+            // Joins the queue's thread, which stops early once cancelled
+            events = null;
+            if (snapshot_timeout_id != 0) {
+                Source.remove(snapshot_timeout_id);
+                snapshot_timeout_id = 0;
+            }
+            // Crawls stop at their next directory once cancelled. Waiting
+            // for them keeps a restart from indexing paths of the old
+            // configuration, and an interrupted crawl is never snapshotted.
+            bool interrupted = Threading.atomic_load(ref pending_work) != 0;
+            while (Threading.atomic_load(ref pending_work) != 0) {
+                Thread.usleep(1000);
+            }
+            if (!interrupted && FileTreeManager.get_shard_count() > 0 &&
+                FileTreeManager.get_version() != snapshot_version) {
+                save_snapshot(get_config_fingerprint());
             }
+            if (FileFrecency.is_dirty()) save_frecency();
+            directory_configs = new HashTable<string, DirectoryConfig>(str_hash, str_equal);
+            monitor = null;
+        }
 
-            string? name;
-            while ((name = dir.read_name()) != null) {
-                if (!work.config.show_hidden && name.has_prefix(".")) {
-                    continue;
-                }
+        private FileCrawler.Crawler new_crawler() {
+            var crawler = new FileCrawler.Crawler(on_directory_entered);
+            foreach (unowned string suffix in suffixes) {
+                crawler.ignore_suffix(suffix);
+            }
+            foreach (unowned string path in directory_configs.get_keys()) {
+                crawler.exclude(path);
+            }
+            return crawler;
+        }
 
-                if (is_name_ignored(name, gitignore_patterns)) {
-                    continue;
-                }
+        private FileFanotify.Watcher? start_fanotify() {
+            var watcher = FileFanotify.Watcher.create(events);
+            if (watcher == null) return null;
 
-                var child_path = Path.build_filename(work.path, name);
+            foreach (unowned string path in directory_configs.get_keys()) {
+                if (!watcher.add_root(path)) return null;
+            }
+            return watcher.start() ? (owned)watcher : null;
+        }
 
-                if (directory_configs.contains(child_path)) {
-                    debug("already have: %s, not recursing for: %s", child_path, work.config.path);
-                    continue;
-                }
+        // Runs on the crawler's worker threads.
+        private void on_directory_entered(string path) {
+            if (Threading.atomic_load(ref cancelled) == 1) return;
+            if (fanotify == null) monitor.add_path(path);
+        }
 
-                Idle.add(() => {
-                    queue_addition(child_path, work.config, work.depth + 1, gitignore_patterns);
-                    return false;
-                }, GLib.Priority.LOW);
-            }
+        private void crawl(owned FileCrawler.Crawler crawler) {
+            if (Threading.atomic_load(ref cancelled) == 1) return;
+            Threading.atomic_inc(ref pending_work);
+            Threading.run(() => {
+                crawler.run(0, ref cancelled);
+                Threading.atomic_dec(ref pending_work);
+            });
         }
 
         protected override void search_shard(ResultContainer rs, uint shard_id) {
@@ -275,6 +413,20 @@ namespace BobLauncher {
         }
 
         public override void on_setting_changed(string key, GLib.Variant value) {
+            if (key == "shard-policy") {
+                set_shard_policy(value.get_string());
+                return;
+            }
+            if (key == "shard-count") {
+                configured_shards = value.get_int32();
+                restart();
+                return;
+            }
+            if (key == "watch-backend") {
+                use_fanotify = value.get_string() == "fanotify";
+                restart();
+                return;
+            }
             if (key != "directory-configs") return;
             if (directory_configs == null) {
                 initialize_dir_config(value);
@@ -285,6 +437,28 @@ namespace BobLauncher {
             }
         }
 
+        // The policy decides how the index is laid out, so a running index
+        // is rebuilt under the new one.
+        private void set_shard_policy(string policy) {
+            switch (policy) {
+                case "directory":
+                    FileTreeManager.set_shard_policy(FileTreeManager.ShardPolicy.BY_DIRECTORY);
+                    break;
+                default:
+                    FileTreeManager.set_shard_policy(FileTreeManager.ShardPolicy.BY_HASH);
+                    break;
+            }
+            restart();
+        }
+
+        private void restart() {
+            if (monitor == null) return;
+            var configs = directory_configs;
+            deactivate();
+            directory_configs = configs;
+            activate();
+        }
+
         private void initialize_dir_config(GLib.Variant value) {
             directory_configs = new HashTable<string, DirectoryConfig>(str_hash, str_equal);
 
@@ -0,0 +1,319 @@
+#include "file-snapshot.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "BOBFSIDX"
+#define SECTION_ALIGN 64
+#define DIRECTORY_ALIGN 8
+
+// Layout: header, shard table, then per shard the blob, the sorted index,
+// the slot table, the slot mask lane and the interned directory table, each
+// 64-byte aligned, followed by the list of crawled directories.
+// All sections are stored exactly as FileTable keeps them in memory, so a
+// mapped snapshot is used in place.
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t config_hash;
+    uint32_t shard_count;
+    uint32_t entry_header_size;
+    uint64_t file_size;
+    uint64_t shards_offset;
+    uint64_t directories_offset;
+    uint64_t directory_count;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t data_offset;
+    uint64_t used;
+    uint64_t dead_bytes;
+    uint64_t index_offset;
+    uint64_t count;
+    uint64_t slots_offset;
+    uint64_t masks_offset;
+    uint64_t meta_offset;
+    uint32_t slot_count;
+    uint64_t dir_data_offset;
+    uint64_t dir_used;
+    uint64_t dir_offsets_offset;
+    uint64_t dir_buckets_offset;
+    uint32_t dir_count;
+    uint32_t dir_bucket_count;
+} SnapshotShard;
+
+typedef struct {
+    int64_t mtime;
+    uint32_t length;
+    uint32_t _reserved;
+    char path[];
+} SnapshotDirectory;
+
+struct FileSnapshot {
+    char* base;
+    size_t size;
+    SnapshotHeader* header;
+    SnapshotShard* shards;
+};
+
+static bool write_aligned(FILE* f, const void* buf, size_t len, size_t align, uint64_t* offset) {
+    static const char zeros[SECTION_ALIGN] = { 0 };
+
+    if (len > 0 && fwrite(buf, 1, len, f) != len) return false;
+    *offset += len;
+
+    size_t pad = (align - (*offset % align)) % align;
+    if (pad > 0 && fwrite(zeros, 1, pad, f) != pad) return false;
+    *offset += pad;
+    return true;
+}
+
+static bool write_directories(FILE* f, GHashTable* directories, SnapshotHeader* header, uint64_t* offset) {
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, directories);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char* path = key;
+        SnapshotDirectory dir = {
+            .mtime = (int64_t)(intptr_t)value,
+            .length = (uint32_t)strlen(path),
+        };
+
+        if (!write_aligned(f, &dir, sizeof(dir), 1, offset) ||
+            !write_aligned(f, path, dir.length + 1, DIRECTORY_ALIGN, offset)) {
+            return false;
+        }
+        header->directory_count++;
+    }
+    return true;
+}
+
+// Writes to a temporary file and renames it into place, so a crash never
+// leaves a torn snapshot behind.
+bool fs_write(const char* path, uint32_t config_hash,
+              FileTable** shards, unsigned int shard_count,
+              GHashTable* directories) {
+    if (!path || !shards || shard_count == 0) return false;
+
+    char* tmp_path = g_strconcat(path, ".tmp", NULL);
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) {
+        g_free(tmp_path);
+        return false;
+    }
+
+    SnapshotHeader header = { 0 };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = FILE_SNAPSHOT_VERSION;
+    header.config_hash = config_hash;
+    header.shard_count = shard_count;
+    header.entry_header_size = sizeof(FileEntry);
+
+    SnapshotShard* table = calloc(shard_count, sizeof(SnapshotShard));
+    uint64_t offset = 0;
+
+    bool ok = table != NULL && write_aligned(f, &header, sizeof(header), SECTION_ALIGN, &offset);
+    header.shards_offset = offset;
+    ok = ok && write_aligned(f, table, shard_count * sizeof(SnapshotShard), SECTION_ALIGN, &offset);
+
+    for (unsigned int i = 0; ok && i < shard_count; i++) {
+        FileTableImage image;
+        if (!ft_export(shards[i], &image)) {
+            ok = false;
+            break;
+        }
+
+        table[i].used = image.used;
+        table[i].dead_bytes = image.dead_bytes;
+        table[i].count = image.count;
+        table[i].slot_count = image.slot_count;
+        table[i].dir_used = image.dir_used;
+        table[i].dir_count = image.dir_count;
+        table[i].dir_bucket_count = image.dir_bucket_count;
+
+        table[i].data_offset = offset;
+        ok = write_aligned(f, image.data, image.used, SECTION_ALIGN, &offset);
+        table[i].index_offset = offset;
+        ok = ok && write_aligned(f, image.index, image.count * sizeof(uint32_t), SECTION_ALIGN, &offset);
+        table[i].slots_offset = offset;
+        ok = ok && write_aligned(f, image.slots, image.slot_count * sizeof(FileSlot), SECTION_ALIGN, &offset);
+        table[i].masks_offset = offset;
+        ok = ok && write_aligned(f, image.masks, image.slot_count * sizeof(uint64_t), SECTION_ALIGN, &offset);
+        table[i].meta_offset = offset;
+        ok = ok && write_aligned(f, image.meta, image.slot_count * sizeof(FileMeta), SECTION_ALIGN, &offset);
+        table[i].dir_data_offset = offset;
+        ok = ok && write_aligned(f, image.dir_data, image.dir_used, SECTION_ALIGN, &offset);
+        table[i].dir_offsets_offset = offset;
+        ok = ok && write_aligned(f, image.dir_offsets, image.dir_count * sizeof(uint32_t), SECTION_ALIGN, &offset);
+        table[i].dir_buckets_offset = offset;
+        ok = ok && write_aligned(f, image.dir_buckets, image.dir_bucket_count * sizeof(uint32_t), SECTION_ALIGN, &offset);
+
+        ft_image_free(&image);
+    }
+
+    header.directories_offset = offset;
+    if (ok && directories) {
+        ok = write_directories(f, directories, &header, &offset);
+    }
+    header.file_size = offset;
+
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fseek(f, header.shards_offset, SEEK_SET) == 0 &&
+         fwrite(table, sizeof(SnapshotShard), shard_count, f) == shard_count;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+
+    if (!ok) {
+        unlink(tmp_path);
+        fprintf(stderr, "Failed to write file index snapshot %s\n", path);
+    }
+
+    free(table);
+    g_free(tmp_path);
+    return ok;
+}
+
+static inline bool range_ok(FileSnapshot* snapshot, uint64_t offset, uint64_t len) {
+    return offset <= snapshot->size && len <= snapshot->size - offset;
+}
+
+static bool validate(FileSnapshot* snapshot, uint32_t config_hash) {
+    SnapshotHeader* header = snapshot->header;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != FILE_SNAPSHOT_VERSION ||
+        header->entry_header_size != sizeof(FileEntry) ||
+        header->config_hash != config_hash ||
+        header->file_size != snapshot->size ||
+        header->shard_count == 0 ||
+        header->shards_offset % SECTION_ALIGN != 0 ||
+        !range_ok(snapshot, header->shards_offset, (uint64_t)header->shard_count * sizeof(SnapshotShard)) ||
+        !range_ok(snapshot, header->directories_offset, 0)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->shard_count; i++) {
+        SnapshotShard* shard = &snapshot->shards[i];
+        if (shard->data_offset % SECTION_ALIGN != 0 ||
+            shard->index_offset % SECTION_ALIGN != 0 ||
+            shard->slots_offset % SECTION_ALIGN != 0 ||
+            shard->masks_offset % SECTION_ALIGN != 0 ||
+            shard->meta_offset % SECTION_ALIGN != 0 ||
+            shard->dir_data_offset % SECTION_ALIGN != 0 ||
+            shard->dir_offsets_offset % SECTION_ALIGN != 0 ||
+            shard->dir_buckets_offset % SECTION_ALIGN != 0 ||
+            shard->dir_used > UINT32_MAX ||
+            (shard->dir_bucket_count & (shard->dir_bucket_count - 1)) != 0 ||
+            (uint64_t)shard->dir_count * 2 > shard->dir_bucket_count ||
+            shard->dead_bytes > shard->used ||
+            shard->used > UINT32_MAX ||
+            shard->count > shard->slot_count ||
+            shard->slot_count > FT_MAX_SLOTS ||
+            !range_ok(snapshot, shard->data_offset, shard->used) ||
+            !range_ok(snapshot, shard->index_offset, shard->count * sizeof(uint32_t)) ||
+            !range_ok(snapshot, shard->slots_offset, (uint64_t)shard->slot_count * sizeof(FileSlot)) ||
+            !range_ok(snapshot, shard->masks_offset, (uint64_t)shard->slot_count * sizeof(uint64_t)) ||
+            !range_ok(snapshot, shard->meta_offset, (uint64_t)shard->slot_count * sizeof(FileMeta)) ||
+            !range_ok(snapshot, shard->dir_data_offset, shard->dir_used) ||
+            !range_ok(snapshot, shard->dir_offsets_offset, (uint64_t)shard->dir_count * sizeof(uint32_t)) ||
+            !range_ok(snapshot, shard->dir_buckets_offset, (uint64_t)shard->dir_bucket_count * sizeof(uint32_t))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps the snapshot private and writable: tables built on it tombstone
+// entries in place, which only dirties copy-on-write pages.
+FileSnapshot* fs_map(const char* path, uint32_t config_hash) {
+    if (!path) return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    FileSnapshot* snapshot = malloc(sizeof(FileSnapshot));
+    if (!snapshot) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    snapshot->base = base;
+    snapshot->size = st.st_size;
+    snapshot->header = base;
+    snapshot->shards = (SnapshotShard*)(snapshot->base + snapshot->header->shards_offset);
+
+    if (!validate(snapshot, config_hash)) {
+        fs_unmap(snapshot);
+        return NULL;
+    }
+
+    return snapshot;
+}
+
+unsigned int fs_shard_count(FileSnapshot* snapshot) {
+    return snapshot ? snapshot->header->shard_count : 0;
+}
+
+bool fs_shard_image(FileSnapshot* snapshot, unsigned int shard, FileTableImage* image) {
+    if (!snapshot || !image || shard >= snapshot->header->shard_count) return false;
+
+    SnapshotShard* s = &snapshot->shards[shard];
+    image->data = snapshot->base + s->data_offset;
+    image->used = s->used;
+    image->dead_bytes = s->dead_bytes;
+    image->index = (uint32_t*)(snapshot->base + s->index_offset);
+    image->count = s->count;
+    image->slots = (FileSlot*)(snapshot->base + s->slots_offset);
+    image->masks = (uint64_t*)(snapshot->base + s->masks_offset);
+    image->meta = (FileMeta*)(snapshot->base + s->meta_offset);
+    image->dir_data = snapshot->base + s->dir_data_offset;
+    image->dir_used = s->dir_used;
+    image->dir_offsets = (uint32_t*)(snapshot->base + s->dir_offsets_offset);
+    image->dir_count = s->dir_count;
+    image->dir_buckets = (uint32_t*)(snapshot->base + s->dir_buckets_offset);
+    image->dir_bucket_count = s->dir_bucket_count;
+    image->slot_count = s->slot_count;
+    return true;
+}
+
+void fs_iterate_directories(FileSnapshot* snapshot, fs_directory_iterator callback, void* user_data) {
+    if (!snapshot || !callback) return;
+
+    uint64_t offset = snapshot->header->directories_offset;
+    for (uint64_t i = 0; i < snapshot->header->directory_count; i++) {
+        if (!range_ok(snapshot, offset, sizeof(SnapshotDirectory))) return;
+
+        SnapshotDirectory* dir = (SnapshotDirectory*)(snapshot->base + offset);
+        if (!range_ok(snapshot, offset + sizeof(SnapshotDirectory), (uint64_t)dir->length + 1) ||
+            dir->path[dir->length] != '\0') {
+            return;
+        }
+
+        callback(dir->path, dir->mtime, user_data);
+
+        offset += sizeof(SnapshotDirectory) + dir->length + 1;
+        offset = (offset + DIRECTORY_ALIGN - 1) & ~(uint64_t)(DIRECTORY_ALIGN - 1);
+    }
+}
+
+void fs_unmap(FileSnapshot* snapshot) {
+    if (!snapshot) return;
+    munmap(snapshot->base, snapshot->size);
+    free(snapshot);
+}
@@ -0,0 +1,25 @@
+#ifndef FILE_SNAPSHOT_H
+#define FILE_SNAPSHOT_H
+
+#include "file-hashtable.h"
+#include <glib.h>
+
+// Bump whenever FileEntry, FileDir, FileSlot, FileMeta, the path masks or the file
+// layout changes.
+#define FILE_SNAPSHOT_VERSION 5
+
+typedef struct FileSnapshot FileSnapshot;
+
+typedef void (*fs_directory_iterator)(const char* path, int64_t mtime, void* user_data);
+
+bool fs_write(const char* path, uint32_t config_hash,
+              FileTable** shards, unsigned int shard_count,
+              GHashTable* directories);
+
+FileSnapshot* fs_map(const char* path, uint32_t config_hash);
+unsigned int fs_shard_count(FileSnapshot* snapshot);
+bool fs_shard_image(FileSnapshot* snapshot, unsigned int shard, FileTableImage* image);
+void fs_iterate_directories(FileSnapshot* snapshot, fs_directory_iterator callback, void* user_data);
+void fs_unmap(FileSnapshot* snapshot);
+
+#endif // FILE_SNAPSHOT_H
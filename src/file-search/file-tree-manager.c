@@ -1,109 +1,1269 @@
 #include "file-tree-manager.h"
 #include "constants.h"
 #include "file-hashtable.h"
+#include "file-snapshot.h"
+#include "file-prefilter.h"
+#include "file-frecency.h"
 #include "match.h"
 #include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define CACHE_LINE_SIZE 64
 
+// The shard id is packed into 8 bits of the lazy match user data
+#define MAX_SHARDS 256
+// Entries a shard may hold before the shard count is doubled, small enough
+// that scanning one shard fits in a scheduler time slice
+#define TARGET_SHARD_SIZE 65536
+// Under FILE_TREE_SHARD_BY_DIRECTORY a full shard holding this many times
+// the average has groups moved off it instead of growing every shard
+#define IMBALANCE_RATIO 2
+// Path components that make up a directory group under
+// FILE_TREE_SHARD_BY_DIRECTORY
+#define GROUP_DEPTH 4
+// Bytes of the query's leading components tested against directories
+#define MAX_LEADING_COMPONENTS 256
+
 static FileTable** shards = NULL;
-static unsigned int num_shards = 0;
+static _Atomic unsigned int num_shards = 0;
+static atomic_size_t overflow_count = 0;
+// Matches each shard's last search scored but left out of its top results
+static atomic_size_t omitted_results[MAX_SHARDS];
+// Whether the shard count follows the corpus; off once a count is pinned
+static bool adaptive_shards = true;
+static unsigned int pinned_shards = 0;
+// Size a shard has to reach before it is balanced again, so one group too
+// large to move does not trigger a rebalance on every insert
+static size_t balance_floor[MAX_SHARDS];
+
+// Writers hold this shared; growing the shard count holds it exclusively so
+// no insert can be routed by the old modulus while entries are moving.
+static pthread_rwlock_t shards_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// The policy requested for the next initialize, and the one the current
+// shards were built with
+static _Atomic FileTreeShardPolicy requested_policy = FILE_TREE_SHARD_BY_HASH;
+static FileTreeShardPolicy shard_policy = FILE_TREE_SHARD_BY_HASH;
+
+// Under FILE_TREE_SHARD_BY_DIRECTORY every path is routed by its directory
+// group, the first GROUP_DEPTH components of its directory part, so whole
+// subtrees share a shard. Maps the group prefix to its shard index + 1.
+// Routes are not persisted; after loading a snapshot they are rediscovered
+// by probing the shards on first use.
+static GHashTable* routes = NULL;
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shards loaded from a snapshot borrow its mapping until they are destroyed
+static FileSnapshot* mapped_snapshot = NULL;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Directories the crawler descended into, with the mtime seen at the time.
+// Persisted with the snapshot so startup only rescans directories whose
+// mtime has moved since.
+static GHashTable* directories = NULL;
+static pthread_mutex_t directories_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slots that matched the last query run against a shard. A query that
+// extends it can only match a subset of them, so while the shard is
+// unchanged only these are rescored. `epoch` ties the cache to the shard
+// tables it was built from, since replaced tables restart their versions.
+typedef struct {
+    uint64_t epoch;
+    uint64_t version;
+    uint32_t* needle;
+    int needle_len;
+    uint32_t* slots;
+    size_t count;
+    size_t capacity;
+    bool failed;
+} SurvivorCache;
+
+static _Atomic(SurvivorCache*) survivor_caches[MAX_SHARDS];
+static _Atomic uint64_t shard_epoch = 0;
+
+// Length of path's directory group: its directory part, cut after the
+// GROUP_DEPTH-th component.
+static size_t group_length(const char* path) {
+    const char* last_slash = strrchr(path, '/');
+    if (!last_slash) return 0;
+
+    size_t dir_len = last_slash - path + 1;
+    unsigned int slashes = 0;
+    for (size_t i = 0; i < dir_len; i++) {
+        if (path[i] == '/' && ++slashes == GROUP_DEPTH + 1) return i + 1;
+    }
+    return dir_len;
+}
+
+static unsigned int least_loaded_shard(unsigned int count) {
+    unsigned int best = 0;
+    size_t best_size = SIZE_MAX;
+    for (unsigned int i = 0; i < count; i++) {
+        size_t size = ft_size(shards[i]);
+        if (size < best_size) {
+            best = i;
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+// Finds the shard holding the group of path. Unknown groups are looked for
+// in the shards first, since routes are lost across snapshot loads; a group
+// found nowhere goes to the emptiest shard when create is set. Returns -1
+// for an unknown group otherwise. Callers hold shards_lock.
+static int route_by_group(const char* path, bool create) {
+    size_t len = group_length(path);
+    char group[len + 1];
+    memcpy(group, path, len);
+    group[len] = '\0';
+
+    pthread_mutex_lock(&routes_lock);
+    int shard = routes ? (int)(intptr_t)g_hash_table_lookup(routes, group) - 1 : -1;
+    pthread_mutex_unlock(&routes_lock);
+    if (shard >= 0) return shard;
+
+    // Everything below a full-depth group belongs to it, but a shallower
+    // group shares its prefix with deeper ones, so only entries directly
+    // inside it identify its shard
+    unsigned int slashes = 0;
+    for (size_t i = 0; i < len; i++) {
+        slashes += group[i] == '/';
+    }
+    bool direct_child = slashes <= GROUP_DEPTH;
+
+    unsigned int count = atomic_load(&num_shards);
+    for (unsigned int i = 0; i < count && shard < 0; i++) {
+        if (ft_has_prefix(shards[i], group, direct_child)) shard = (int)i;
+    }
+
+    if (shard < 0) {
+        if (!create) return -1;
+        shard = (int)least_loaded_shard(count);
+    }
+
+    pthread_mutex_lock(&routes_lock);
+    if (routes) {
+        // Another writer may have routed the group meanwhile
+        gpointer existing = g_hash_table_lookup(routes, group);
+        if (existing) {
+            shard = (int)(intptr_t)existing - 1;
+        } else {
+            g_hash_table_insert(routes, g_strdup(group), (gpointer)(intptr_t)(shard + 1));
+        }
+    }
+    pthread_mutex_unlock(&routes_lock);
+    return shard;
+}
+
+// Returns the shard path belongs in, or -1 if it cannot be in any.
+static int get_shard_index(const char* path, bool create) {
+    if (shard_policy == FILE_TREE_SHARD_BY_DIRECTORY) {
+        return route_by_group(path, create);
+    }
+    return g_str_hash(path) % atomic_load(&num_shards);
+}
+
+static void reset_routes(void) {
+    pthread_mutex_lock(&routes_lock);
+    if (routes) g_hash_table_remove_all(routes);
+    pthread_mutex_unlock(&routes_lock);
+}
+
+static SurvivorCache* survivor_cache_new(const needle_info* needle, uint64_t epoch) {
+    SurvivorCache* cache = calloc(1, sizeof(SurvivorCache));
+    if (!cache) return NULL;
+
+    cache->needle = malloc((needle->len ? needle->len : 1) * sizeof(uint32_t));
+    if (!cache->needle) {
+        free(cache);
+        return NULL;
+    }
+    memcpy(cache->needle, needle->chars, needle->len * sizeof(uint32_t));
+    cache->needle_len = needle->len;
+    cache->epoch = epoch;
+    return cache;
+}
+
+static void survivor_cache_free(SurvivorCache* cache) {
+    if (!cache) return;
+    free(cache->needle);
+    free(cache->slots);
+    free(cache);
+}
+
+static inline void survivor_cache_push(SurvivorCache* cache, uint32_t slot) {
+    if (cache->failed) return;
+
+    if (cache->count >= cache->capacity) {
+        size_t new_cap = cache->capacity ? cache->capacity * 2 : 1024;
+        uint32_t* new_slots = realloc(cache->slots, new_cap * sizeof(uint32_t));
+        if (!new_slots) {
+            cache->failed = true;
+            return;
+        }
+        cache->slots = new_slots;
+        cache->capacity = new_cap;
+    }
+    cache->slots[cache->count++] = slot;
+}
+
+static bool survivor_cache_extends(const SurvivorCache* cache, const needle_info* needle, uint64_t epoch) {
+    return cache->epoch == epoch &&
+           needle->len >= cache->needle_len &&
+           memcmp(cache->needle, needle->chars, cache->needle_len * sizeof(uint32_t)) == 0;
+}
+
+static void drop_survivor_caches(void) {
+    atomic_fetch_add(&shard_epoch, 1);
+    for (unsigned int i = 0; i < MAX_SHARDS; i++) {
+        survivor_cache_free(atomic_exchange(&survivor_caches[i], NULL));
+    }
+}
+
+static void cleanup_locked(void) {
+    drop_survivor_caches();
+
+    if (shards != NULL) {
+        for (unsigned int i = 0; i < MAX_SHARDS; i++) {
+            if (shards[i] != NULL) {
+                ft_destroy(shards[i]);
+                shards[i] = NULL;
+            }
+        }
+        free(shards);
+        shards = NULL;
+    }
+    atomic_store(&num_shards, 0);
 
-static unsigned int get_shard_index(const char* path) {
-    return g_str_hash(path) % num_shards;
+    fs_unmap(mapped_snapshot);
+    mapped_snapshot = NULL;
+
+    pthread_mutex_lock(&directories_lock);
+    if (directories != NULL) {
+        g_hash_table_destroy(directories);
+        directories = NULL;
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    pthread_mutex_lock(&routes_lock);
+    if (routes != NULL) {
+        g_hash_table_destroy(routes);
+        routes = NULL;
+    }
+    pthread_mutex_unlock(&routes_lock);
 }
 
+// Takes effect at the next initialize.
+void file_tree_manager_set_shard_policy(FileTreeShardPolicy policy) {
+    atomic_store(&requested_policy, policy);
+}
+
+// One shard per online CPU lets a search use every core from the start;
+// the count then doubles as the corpus fills the shards.
+static int initial_shard_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > MAX_SHARDS ? MAX_SHARDS : (int)cpus;
+}
+
+// A count of 0 or less sizes the index automatically and keeps adapting
+// it; anything else is used as is for as long as the index lives.
 void file_tree_manager_initialize(int shard_count) {
-    num_shards = shard_count;
+    bool adaptive = shard_count <= 0;
+    if (adaptive) shard_count = initial_shard_count();
+    if (shard_count > MAX_SHARDS) shard_count = MAX_SHARDS;
+
+    pthread_rwlock_wrlock(&shards_lock);
+    cleanup_locked();
+
+    adaptive_shards = adaptive;
+    pinned_shards = adaptive ? 0 : (unsigned int)shard_count;
+    memset(balance_floor, 0, sizeof(balance_floor));
+
+    shard_policy = atomic_load(&requested_policy);
+
+    pthread_mutex_lock(&directories_lock);
+    directories = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pthread_mutex_unlock(&directories_lock);
+
+    pthread_mutex_lock(&routes_lock);
+    routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pthread_mutex_unlock(&routes_lock);
 
     shards = NULL;
     if (posix_memalign((void**)&shards, CACHE_LINE_SIZE,
-                     num_shards * sizeof(*shards)) != 0) {
+                     MAX_SHARDS * sizeof(*shards)) != 0) {
         fprintf(stderr, "Failed to allocate aligned memory for shards\n");
+        pthread_rwlock_unlock(&shards_lock);
         return;
     }
 
-    memset(shards, 0, num_shards * sizeof(*shards));
+    memset(shards, 0, MAX_SHARDS * sizeof(*shards));
 
-    for (int i = 0; i < num_shards; i++) {
+    for (int i = 0; i < shard_count; i++) {
         shards[i] = ft_create();
     }
+
+    atomic_store(&overflow_count, 0);
+    atomic_store(&num_shards, shard_count);
+    pthread_rwlock_unlock(&shards_lock);
+}
+
+typedef struct {
+    FileTable* target;
+    unsigned int modulus;
+    unsigned int keep;
+    FileTable* source;
+} ShardSplit;
+
+static bool split_moves(const ShardSplit* split, const char* path, uint32_t hash) {
+    if (shard_policy == FILE_TREE_SHARD_BY_DIRECTORY) {
+        return get_shard_index(path, false) != (int)split->keep;
+    }
+    return hash % split->modulus != split->keep;
+}
+
+static void split_copy_callback(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    ShardSplit* split = data;
+    if (split_moves(split, path, hash)) {
+        // The source is locked by the iteration, so its lane can be read
+        ft_insert_meta(split->target, path, &split->source->meta[slot]);
+    }
+}
+
+static bool split_moved_predicate(const FileEntry* entry, const char* path, void* data) {
+    return split_moves(data, path, entry->hash);
+}
+
+typedef struct {
+    char* group;
+    size_t count;
+} GroupSize;
+
+static void tally_group_callback(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    GHashTable* tally = data;
+    size_t len = group_length(path);
+    char group[len + 1];
+    memcpy(group, path, len);
+    group[len] = '\0';
+
+    gpointer count = g_hash_table_lookup(tally, group);
+    if (count) {
+        g_hash_table_replace(tally, g_strdup(group), (gpointer)((intptr_t)count + 1));
+    } else {
+        g_hash_table_insert(tally, g_strdup(group), (gpointer)(intptr_t)1);
+    }
+}
+
+static int compare_group_size(const void* a, const void* b) {
+    size_t ca = ((const GroupSize*)a)->count;
+    size_t cb = ((const GroupSize*)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+// Returns the groups of shard, largest first. Their names belong to
+// *tally, which the caller destroys after the groups.
+static GroupSize* tally_groups(unsigned int shard, GHashTable** tally, guint* n) {
+    *tally = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ft_iterate(shards[shard], tally_group_callback, *tally);
+
+    *n = g_hash_table_size(*tally);
+    GroupSize* groups = g_new(GroupSize, *n ? *n : 1);
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i = 0;
+
+    g_hash_table_iter_init(&iter, *tally);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        groups[i++] = (GroupSize){ key, (size_t)(intptr_t)value };
+    }
+    qsort(groups, *n, sizeof(GroupSize), compare_group_size);
+    return groups;
+}
+
+// Routes the groups of shard `keep` between it and its new sibling, largest
+// first onto whichever side holds fewer entries so far.
+static void balance_groups(unsigned int keep, unsigned int sibling) {
+    GHashTable* tally;
+    guint n;
+    GroupSize* groups = tally_groups(keep, &tally, &n);
+    guint i;
+
+    size_t kept = 0;
+    size_t moved = 0;
+
+    pthread_mutex_lock(&routes_lock);
+    for (i = 0; i < n; i++) {
+        unsigned int target = moved < kept ? sibling : keep;
+        if (target == keep) {
+            kept += groups[i].count;
+        } else {
+            moved += groups[i].count;
+        }
+        g_hash_table_replace(routes, g_strdup(groups[i].group), (gpointer)(intptr_t)(target + 1));
+    }
+    pthread_mutex_unlock(&routes_lock);
+
+    g_free(groups);
+    g_hash_table_destroy(tally);
+}
+
+// Doubles the shard count, splitting every shard into itself and one new
+// sibling. By hash: with h % n == i, h % 2n is either i or i + n. By
+// directory: the shard's groups are rebalanced between the two. Entries are
+// copied to the siblings before the new count is published and pruned
+// afterwards, so a concurrent search sees each file at least once;
+// duplicates share a hash and are collapsed by the result container.
+static void grow_shards(void) {
+    pthread_rwlock_wrlock(&shards_lock);
+
+    unsigned int old_count = atomic_load(&num_shards);
+    unsigned int new_count = old_count * 2;
+    if (new_count > MAX_SHARDS) {
+        pthread_rwlock_unlock(&shards_lock);
+        return;
+    }
+
+    for (unsigned int i = old_count; i < new_count; i++) {
+        shards[i] = ft_create();
+        if (!shards[i]) {
+            for (unsigned int j = old_count; j < i; j++) {
+                ft_destroy(shards[j]);
+                shards[j] = NULL;
+            }
+            pthread_rwlock_unlock(&shards_lock);
+            return;
+        }
+    }
+
+    for (unsigned int i = 0; i < old_count; i++) {
+        if (shard_policy == FILE_TREE_SHARD_BY_DIRECTORY) {
+            balance_groups(i, i + old_count);
+        }
+        ShardSplit split = { shards[i + old_count], new_count, i, shards[i] };
+        ft_iterate(shards[i], split_copy_callback, &split);
+    }
+
+    atomic_store(&num_shards, new_count);
+
+    for (unsigned int i = 0; i < old_count; i++) {
+        ShardSplit split = { NULL, new_count, i, NULL };
+        ft_remove_if(shards[i], split_moved_predicate, &split);
+    }
+    memset(balance_floor, 0, sizeof(balance_floor));
+
+    pthread_rwlock_unlock(&shards_lock);
+}
+
+// Moves groups off shard `from` onto the emptiest shard, largest first,
+// as long as each move leaves the larger of the two smaller than before.
+// Copied, then pruned, as when growing. Kept groups are routed too, since
+// deciding an unrouted group probes the shards, `from` included, whose
+// lock the copy and the prune hold.
+static void balance_shard(unsigned int from) {
+    pthread_rwlock_wrlock(&shards_lock);
+
+    unsigned int count = atomic_load(&num_shards);
+    if (from >= count || ft_size(shards[from]) <= balance_floor[from]) {
+        pthread_rwlock_unlock(&shards_lock);
+        return;
+    }
+
+    unsigned int to = least_loaded_shard(count);
+    size_t from_size = ft_size(shards[from]);
+    size_t to_size = ft_size(shards[to]);
+
+    GHashTable* tally;
+    guint n;
+    GroupSize* groups = tally_groups(from, &tally, &n);
+    size_t moved = 0;
+
+    pthread_mutex_lock(&routes_lock);
+    for (guint i = 0; i < n; i++) {
+        unsigned int target = from;
+        if (to != from && to_size + moved + groups[i].count < from_size - moved) {
+            moved += groups[i].count;
+            target = to;
+        }
+        g_hash_table_replace(routes, g_strdup(groups[i].group), (gpointer)(intptr_t)(target + 1));
+    }
+    pthread_mutex_unlock(&routes_lock);
+
+    g_free(groups);
+    g_hash_table_destroy(tally);
+
+    if (moved > 0) {
+        ShardSplit split = { shards[to], count, from, shards[from] };
+        ft_iterate(shards[from], split_copy_callback, &split);
+        ft_remove_if(shards[from], split_moved_predicate, &split);
+    }
+    balance_floor[from] = ft_size(shards[from]) * IMBALANCE_RATIO;
+
+    pthread_rwlock_unlock(&shards_lock);
+}
+
+typedef enum {
+    SHARDS_KEEP,
+    SHARDS_GROW,
+    SHARDS_BALANCE
+} ShardAction;
+
+// By hash a single full shard means the corpus has outgrown the shard
+// count. By directory one shard can hold a large group on its own, so only
+// grow once the shards are full on average, and otherwise spread the
+// groups of a shard that holds well over its share.
+static ShardAction shard_action(unsigned int shard, unsigned int count) {
+    size_t size = ft_size(shards[shard]);
+    if (!adaptive_shards || size <= TARGET_SHARD_SIZE) return SHARDS_KEEP;
+
+    bool can_grow = count * 2 <= MAX_SHARDS;
+    if (shard_policy == FILE_TREE_SHARD_BY_HASH) return can_grow ? SHARDS_GROW : SHARDS_KEEP;
+
+    size_t total = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        total += ft_size(shards[i]);
+    }
+    if (can_grow && total > (size_t)TARGET_SHARD_SIZE * count) return SHARDS_GROW;
+    if (size > balance_floor[shard] && size * count > total * IMBALANCE_RATIO) return SHARDS_BALANCE;
+    return SHARDS_KEEP;
+}
+
+// Called without shards_lock held.
+static void apply_shard_action(ShardAction action, unsigned int shard) {
+    if (action == SHARDS_GROW) {
+        grow_shards();
+    } else if (action == SHARDS_BALANCE) {
+        balance_shard(shard);
+    }
 }
 
 void file_tree_manager_add_file(const char* path) {
-    unsigned int shard_index = get_shard_index(path);
-    ft_insert(shards[shard_index], path);
+    pthread_rwlock_rdlock(&shards_lock);
+
+    unsigned int count = atomic_load(&num_shards);
+    unsigned int index = (unsigned int)get_shard_index(path, true);
+    ShardAction action = SHARDS_KEEP;
+
+    if (!ft_insert(shards[index], path)) {
+        if (atomic_fetch_add(&overflow_count, 1) == 0) {
+            fprintf(stderr, "File index is full, dropping %s\n", path);
+        }
+    } else {
+        action = shard_action(index, count);
+    }
+
+    pthread_rwlock_unlock(&shards_lock);
+
+    apply_shard_action(action, index);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+typedef struct {
+    const char* path;
+    uint8_t type;
+} TypedPath;
+
+static int compare_typed_paths(const void* a, const void* b) {
+    return strcmp(((const TypedPath*)a)->path, ((const TypedPath*)b)->path);
+}
+
+void file_tree_manager_add_batch(char* const* paths, size_t n) {
+    file_tree_manager_add_typed_batch(paths, NULL, n);
+}
+
+// Partitions paths by shard, then sorts each partition and merges it into
+// its shard in one pass, so a crawl or an event storm costs O(n log n)
+// instead of one index splice per path.
+void file_tree_manager_add_typed_batch(char* const* paths, const uint8_t* types, size_t n) {
+    if (n == 0) return;
+
+    int* shard_of = malloc(n * sizeof(int));
+    TypedPath* sorted = malloc(n * sizeof(TypedPath));
+    const char** part_paths = malloc(n * sizeof(const char*));
+    uint8_t* part_types = malloc(n);
+    if (!shard_of || !sorted || !part_paths || !part_types) {
+        free(shard_of);
+        free(sorted);
+        free(part_paths);
+        free(part_types);
+        for (size_t i = 0; i < n; i++) {
+            file_tree_manager_add_file(paths[i]);
+        }
+        return;
+    }
+
+    pthread_rwlock_rdlock(&shards_lock);
+
+    unsigned int count = atomic_load(&num_shards);
+    size_t starts[MAX_SHARDS + 1] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        shard_of[i] = get_shard_index(paths[i], true);
+        starts[shard_of[i] + 1]++;
+    }
+    for (unsigned int s = 0; s < count; s++) {
+        starts[s + 1] += starts[s];
+    }
+
+    size_t fill[MAX_SHARDS];
+    memcpy(fill, starts, count * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        sorted[fill[shard_of[i]]++] = (TypedPath){ paths[i], types ? types[i] : FT_TYPE_UNKNOWN };
+    }
+
+    ShardAction action = SHARDS_KEEP;
+    unsigned int action_shard = 0;
+    size_t dropped = 0;
+    for (unsigned int s = 0; s < count; s++) {
+        size_t len = starts[s + 1] - starts[s];
+        if (len == 0) continue;
+
+        TypedPath* part = sorted + starts[s];
+        qsort(part, len, sizeof(TypedPath), compare_typed_paths);
+        for (size_t i = 0; i < len; i++) {
+            part_paths[i] = part[i].path;
+            part_types[i] = part[i].type;
+        }
+
+        size_t indexed = ft_insert_batch(shards[s], part_paths, part_types, len);
+        if (indexed < len) {
+            dropped += len - indexed;
+        } else if (action != SHARDS_GROW) {
+            ShardAction wanted = shard_action(s, count);
+            if (wanted != SHARDS_KEEP) {
+                action = wanted;
+                action_shard = s;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&shards_lock);
+
+    if (dropped > 0 && atomic_fetch_add(&overflow_count, dropped) == 0) {
+        fprintf(stderr, "File index is full, dropping %zu paths\n", dropped);
+    }
+
+    free(shard_of);
+    free(sorted);
+    free(part_paths);
+    free(part_types);
+
+    apply_shard_action(action, action_shard);
 }
 
 void file_tree_manager_remove_file(const char* path) {
-    unsigned int shard_index = get_shard_index(path);
-    ft_remove(shards[shard_index], path);
+    pthread_rwlock_rdlock(&shards_lock);
+    int shard_index = get_shard_index(path, false);
+    if (shard_index >= 0) ft_remove(shards[shard_index], path);
+    pthread_rwlock_unlock(&shards_lock);
+
+    pthread_mutex_lock(&directories_lock);
+    if (directories) g_hash_table_remove(directories, path);
+    pthread_mutex_unlock(&directories_lock);
+}
+
+bool file_tree_manager_contains(const char* path) {
+    pthread_rwlock_rdlock(&shards_lock);
+    int shard_index = get_shard_index(path, false);
+    bool found = shard_index >= 0 && ft_contains(shards[shard_index], path);
+    pthread_rwlock_unlock(&shards_lock);
+    return found;
+}
+
+static gboolean directory_has_prefix(gpointer key, gpointer value, gpointer prefix) {
+    return g_str_has_prefix(key, prefix);
+}
+
+// Removes path and everything below it.
+void file_tree_manager_remove_subtree(const char* path) {
+    char* prefix = g_strconcat(path, "/", NULL);
+
+    pthread_rwlock_rdlock(&shards_lock);
+    unsigned int count = atomic_load(&num_shards);
+    int shard_index = get_shard_index(path, false);
+    if (shard_index >= 0) ft_remove(shards[shard_index], path);
+    for (unsigned int i = 0; i < count; i++) {
+        ft_remove_prefix(shards[i], prefix);
+    }
+    pthread_rwlock_unlock(&shards_lock);
+
+    pthread_mutex_lock(&directories_lock);
+    if (directories) {
+        g_hash_table_remove(directories, path);
+        g_hash_table_foreach_remove(directories, directory_has_prefix, prefix);
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    g_free(prefix);
+}
+
+static void collect_path_callback(const char* path, void* data) {
+    g_ptr_array_add((GPtrArray*)data, g_strdup(path));
+}
+
+// Removes paths in one pass per shard. Paths recorded as directories take
+// everything below them along, like file_tree_manager_remove_subtree.
+void file_tree_manager_remove_batch(char* const* paths, size_t n) {
+    if (n == 0) return;
+
+    GPtrArray* subtrees = g_ptr_array_new();
+    pthread_mutex_lock(&directories_lock);
+    if (directories) {
+        for (size_t i = 0; i < n; i++) {
+            if (g_hash_table_contains(directories, paths[i])) g_ptr_array_add(subtrees, paths[i]);
+        }
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    for (guint i = 0; i < subtrees->len; i++) {
+        file_tree_manager_remove_subtree(g_ptr_array_index(subtrees, i));
+    }
+    g_ptr_array_free(subtrees, TRUE);
+
+    int* shard_of = malloc(n * sizeof(int));
+    const char** sorted = malloc(n * sizeof(const char*));
+    if (!shard_of || !sorted) {
+        free(shard_of);
+        free(sorted);
+        for (size_t i = 0; i < n; i++) {
+            file_tree_manager_remove_file(paths[i]);
+        }
+        return;
+    }
+
+    pthread_rwlock_rdlock(&shards_lock);
+
+    unsigned int count = atomic_load(&num_shards);
+    size_t starts[MAX_SHARDS + 1] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        shard_of[i] = get_shard_index(paths[i], false);
+        if (shard_of[i] >= 0) starts[shard_of[i] + 1]++;
+    }
+    for (unsigned int s = 0; s < count; s++) {
+        starts[s + 1] += starts[s];
+    }
+
+    size_t fill[MAX_SHARDS];
+    memcpy(fill, starts, count * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        if (shard_of[i] >= 0) sorted[fill[shard_of[i]]++] = paths[i];
+    }
+
+    for (unsigned int s = 0; s < count; s++) {
+        size_t len = starts[s + 1] - starts[s];
+        if (len == 0) continue;
+
+        const char** part = sorted + starts[s];
+        qsort(part, len, sizeof(const char*), compare_paths);
+        ft_remove_batch(shards[s], part, len);
+    }
+
+    pthread_rwlock_unlock(&shards_lock);
+
+    free(shard_of);
+    free(sorted);
+}
+
+typedef struct {
+    GPtrArray* paths;
+    size_t from_len;
+    const char* to;
+} RenameContext;
+
+static void collect_renamed_callback(const char* path, void* data) {
+    RenameContext* ctx = data;
+    g_ptr_array_add(ctx->paths, g_strconcat(ctx->to, path + ctx->from_len, NULL));
+}
+
+typedef struct {
+    GHashTable* moved;
+    const char* prefix;
+} RenameDirectoriesContext;
+
+static void collect_renamed_directory(gpointer key, gpointer value, gpointer data) {
+    RenameDirectoriesContext* ctx = data;
+    if (g_str_has_prefix(key, ctx->prefix)) g_hash_table_insert(ctx->moved, g_strdup(key), value);
+}
+
+// Moves everything indexed at or below from to the same place below to,
+// keeping the recorded directory mtimes so a later reconcile does not
+// list the moved directories again. Returns the moved directories under
+// their new names, or NULL if nothing was indexed under from.
+char** file_tree_manager_rename_subtree(const char* from, const char* to) {
+    size_t from_len = strlen(from);
+    char* prefix = g_strconcat(from, "/", NULL);
+    RenameContext ctx = { g_ptr_array_new_with_free_func(g_free), from_len, to };
+
+    pthread_rwlock_rdlock(&shards_lock);
+    unsigned int count = atomic_load(&num_shards);
+    int shard_index = get_shard_index(from, false);
+    if (shard_index >= 0 && ft_contains(shards[shard_index], from)) {
+        g_ptr_array_add(ctx.paths, g_strdup(to));
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        ft_iterate_prefix(shards[i], prefix, collect_renamed_callback, &ctx);
+    }
+    pthread_rwlock_unlock(&shards_lock);
+
+    if (ctx.paths->len == 0) {
+        g_ptr_array_free(ctx.paths, TRUE);
+        g_free(prefix);
+        return NULL;
+    }
+
+    GHashTable* moved = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pthread_mutex_lock(&directories_lock);
+    if (directories) {
+        RenameDirectoriesContext dirs = { moved, prefix };
+        g_hash_table_foreach(directories, collect_renamed_directory, &dirs);
+        gpointer mtime;
+        if (g_hash_table_lookup_extended(directories, from, NULL, &mtime)) {
+            g_hash_table_insert(moved, g_strdup(from), mtime);
+        }
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    file_tree_manager_remove_subtree(from);
+    file_tree_manager_add_batch((char* const*)ctx.paths->pdata, ctx.paths->len);
+
+    GPtrArray* renamed = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, moved);
+    pthread_mutex_lock(&directories_lock);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        char* path = g_strconcat(to, (const char*)key + from_len, NULL);
+        if (directories) g_hash_table_replace(directories, g_strdup(path), value);
+        g_ptr_array_add(renamed, path);
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    g_hash_table_destroy(moved);
+    g_ptr_array_free(ctx.paths, TRUE);
+    g_free(prefix);
+
+    g_ptr_array_add(renamed, NULL);
+    return (char**)g_ptr_array_free(renamed, FALSE);
 }
 
-#define PACK_USER_DATA(i, hash) ( \
-    ((uint64_t)(hash) & 0xFFFFFFFF) | \
-    (((uint64_t)(i) & 0xFFFF) << 32) \
+// Returns the indexed direct children of path as a NULL-terminated vector.
+char** file_tree_manager_list_children(const char* path) {
+    GPtrArray* children = g_ptr_array_new();
+    char* prefix = g_strconcat(path, "/", NULL);
+
+    pthread_rwlock_rdlock(&shards_lock);
+    unsigned int count = atomic_load(&num_shards);
+    for (unsigned int i = 0; i < count; i++) {
+        ft_iterate_children(shards[i], prefix, collect_path_callback, children);
+    }
+    pthread_rwlock_unlock(&shards_lock);
+
+    g_free(prefix);
+    g_ptr_array_add(children, NULL);
+    return (char**)g_ptr_array_free(children, FALSE);
+}
+
+static bool stat_directory(const char* path, int64_t* mtime) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+void file_tree_manager_record_directory_mtime(const char* path, int64_t mtime) {
+    pthread_mutex_lock(&directories_lock);
+    if (directories) g_hash_table_replace(directories, g_strdup(path), (gpointer)(intptr_t)mtime);
+    pthread_mutex_unlock(&directories_lock);
+}
+
+// Stats path and remembers its mtime if it is a directory. Returns whether
+// it is one, so the caller needs no separate test.
+bool file_tree_manager_record_directory(const char* path) {
+    int64_t mtime;
+    if (!stat_directory(path, &mtime)) return false;
+
+    file_tree_manager_record_directory_mtime(path, mtime);
+    return true;
+}
+
+FileTreeDirectoryState file_tree_manager_check_directory(const char* path) {
+    int64_t mtime;
+    if (!stat_directory(path, &mtime)) {
+        pthread_mutex_lock(&directories_lock);
+        if (directories) g_hash_table_remove(directories, path);
+        pthread_mutex_unlock(&directories_lock);
+        return FILE_TREE_DIRECTORY_GONE;
+    }
+
+    gpointer recorded = NULL;
+    bool known = false;
+    pthread_mutex_lock(&directories_lock);
+    if (directories) {
+        known = g_hash_table_lookup_extended(directories, path, NULL, &recorded);
+        g_hash_table_replace(directories, g_strdup(path), (gpointer)(intptr_t)mtime);
+    }
+    pthread_mutex_unlock(&directories_lock);
+
+    return known && (int64_t)(intptr_t)recorded == mtime
+        ? FILE_TREE_DIRECTORY_UNCHANGED
+        : FILE_TREE_DIRECTORY_CHANGED;
+}
+
+bool file_tree_manager_has_directory(const char* path) {
+    pthread_mutex_lock(&directories_lock);
+    bool known = directories && g_hash_table_contains(directories, path);
+    pthread_mutex_unlock(&directories_lock);
+    return known;
+}
+
+char** file_tree_manager_get_directories(void) {
+    pthread_mutex_lock(&directories_lock);
+    if (!directories) {
+        pthread_mutex_unlock(&directories_lock);
+        return g_new0(char*, 1);
+    }
+    guint length = 0;
+    char** keys = (char**)g_hash_table_get_keys_as_array(directories, &length);
+    char** result = g_new(char*, length + 1);
+    for (guint i = 0; i < length; i++) {
+        result[i] = g_strdup(keys[i]);
+    }
+    result[length] = NULL;
+    g_free(keys);
+    pthread_mutex_unlock(&directories_lock);
+    return result;
+}
+
+static void load_directory_callback(const char* path, int64_t mtime, void* data) {
+    g_hash_table_replace((GHashTable*)data, g_strdup(path), (gpointer)(intptr_t)mtime);
+}
+
+// Shards are laid out by the sharding policy, so a snapshot only applies
+// under the policy it was written with, and only under the same pinned
+// shard count; an adaptive index takes whatever count it had reached.
+static uint32_t snapshot_config_hash(uint32_t config_hash) {
+    return config_hash ^ ((uint32_t)shard_policy * 0x9E3779B9u) ^ (pinned_shards * 0x85EBCA6Bu);
+}
+
+// Replaces the (freshly initialized) index with the tables of a snapshot.
+// The shards are built on the mapping in place; nothing is copied until a
+// shard is first modified.
+bool file_tree_manager_load_snapshot(const char* path, uint32_t config_hash) {
+    FileSnapshot* snapshot = fs_map(path, snapshot_config_hash(config_hash));
+    if (!snapshot) return false;
+
+    unsigned int count = fs_shard_count(snapshot);
+    if (count > MAX_SHARDS) {
+        fs_unmap(snapshot);
+        return false;
+    }
+
+    FileTable* loaded[MAX_SHARDS] = { 0 };
+    for (unsigned int i = 0; i < count; i++) {
+        FileTableImage image;
+        if (!fs_shard_image(snapshot, i, &image) ||
+            !(loaded[i] = ft_create_from_image(&image))) {
+            for (unsigned int j = 0; j < i; j++) {
+                ft_destroy(loaded[j]);
+            }
+            fs_unmap(snapshot);
+            return false;
+        }
+    }
+
+    pthread_rwlock_wrlock(&shards_lock);
+    if (shards == NULL) {
+        pthread_rwlock_unlock(&shards_lock);
+        for (unsigned int i = 0; i < count; i++) {
+            ft_destroy(loaded[i]);
+        }
+        fs_unmap(snapshot);
+        return false;
+    }
+
+    drop_survivor_caches();
+    reset_routes();
+    for (unsigned int i = 0; i < MAX_SHARDS; i++) {
+        ft_destroy(shards[i]);
+        shards[i] = loaded[i];
+    }
+    atomic_store(&num_shards, count);
+    memset(balance_floor, 0, sizeof(balance_floor));
+
+    fs_unmap(mapped_snapshot);
+    mapped_snapshot = snapshot;
+    pthread_rwlock_unlock(&shards_lock);
+
+    pthread_mutex_lock(&directories_lock);
+    g_hash_table_remove_all(directories);
+    fs_iterate_directories(snapshot, load_directory_callback, directories);
+    pthread_mutex_unlock(&directories_lock);
+
+    return true;
+}
+
+bool file_tree_manager_save_snapshot(const char* path, uint32_t config_hash) {
+    pthread_mutex_lock(&snapshot_lock);
+    pthread_rwlock_rdlock(&shards_lock);
+
+    bool ok = false;
+    if (shards != NULL) {
+        pthread_mutex_lock(&directories_lock);
+        ok = fs_write(path, snapshot_config_hash(config_hash), shards, atomic_load(&num_shards), directories);
+        pthread_mutex_unlock(&directories_lock);
+    }
+
+    pthread_rwlock_unlock(&shards_lock);
+    pthread_mutex_unlock(&snapshot_lock);
+    return ok;
+}
+
+// Changes whenever any shard is modified; used to skip redundant snapshots.
+uint64_t file_tree_manager_get_version(void) {
+    pthread_rwlock_rdlock(&shards_lock);
+    unsigned int count = atomic_load(&num_shards);
+    uint64_t version = count;
+    for (unsigned int i = 0; i < count; i++) {
+        version += ft_version(shards[i]);
+    }
+    pthread_rwlock_unlock(&shards_lock);
+    return version;
+}
+
+unsigned int file_tree_manager_get_shard_count(void) {
+    return atomic_load(&num_shards);
+}
+
+size_t file_tree_manager_get_omitted_count(void) {
+    size_t total = 0;
+    unsigned int count = atomic_load(&num_shards);
+    for (unsigned int i = 0; i < count; i++) {
+        total += atomic_load_explicit(&omitted_results[i], memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t file_tree_manager_get_overflow_count(void) {
+    return atomic_load(&overflow_count);
+}
+
+// Bits 0-7:   shard      (8 bits)
+// Bits 8-34:  slot       (27 bits)
+// Bits 35-50: generation (16 bits)
+// 51 bits in total, the factory user data budget of result-container.h
+
+#define PACK_USER_DATA(shard, slot, generation) ( \
+    ((uint64_t)(shard) & 0xFF) | \
+    (((uint64_t)(slot) & (FT_MAX_SLOTS - 1)) << 8) | \
+    (((uint64_t)(generation) & 0xFFFF) << (8 + FT_SLOT_BITS)) \
 )
 
-#define UNPACK_HASH(x)      ((uint32_t)((x)))
-#define UNPACK_I(x)         ((uint16_t)(((x) >> 32) & 0xFFFF))
+#define UNPACK_SHARD(x)      ((uint8_t)((x) & 0xFF))
+#define UNPACK_SLOT(x)       ((uint32_t)(((x) >> 8) & (FT_MAX_SLOTS - 1)))
+#define UNPACK_GENERATION(x) ((uint16_t)(((x) >> (8 + FT_SLOT_BITS)) & 0xFFFF))
+
+// Only this many matches per shard reach the result container; the UI
+// shows a fraction of that, and the rest would only add merge work
+#define SHARD_TOP_K 128
+
+typedef struct {
+    score_t score;
+    uint16_t generation;
+    uint32_t hash;
+    uint32_t slot;
+} ScoredEntry;
+
+typedef struct {
+    ResultContainer* rs;
+    unsigned int shard_id;
+    SurvivorCache* survivors;
+    float now;
+    // Min-heap on score of the best SHARD_TOP_K matches so far
+    ScoredEntry top[SHARD_TOP_K];
+    size_t top_count;
+    size_t omitted;
+} ShardIterContext;
+
+// Defined in file-search-plugin.vala; reports launches to the frecency table
+BobLauncherFileMatch* bob_launcher_indexed_file_match_new(const gchar* path, FileEntryType file_type,
+                                                          FileMimeClass mime_class, gint64 mtime);
 
 static inline BobLauncherMatch* custom_factory_func(void *user_data) {
     uint64_t shifted_back = ((uint64_t)user_data >> 4);
 
-    uint32_t wanted_hsh   = UNPACK_HASH(shifted_back);
-    uint16_t i        = UNPACK_I(shifted_back);
-    uint8_t shard_id  = wanted_hsh % num_shards;
+    uint8_t shard_id    = UNPACK_SHARD(shifted_back);
+    uint32_t slot       = UNPACK_SLOT(shifted_back);
+    uint16_t generation = UNPACK_GENERATION(shifted_back);
 
-    const char *resolved_path =
-        ft_lookup_by_index(shards[shard_id], i);
+    // A snapshot load or cleanup may have replaced the shards since the
+    // search, so they are only touched under the lock
+    FileMeta meta;
+    pthread_rwlock_rdlock(&shards_lock);
+    char *resolved_path = shards && shard_id < atomic_load(&num_shards)
+        ? ft_lookup_by_slot(shards[shard_id], slot, generation, &meta)
+        : NULL;
+    pthread_rwlock_unlock(&shards_lock);
 
+    // The entry was removed between scoring and materialisation
     if (!resolved_path)
         return (BobLauncherMatch*)bob_launcher_file_match_new_from_path("/");
 
-    uint32_t found_hsh = g_str_hash(resolved_path);
-
-    if (found_hsh != wanted_hsh)
-        return (BobLauncherMatch*)bob_launcher_file_match_new_from_path("/");
+    // One lstat the first time an entry is shown, instead of a query_info
+    // every time its row is drawn
+    struct stat st;
+    if (!(meta.flags & FT_META_STAT) && lstat(resolved_path, &st) == 0) {
+        meta.size = (uint64_t)st.st_size;
+        meta.mtime = st.st_mtime > 0 ? (uint32_t)st.st_mtime : 0;
+        meta.flags |= FT_META_STAT;
+        if (meta.type == FT_TYPE_UNKNOWN) {
+            meta.type = S_ISDIR(st.st_mode) ? FT_TYPE_DIRECTORY
+                      : S_ISLNK(st.st_mode) ? FT_TYPE_SYMLINK
+                      : FT_TYPE_FILE;
+        }
+        pthread_rwlock_rdlock(&shards_lock);
+        if (shards && shard_id < atomic_load(&num_shards)) {
+            ft_set_stat(shards[shard_id], slot, generation, meta.size, meta.mtime);
+        }
+        pthread_rwlock_unlock(&shards_lock);
+    }
 
-    BobLauncherMatch* match = (BobLauncherMatch*)bob_launcher_file_match_new_from_path(resolved_path);
+    BobLauncherMatch* match = (BobLauncherMatch*)bob_launcher_indexed_file_match_new(
+        resolved_path, meta.type, meta.mime_class, (meta.flags & FT_META_STAT) ? (gint64)meta.mtime : 0);
     free(resolved_path);
 
     return match;
 }
 
-static void shard_iter_callback(uint16_t i, const char* path, uint32_t hash, void* data) {
-    score_t score = result_container_match_score(((ResultContainer*)data), path);
+static void top_sift_down(ScoredEntry* heap, size_t count, size_t i) {
+    ScoredEntry entry = heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && heap[child + 1].score < heap[child].score) child++;
+        if (heap[child].score >= entry.score) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = entry;
+}
+
+static void top_push(ShardIterContext* ctx, ScoredEntry entry) {
+    ScoredEntry* heap = ctx->top;
+
+    if (ctx->top_count < SHARD_TOP_K) {
+        size_t i = ctx->top_count++;
+        while (i > 0 && heap[(i - 1) / 2].score > entry.score) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = entry;
+        return;
+    }
+
+    ctx->omitted++;
+    if (entry.score <= heap[0].score) return;
+    heap[0] = entry;
+    top_sift_down(heap, SHARD_TOP_K, 0);
+}
+
+static void shard_iter_callback(uint32_t slot, uint16_t generation, const char* path, uint32_t hash, void* data) {
+    ShardIterContext* ctx = data;
+    score_t score = result_container_match_score(ctx->rs, path);
+    if (score > SCORE_MIN && ctx->survivors) {
+        survivor_cache_push(ctx->survivors, slot);
+    }
     if (score > SCORE_THRESHOLD) {
+        int boosted = score + file_frecency_bonus(hash, ctx->now);
+        ScoredEntry entry = { boosted > SCORE_MAX ? SCORE_MAX : (score_t)boosted, generation, hash, slot };
+        top_push(ctx, entry);
+    }
+}
+
+static void emit_top(ShardIterContext* ctx) {
+    for (size_t i = 0; i < ctx->top_count; i++) {
+        const ScoredEntry* entry = &ctx->top[i];
         result_container_add_lazy(
-            ((ResultContainer*)data),
-            hash,
-            score,
+            ctx->rs,
+            entry->hash,
+            entry->score,
             custom_factory_func,
-            (void*)(PACK_USER_DATA(i, hash) << 4),
+            (void*)(PACK_USER_DATA(ctx->shard_id, entry->slot, entry->generation) << 4),
             NULL
         );
     }
+    atomic_store_explicit(&omitted_results[ctx->shard_id], ctx->omitted, memory_order_relaxed);
 }
 
+// Holds shards_lock for reading while scanning, so a snapshot load cannot
+// free the table or unmap its pages underneath.
 void file_tree_manager_tree_manager_shard(ResultContainer* rs, unsigned int shard_id) {
-    if (shard_id >= num_shards) return;
-    ft_iterate(shards[shard_id], shard_iter_callback, rs);
+    pthread_rwlock_rdlock(&shards_lock);
+    if (!shards || shard_id >= atomic_load(&num_shards)) {
+        pthread_rwlock_unlock(&shards_lock);
+        return;
+    }
+    FileTable* table = shards[shard_id];
+    needle_info* needle = rs->string_info;
+    ShardIterContext ctx = { .rs = rs, .shard_id = shard_id, .now = file_frecency_now() };
+
+    // Paths missing a character of the query can never score, and neither
+    // can paths whose directory lacks the query's leading components or
+    // that hold its characters out of order, so all of them are rejected
+    // without running the scorer
+    char leading[MAX_LEADING_COMPONENTS];
+    char ordered[MAX_LEADING_COMPONENTS];
+    FileQuery query = { 0 };
+    if (needle) {
+        query.mask = fp_needle_mask(needle->chars, needle->len);
+        query.dir_len = fp_leading_components(needle->chars, needle->len, leading, sizeof(leading));
+        query.dir_chars = leading;
+        query.path_len = fp_ordered_chars(needle->chars, needle->len, ordered, sizeof(ordered));
+        query.path_chars = ordered;
+    }
+
+    if (!needle) {
+        ft_iterate_filtered(table, &query, shard_iter_callback, &ctx);
+        pthread_rwlock_unlock(&shards_lock);
+        emit_top(&ctx);
+        return;
+    }
+
+    // Taking the cache out of its slot keeps concurrent searches of the
+    // same shard from sharing it; the loser simply does a full scan
+    uint64_t epoch = atomic_load(&shard_epoch);
+    SurvivorCache* previous = atomic_exchange(&survivor_caches[shard_id], NULL);
+    ctx.survivors = survivor_cache_new(needle, epoch);
+
+    if (ctx.survivors && previous && survivor_cache_extends(previous, needle, epoch) &&
+        ft_iterate_slots(table, previous->version, previous->slots, previous->count,
+                         &query, shard_iter_callback, &ctx)) {
+        ctx.survivors->version = previous->version;
+    } else {
+        uint64_t version = ft_iterate_filtered(table, &query, shard_iter_callback, &ctx);
+        if (ctx.survivors) ctx.survivors->version = version;
+    }
+    pthread_rwlock_unlock(&shards_lock);
+    survivor_cache_free(previous);
+    emit_top(&ctx);
+
+    if (ctx.survivors && ctx.survivors->failed) {
+        survivor_cache_free(ctx.survivors);
+        return;
+    }
+    survivor_cache_free(atomic_exchange(&survivor_caches[shard_id], ctx.survivors));
 }
 
 void file_tree_manager_cleanup(void) {
-    if (shards != NULL) {
-        for (unsigned int i = 0; i < num_shards; i++) {
-            if (shards[i] != NULL) {
-                ft_destroy(shards[i]);
-                shards[i] = NULL;
-            }
-        }
-        free(shards);
-        shards = NULL;
-    }
+    pthread_rwlock_wrlock(&shards_lock);
+    cleanup_locked();
+    pthread_rwlock_unlock(&shards_lock);
 }
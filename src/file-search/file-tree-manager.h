@@ -3,10 +3,45 @@
 
 #include "bob-launcher.h" // Include for ResultContainer definition
 
+typedef enum {
+    FILE_TREE_DIRECTORY_UNCHANGED,
+    FILE_TREE_DIRECTORY_CHANGED,
+    FILE_TREE_DIRECTORY_GONE
+} FileTreeDirectoryState;
+
+typedef enum {
+    FILE_TREE_SHARD_BY_HASH,
+    FILE_TREE_SHARD_BY_DIRECTORY
+} FileTreeShardPolicy;
+
+void file_tree_manager_set_shard_policy(FileTreeShardPolicy policy);
+// 0 or less sizes the index by CPU count and corpus and keeps adapting it.
 void file_tree_manager_initialize(int shards);
 void file_tree_manager_add_file(const gchar* path);
+void file_tree_manager_add_batch(gchar* const* paths, size_t n);
+// types holds a FileEntryType per path, as the crawler saw it, or is NULL.
+void file_tree_manager_add_typed_batch(gchar* const* paths, const uint8_t* types, size_t n);
 void file_tree_manager_remove_file(const gchar* path);
+void file_tree_manager_remove_subtree(const gchar* path);
+void file_tree_manager_remove_batch(gchar* const* paths, size_t n);
+gchar** file_tree_manager_rename_subtree(const gchar* from, const gchar* to);
+bool file_tree_manager_contains(const gchar* path);
+gchar** file_tree_manager_list_children(const gchar* path);
 void file_tree_manager_tree_manager_shard(ResultContainer* rs, uint shard_id);
+unsigned int file_tree_manager_get_shard_count(void);
+size_t file_tree_manager_get_overflow_count(void);
+// Matches the last search of each shard scored but did not emit, summed.
+size_t file_tree_manager_get_omitted_count(void);
+uint64_t file_tree_manager_get_version(void);
+bool file_tree_manager_record_directory(const gchar* path);
+// For callers that already hold the directory open and have its mtime.
+void file_tree_manager_record_directory_mtime(const gchar* path, int64_t mtime);
+FileTreeDirectoryState file_tree_manager_check_directory(const gchar* path);
+// Whether path was entered by a crawl, i.e. its children are indexed.
+bool file_tree_manager_has_directory(const gchar* path);
+gchar** file_tree_manager_get_directories(void);
+bool file_tree_manager_load_snapshot(const gchar* path, uint32_t config_hash);
+bool file_tree_manager_save_snapshot(const gchar* path, uint32_t config_hash);
 void file_tree_manager_cleanup(void);
 
 #endif // FILE_TREE_MANAGER_H